@@ -20,6 +20,14 @@
 #include "compat_user.h"
 #define param_act(t, s, f) xtables_param_act((t), "ipp2p", (s), (f))
 
+enum {
+	FLAG_CT_MASK    = 1 << 16,
+	FLAG_CT_PACKETS = 1 << 17,
+	FLAGS_CT        = FLAG_CT_MASK | FLAG_CT_PACKETS,
+
+	DEFAULT_CT_PACKETS = 10,
+};
+
 static void ipp2p_mt_help(void)
 {
 	printf(
@@ -37,7 +45,12 @@ static void ipp2p_mt_help(void)
 	"  --mute   [tcp]      All known Mute packets\n"
 	"  --waste  [tcp]      All known Waste packets\n"
 	"  --xdcc   [tcp]      All known XDCC packets (only xdcc login)\n\n"
-	, IPP2P_VERSION);
+	"Verdict caching:\n"
+	"  --ct-mask mask      Keep the verdict on each connection in these\n"
+	"                      connmark bits, and match later packets by it\n"
+	"  --ct-packets n      Give up on connections after n packets with\n"
+	"                      payload did not match (default %u)\n\n"
+	, IPP2P_VERSION, DEFAULT_CT_PACKETS);
 }
 
 static const struct option ipp2p_mt_opts[] = {
@@ -54,6 +67,8 @@ static const struct option ipp2p_mt_opts[] = {
 	{.name = "waste", .has_arg = false, .val = 'h'},
 	{.name = "xdcc",  .has_arg = false, .val = 'i'},
 	{.name = "debug", .has_arg = false, .val = 'j'},
+	{.name = "ct-mask",    .has_arg = true, .val = 'k'},
+	{.name = "ct-packets", .has_arg = true, .val = 'l'},
 	{NULL},
 };
 
@@ -165,6 +180,24 @@ static int ipp2p_mt_parse(int c, char **argv, int invert, unsigned int *flags,
 		info->debug = 1;
 		break;
 
+	case 'k':		/*cmd: ct-mask*/
+		param_act(XTF_ONLY_ONCE, "--ct-mask", *flags & FLAG_CT_MASK);
+		param_act(XTF_NO_INVERT, "--ct-mask", invert);
+		if (!xtables_strtoui(optarg, NULL, &info->ct_mask, 1, ~0U))
+			param_act(XTF_BAD_VALUE, "--ct-mask", optarg);
+		if (info->ct_packets == 0)
+			info->ct_packets = DEFAULT_CT_PACKETS;
+		*flags |= FLAG_CT_MASK;
+		break;
+
+	case 'l':		/*cmd: ct-packets*/
+		param_act(XTF_ONLY_ONCE, "--ct-packets", *flags & FLAG_CT_PACKETS);
+		param_act(XTF_NO_INVERT, "--ct-packets", invert);
+		if (!xtables_strtoui(optarg, NULL, &info->ct_packets, 1, ~0U))
+			param_act(XTF_BAD_VALUE, "--ct-packets", optarg);
+		*flags |= FLAG_CT_PACKETS;
+		break;
+
 	default:
 //		xtables_error(PARAMETER_PROBLEM,
 //		"\nipp2p-parameter problem: for ipp2p usage type: iptables -m ipp2p --help\n");
@@ -173,11 +206,25 @@ static int ipp2p_mt_parse(int c, char **argv, int invert, unsigned int *flags,
 	return 1;
 }
 
+/* Revision 1 has room for the protocols and --debug only. */
+static int ipp2p_mt_parse_v1(int c, char **argv, int invert,
+    unsigned int *flags, const void *entry, struct xt_entry_match **match)
+{
+	if (c == 'k' || c == 'l')
+		xtables_error(PARAMETER_PROBLEM,
+			"ipp2p: --ct-mask and --ct-packets need a newer "
+			"xt_ipp2p kernel module");
+	return ipp2p_mt_parse(c, argv, invert, flags, entry, match);
+}
+
 static void ipp2p_mt_check(unsigned int flags)
 {
-	if (!flags)
+	if (!(flags & ~FLAGS_CT))
 		xtables_error(PARAMETER_PROBLEM,
 			"\nipp2p-parameter problem: for ipp2p usage type: iptables -m ipp2p --help\n");
+	if ((flags & FLAGS_CT) == FLAG_CT_PACKETS)
+		xtables_error(PARAMETER_PROBLEM,
+			"ipp2p: --ct-packets needs --ct-mask");
 }
 
 static const char *const ipp2p_cmds[] = {
@@ -199,11 +246,8 @@ static const char *const ipp2p_cmds[] = {
 	[IPP2N_XDCC]       = "--xdcc",
 };
 
-static void
-ipp2p_mt_print1(const void *entry, const struct xt_entry_match *match,
-               int numeric)
+static void ipp2p_mt_print1(const struct ipt_p2p_info *info)
 {
-	const struct ipt_p2p_info *info = (const void *)match->data;
 	unsigned int i;
 
 	for (i = IPP2N_EDK; i <= IPP2N_XDCC; ++i)
@@ -212,36 +256,75 @@ ipp2p_mt_print1(const void *entry, const struct xt_entry_match *match,
 
 	if (info->debug != 0)
 		printf(" --debug ");
+	if (info->ct_mask != 0)
+		printf(" --ct-mask 0x%x --ct-packets %u ",
+		       info->ct_mask, info->ct_packets);
 }
 
 static void ipp2p_mt_print(const void *entry,
     const struct xt_entry_match *match, int numeric)
 {
 	printf(" ipp2p ");
-	ipp2p_mt_print1(entry, match, true);
+	ipp2p_mt_print1((const void *)match->data);
 }
 
 static void ipp2p_mt_save(const void *entry, const struct xt_entry_match *match)
 {
-	ipp2p_mt_print1(entry, match, true);
+	ipp2p_mt_print1((const void *)match->data);
+}
+
+static void ipp2p_mt_print_v1(const void *entry,
+    const struct xt_entry_match *match, int numeric)
+{
+	const struct ipt_p2p_info_v1 *old = (const void *)match->data;
+	struct ipt_p2p_info info = {.cmd = old->cmd, .debug = old->debug};
+
+	printf(" ipp2p ");
+	ipp2p_mt_print1(&info);
+}
+
+static void
+ipp2p_mt_save_v1(const void *entry, const struct xt_entry_match *match)
+{
+	const struct ipt_p2p_info_v1 *old = (const void *)match->data;
+	struct ipt_p2p_info info = {.cmd = old->cmd, .debug = old->debug};
+
+	ipp2p_mt_print1(&info);
 }
 
-static struct xtables_match ipp2p_mt_reg = {
-	.version       = XTABLES_VERSION,
-	.name          = "ipp2p",
-	.revision      = 1,
-	.family        = NFPROTO_IPV4,
-	.size          = XT_ALIGN(sizeof(struct ipt_p2p_info)),
-	.userspacesize = XT_ALIGN(sizeof(struct ipt_p2p_info)),
-	.help          = ipp2p_mt_help,
-	.parse         = ipp2p_mt_parse,
-	.final_check   = ipp2p_mt_check,
-	.print         = ipp2p_mt_print,
-	.save          = ipp2p_mt_save,
-	.extra_opts    = ipp2p_mt_opts,
+static struct xtables_match ipp2p_mt_reg[] = {
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "ipp2p",
+		.revision      = 1,
+		.family        = NFPROTO_UNSPEC,
+		.size          = XT_ALIGN(sizeof(struct ipt_p2p_info_v1)),
+		.userspacesize = XT_ALIGN(sizeof(struct ipt_p2p_info_v1)),
+		.help          = ipp2p_mt_help,
+		.parse         = ipp2p_mt_parse_v1,
+		.final_check   = ipp2p_mt_check,
+		.print         = ipp2p_mt_print_v1,
+		.save          = ipp2p_mt_save_v1,
+		.extra_opts    = ipp2p_mt_opts,
+	},
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "ipp2p",
+		.revision      = 2,
+		.family        = NFPROTO_UNSPEC,
+		.size          = XT_ALIGN(sizeof(struct ipt_p2p_info)),
+		.userspacesize = XT_ALIGN(sizeof(struct ipt_p2p_info)),
+		.help          = ipp2p_mt_help,
+		.parse         = ipp2p_mt_parse,
+		.final_check   = ipp2p_mt_check,
+		.print         = ipp2p_mt_print,
+		.save          = ipp2p_mt_save,
+		.extra_opts    = ipp2p_mt_opts,
+	},
 };
 
 static __attribute__((constructor)) void ipp2p_mt_ldr(void)
 {
-	xtables_register_match(&ipp2p_mt_reg);
+	xtables_register_matches(ipp2p_mt_reg,
+		sizeof(ipp2p_mt_reg) / sizeof(*ipp2p_mt_reg));
 }
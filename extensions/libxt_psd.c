@@ -37,7 +37,9 @@ static void psd_mt_help(void) {
 		" --psd-weight-threshold threshhold  Portscan detection weight threshold\n"
 		" --psd-delay-threshold  delay       Portscan detection delay threshold\n"
 		" --psd-lo-ports-weight  lo          Privileged ports weight\n"
-		" --psd-hi-ports-weight  hi          High ports weight\n\n");
+		" --psd-hi-ports-weight  hi          High ports weight\n"
+		" --psd-ipv6-prefix-len  len         Track IPv6 sources by prefix\n"
+		" --psd-notify                       Send netlink events for new scanners\n\n");
 }
 
 static const struct option psd_mt_opts[] = {
@@ -45,6 +47,8 @@ static const struct option psd_mt_opts[] = {
 	{.name = "psd-delay-threshold", .has_arg = true, .val = '2'},
 	{.name = "psd-lo-ports-weight", .has_arg = true, .val = '3'},
 	{.name = "psd-hi-ports-weight", .has_arg = true, .val = '4'},
+	{.name = "psd-ipv6-prefix-len", .has_arg = true, .val = '5'},
+	{.name = "psd-notify", .has_arg = false, .val = '6'},
 	{NULL}
 };
 
@@ -61,6 +65,8 @@ static void psd_mt_init(struct xt_entry_match *match) {
 #define XT_PSD_OPT_DTRESH 0x02
 #define XT_PSD_OPT_LPWEIGHT 0x04
 #define XT_PSD_OPT_HPWEIGHT 0x08
+#define XT_PSD_OPT_PREFIX 0x10
+#define XT_PSD_OPT_NOTIFY 0x20
 
 static int psd_mt_parse(int c, char **argv, int invert, unsigned int *flags,
                      const void *entry, struct xt_entry_match **match)
@@ -108,52 +114,139 @@ static int psd_mt_parse(int c, char **argv, int invert, unsigned int *flags,
 			psdinfo->hi_ports_weight = num;
 			*flags |= XT_PSD_OPT_HPWEIGHT;
 			return true;
+
+		/* PSD-ipv6-prefix-len */
+		case '5':
+			if (*flags & XT_PSD_OPT_PREFIX)
+				xtables_error(PARAMETER_PROBLEM, "Can't specify --psd-ipv6-prefix-len twice");
+			if (!xtables_strtoui(optarg, NULL, &num, 1, 128))
+				xtables_error(PARAMETER_PROBLEM, "bad --psd-ipv6-prefix-len '%s'", optarg);
+			psdinfo->ipv6_prefix = num;
+			*flags |= XT_PSD_OPT_PREFIX;
+			return true;
+
+		/* PSD-notify */
+		case '6':
+			if (*flags & XT_PSD_OPT_NOTIFY)
+				xtables_error(PARAMETER_PROBLEM, "Can't specify --psd-notify twice");
+			psdinfo->flags |= XT_PSD_NOTIFY;
+			*flags |= XT_PSD_OPT_NOTIFY;
+			return true;
 	}
 	return false;
 }
 
+/* Revision 1 has no room for --psd-ipv6-prefix-len and --psd-notify. */
+static int psd_mt_parse_v1(int c, char **argv, int invert, unsigned int *flags,
+                     const void *entry, struct xt_entry_match **match)
+{
+	if (c == '5' || c == '6')
+		xtables_error(PARAMETER_PROBLEM,
+			"--psd-ipv6-prefix-len and --psd-notify need a newer "
+			"xt_psd kernel module");
+	return psd_mt_parse(c, argv, invert, flags, entry, match);
+}
+
 /* Final check; nothing. */
 static void psd_mt_final_check(unsigned int flags) {}
 
 /* Prints out the targinfo. */
-static void psd_mt_print(const void *ip, const struct xt_entry_match *match, int numeric)
+static void psd_mt_print_info(const struct xt_psd_info *psdinfo)
 {
-	const struct xt_psd_info *psdinfo = (const struct xt_psd_info *)match->data;
 	printf(" psd ");
 	printf("weight-threshold: %u ", psdinfo->weight_threshold);
 	printf("delay-threshold: %u ", psdinfo->delay_threshold);
 	printf("lo-ports-weight: %u ", psdinfo->lo_ports_weight);
 	printf("hi-ports-weight: %u ", psdinfo->hi_ports_weight);
+	if (psdinfo->ipv6_prefix != 0)
+		printf("ipv6-prefix-len: %u ", psdinfo->ipv6_prefix);
+	if (psdinfo->flags & XT_PSD_NOTIFY)
+		printf("notify ");
 }
 
 /* Saves the union ipt_targinfo in parsable form to stdout. */
-static void psd_mt_save(const void *ip, const struct xt_entry_match *match)
+static void psd_mt_save_info(const struct xt_psd_info *psdinfo)
 {
-	const struct xt_psd_info *psdinfo = (const struct xt_psd_info *)match->data;
 	printf(" --psd-weight-threshold %u ", psdinfo->weight_threshold);
 	printf("--psd-delay-threshold %u ", psdinfo->delay_threshold);
 	printf("--psd-lo-ports-weight %u ", psdinfo->lo_ports_weight);
 	printf("--psd-hi-ports-weight %u ", psdinfo->hi_ports_weight);
+	if (psdinfo->ipv6_prefix != 0)
+		printf("--psd-ipv6-prefix-len %u ", psdinfo->ipv6_prefix);
+	if (psdinfo->flags & XT_PSD_NOTIFY)
+		printf("--psd-notify ");
+}
+
+static void psd_mt_print(const void *ip, const struct xt_entry_match *match, int numeric)
+{
+	psd_mt_print_info((const struct xt_psd_info *)match->data);
+}
+
+static void psd_mt_save(const void *ip, const struct xt_entry_match *match)
+{
+	psd_mt_save_info((const struct xt_psd_info *)match->data);
+}
+
+/* Revision 1 rules are shown as revision 2 ones with the new fields 0. */
+static void psd_mt_from_v1(struct xt_psd_info *psdinfo,
+                           const struct xt_entry_match *match)
+{
+	memset(psdinfo, 0, sizeof(*psdinfo));
+	memcpy(psdinfo, match->data, sizeof(struct xt_psd_info_v1));
+}
+
+static void psd_mt_print_v1(const void *ip, const struct xt_entry_match *match, int numeric)
+{
+	struct xt_psd_info psdinfo;
+
+	psd_mt_from_v1(&psdinfo, match);
+	psd_mt_print_info(&psdinfo);
+}
+
+static void psd_mt_save_v1(const void *ip, const struct xt_entry_match *match)
+{
+	struct xt_psd_info psdinfo;
+
+	psd_mt_from_v1(&psdinfo, match);
+	psd_mt_save_info(&psdinfo);
 }
 
-static struct xtables_match psd_mt_reg = {
-	.name			= "psd",
-	.version		= XTABLES_VERSION,
-	.revision   	= 1,
-	.family        = NFPROTO_IPV4,
-	.size			= XT_ALIGN(sizeof(struct xt_psd_info)),
-	.userspacesize	= XT_ALIGN(sizeof(struct xt_psd_info)),
-	.help			= psd_mt_help,
-	.init			= psd_mt_init,
-	.parse			= psd_mt_parse,
-	.final_check	= psd_mt_final_check,
-	.print			= psd_mt_print,
-	.save			= psd_mt_save,
-	.extra_opts		= psd_mt_opts,
+static struct xtables_match psd_mt_reg[] = {
+	{
+		.name			= "psd",
+		.version		= XTABLES_VERSION,
+		.revision   	= 1,
+		.family        = NFPROTO_IPV4,
+		.size			= XT_ALIGN(sizeof(struct xt_psd_info_v1)),
+		.userspacesize	= XT_ALIGN(sizeof(struct xt_psd_info_v1)),
+		.help			= psd_mt_help,
+		.init			= psd_mt_init,
+		.parse			= psd_mt_parse_v1,
+		.final_check	= psd_mt_final_check,
+		.print			= psd_mt_print_v1,
+		.save			= psd_mt_save_v1,
+		.extra_opts		= psd_mt_opts,
+	},
+	{
+		.name			= "psd",
+		.version		= XTABLES_VERSION,
+		.revision   	= 2,
+		.family        = NFPROTO_UNSPEC,
+		.size			= XT_ALIGN(sizeof(struct xt_psd_info)),
+		.userspacesize	= XT_ALIGN(sizeof(struct xt_psd_info)),
+		.help			= psd_mt_help,
+		.init			= psd_mt_init,
+		.parse			= psd_mt_parse,
+		.final_check	= psd_mt_final_check,
+		.print			= psd_mt_print,
+		.save			= psd_mt_save,
+		.extra_opts		= psd_mt_opts,
+	},
 };
 
 static __attribute__((constructor)) void psd_mt_ldr(void)
 {
-	xtables_register_match(&psd_mt_reg);
+	xtables_register_matches(psd_mt_reg,
+		sizeof(psd_mt_reg) / sizeof(*psd_mt_reg));
 }
 
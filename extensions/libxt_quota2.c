@@ -10,6 +10,7 @@
  */
 #include <getopt.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +24,11 @@ enum {
 	FL_GROW      = 1 << 2,
 	FL_PACKET    = 1 << 3,
 	FL_NO_CHANGE = 1 << 4,
+	FL_RESET     = 1 << 5,
+	FL_WINDOW    = 1 << 6,
+	FL_BUCKETS   = 1 << 7,
+	FL_NOTIFY    = 1 << 8,
+	FL_PARENT    = 1 << 9,
 };
 
 static const struct option quota_mt2_opts[] = {
@@ -31,6 +37,11 @@ static const struct option quota_mt2_opts[] = {
 	{.name = "name",      .has_arg = true,  .val = 'n'},
 	{.name = "quota",     .has_arg = true,  .val = 'q'},
 	{.name = "packets",   .has_arg = false, .val = 'p'},
+	{.name = "reset-interval", .has_arg = true, .val = 'r'},
+	{.name = "window",    .has_arg = true,  .val = 'w'},
+	{.name = "buckets",   .has_arg = true,  .val = 'b'},
+	{.name = "notify",    .has_arg = true,  .val = 'N'},
+	{.name = "parent",    .has_arg = true,  .val = 'P'},
 	{NULL},
 };
 
@@ -43,14 +54,52 @@ static void quota_mt2_help(void)
 	"    --name name      name for the file in sysfs\n"
 	"[!] --quota quota    initial quota (bytes or packets)\n"
 	"    --packets        count packets instead of bytes\n"
+	"    --reset-interval secs  restore the initial quota every secs seconds\n"
+	"    --window secs    only count what passed in the last secs seconds\n"
+	"    --buckets n      number of sub-intervals in the window (default: 10)\n"
+	"    --notify value[,value...]\n"
+	"                     send a netlink event when the counter falls to or\n"
+	"                     below (with --grow: reaches) one of these values\n"
+	"    --parent name    also charge the (existing) counter name\n"
 	);
 }
 
+static void
+quota_mt2_check_window(const struct xt_quota_mtinfo2 *info, unsigned int flags)
+{
+	/* Every bucket must span at least one second. */
+	if ((flags & FL_WINDOW) && (flags & FL_BUCKETS) &&
+	    info->buckets > info->interval)
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--buckets must not exceed --window seconds");
+}
+
+static void
+quota_mt2_parse_notify(struct xt_quota_mtinfo2 *info, const char *arg)
+{
+	unsigned long long value;
+	char *end;
+
+	for (;;) {
+		if (info->nthresh >= XT_QUOTA_MAX_NOTIFY)
+			xtables_error(PARAMETER_PROBLEM, "quota match: "
+			           "at most %u --notify values allowed",
+			           XT_QUOTA_MAX_NOTIFY);
+		value = strtoull(arg, &end, 0);
+		if (end == arg || (*end != '\0' && *end != ','))
+			xtables_param_act(XTF_BAD_VALUE, "quota", "--notify", arg);
+		info->thresh[info->nthresh++] = value;
+		if (*end == '\0')
+			break;
+		arg = end + 1;
+	}
+}
+
 static int
-quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
-	        const void *entry, struct xt_entry_match **match)
+quota_mt2_parse_info(int c, int invert, unsigned int *flags,
+                     struct xt_quota_mtinfo2 *info)
 {
-	struct xt_quota_mtinfo2 *info = (void *)(*match)->data;
+	unsigned int num;
 	char *end;
 
 	switch (c) {
@@ -89,15 +138,122 @@ quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
 			           "invalid value for --quota");
 		*flags |= FL_QUOTA;
 		return true;
+	case 'r':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--reset-interval", *flags & FL_RESET);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--reset-interval", invert);
+		if (!xtables_strtoui(optarg, NULL, &num, 1, UINT32_MAX))
+			xtables_param_act(XTF_BAD_VALUE, "quota", "--reset-interval", optarg);
+		info->interval = num;
+		*flags |= FL_RESET;
+		return true;
+	case 'w':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--window", *flags & FL_WINDOW);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--window", invert);
+		if (!xtables_strtoui(optarg, NULL, &num, 1, UINT32_MAX))
+			xtables_param_act(XTF_BAD_VALUE, "quota", "--window", optarg);
+		info->interval = num;
+		if (!(*flags & FL_BUCKETS))
+			info->buckets = (num < 10) ? num : 10;
+		*flags |= FL_WINDOW;
+		quota_mt2_check_window(info, *flags);
+		return true;
+	case 'b':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--buckets", *flags & FL_BUCKETS);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--buckets", invert);
+		if (!xtables_strtoui(optarg, NULL, &num, 1, XT_QUOTA_MAX_BUCKETS))
+			xtables_param_act(XTF_BAD_VALUE, "quota", "--buckets", optarg);
+		info->buckets = num;
+		*flags |= FL_BUCKETS;
+		quota_mt2_check_window(info, *flags);
+		return true;
+	case 'N':
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--notify", *flags & FL_NOTIFY);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--notify", invert);
+		quota_mt2_parse_notify(info, optarg);
+		*flags |= FL_NOTIFY;
+		return true;
+	case 'P':
+		/* zero termination done on behalf of the kernel module */
+		xtables_param_act(XTF_ONLY_ONCE, "quota", "--parent", *flags & FL_PARENT);
+		xtables_param_act(XTF_NO_INVERT, "quota", "--parent", invert);
+		strncpy(info->parent, optarg, sizeof(info->parent));
+		*flags |= FL_PARENT;
+		return true;
 	}
 	return false;
 }
 
+static int
+quota_mt2_parse(int c, char **argv, int invert, unsigned int *flags,
+	        const void *entry, struct xt_entry_match **match)
+{
+	return quota_mt2_parse_info(c, invert, flags, (void *)(*match)->data);
+}
+
+/* Revision 3 knows only what it has fields for. */
 static void
-quota_mt2_save(const void *ip, const struct xt_entry_match *match)
+quota_mt2_from_v3(struct xt_quota_mtinfo2 *info,
+                  const struct xt_quota_mtinfo2_v3 *old)
+{
+	memset(info, 0, sizeof(*info));
+	memcpy(info->name, old->name, sizeof(info->name));
+	info->flags = old->flags;
+	info->quota = old->quota;
+}
+
+static int
+quota_mt2_v3_parse(int c, char **argv, int invert, unsigned int *flags,
+                   const void *entry, struct xt_entry_match **match)
+{
+	struct xt_quota_mtinfo2_v3 *old = (void *)(*match)->data;
+	struct xt_quota_mtinfo2 info;
+	int ret;
+
+	switch (c) {
+	case 'r':
+	case 'w':
+	case 'b':
+	case 'N':
+	case 'P':
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--reset-interval, --window, --buckets, --notify "
+		           "and --parent need a newer xt_quota2 kernel module");
+	}
+	quota_mt2_from_v3(&info, old);
+	ret = quota_mt2_parse_info(c, invert, flags, &info);
+	memcpy(old->name, info.name, sizeof(old->name));
+	old->flags = info.flags;
+	old->quota = info.quota;
+	return ret;
+}
+
+static void quota_mt2_check(unsigned int flags)
 {
-	const struct xt_quota_mtinfo2 *q = (void *)match->data;
+	if ((flags & FL_RESET) && (flags & (FL_WINDOW | FL_BUCKETS)))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--reset-interval cannot be used with --window");
+	if ((flags & FL_BUCKETS) && !(flags & FL_WINDOW))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--buckets requires --window");
+	if ((flags & FL_NOTIFY) && !(flags & FL_NAME))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--notify requires --name");
+	if ((flags & FL_PARENT) && !(flags & FL_NAME))
+		xtables_error(PARAMETER_PROBLEM, "quota match: "
+		           "--parent requires --name");
+}
+
+static void quota_mt2_print_notify(const struct xt_quota_mtinfo2 *q)
+{
+	unsigned int i;
+
+	for (i = 0; i < q->nthresh; ++i)
+		printf("%s%llu", (i == 0) ? "" : ",",
+		       (unsigned long long)q->thresh[i]);
+}
 
+static void quota_mt2_save_info(const struct xt_quota_mtinfo2 *q)
+{
 	if (q->flags & XT_QUOTA_INVERT)
 		printf(" !");
 	if (q->flags & XT_QUOTA_GROW)
@@ -108,14 +264,38 @@ quota_mt2_save(const void *ip, const struct xt_entry_match *match)
 		printf(" --packets ");
 	if (*q->name != '\0')
 		printf(" --name %s ", q->name);
+	if (*q->parent != '\0')
+		printf(" --parent %s ", q->parent);
 	printf(" --quota %llu ", (unsigned long long)q->quota);
+	if (q->buckets != 0)
+		printf(" --window %u --buckets %u ",
+		       (unsigned int)q->interval, (unsigned int)q->buckets);
+	else if (q->interval != 0)
+		printf(" --reset-interval %u ", (unsigned int)q->interval);
+	if (q->nthresh != 0) {
+		printf(" --notify ");
+		quota_mt2_print_notify(q);
+		printf(" ");
+	}
 }
 
-static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
-                            int numeric)
+static void
+quota_mt2_save(const void *ip, const struct xt_entry_match *match)
 {
-	const struct xt_quota_mtinfo2 *q = (const void *)match->data;
+	quota_mt2_save_info((const void *)match->data);
+}
 
+static void
+quota_mt2_v3_save(const void *ip, const struct xt_entry_match *match)
+{
+	struct xt_quota_mtinfo2 info;
+
+	quota_mt2_from_v3(&info, (const void *)match->data);
+	quota_mt2_save_info(&info);
+}
+
+static void quota_mt2_print_info(const struct xt_quota_mtinfo2 *q)
+{
 	if (q->flags & XT_QUOTA_INVERT)
 		printf(" !");
 	if (q->flags & XT_QUOTA_GROW)
@@ -124,6 +304,8 @@ static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
 		printf(" quota");
 	if (*q->name != '\0')
 		printf(" %s:", q->name);
+	if (*q->parent != '\0')
+		printf(" (in %s)", q->parent);
 	printf(" %llu ", (unsigned long long)q->quota);
 	if (q->flags & XT_QUOTA_PACKET)
 		printf("packets ");
@@ -131,23 +313,67 @@ static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
 		printf("bytes ");
 	if (q->flags & XT_QUOTA_NO_CHANGE)
 		printf("(no-change mode) ");
+	if (q->buckets != 0)
+		printf("window %us/%u ", (unsigned int)q->interval,
+		       (unsigned int)q->buckets);
+	else if (q->interval != 0)
+		printf("reset every %us ", (unsigned int)q->interval);
+	if (q->nthresh != 0) {
+		printf("notify ");
+		quota_mt2_print_notify(q);
+		printf(" ");
+	}
+}
+
+static void quota_mt2_print(const void *ip, const struct xt_entry_match *match,
+                            int numeric)
+{
+	quota_mt2_print_info((const void *)match->data);
+}
+
+static void
+quota_mt2_v3_print(const void *ip, const struct xt_entry_match *match,
+                   int numeric)
+{
+	struct xt_quota_mtinfo2 info;
+
+	quota_mt2_from_v3(&info, (const void *)match->data);
+	quota_mt2_print_info(&info);
 }
 
-static struct xtables_match quota_mt2_reg = {
-	.family        = NFPROTO_UNSPEC,
-	.revision      = 3,
-	.name          = "quota2",
-	.version       = XTABLES_VERSION,
-	.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2)),
-	.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
-	.help          = quota_mt2_help,
-	.parse         = quota_mt2_parse,
-	.print         = quota_mt2_print,
-	.save          = quota_mt2_save,
-	.extra_opts    = quota_mt2_opts,
+static struct xtables_match quota_mt2_reg[] = {
+	{
+		.family        = NFPROTO_UNSPEC,
+		.revision      = 3,
+		.name          = "quota2",
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2_v3)),
+		.userspacesize = offsetof(struct xt_quota_mtinfo2_v3, quota),
+		.help          = quota_mt2_help,
+		.parse         = quota_mt2_v3_parse,
+		.final_check   = quota_mt2_check,
+		.print         = quota_mt2_v3_print,
+		.save          = quota_mt2_v3_save,
+		.extra_opts    = quota_mt2_opts,
+	},
+	{
+		.family        = NFPROTO_UNSPEC,
+		.revision      = 4,
+		.name          = "quota2",
+		.version       = XTABLES_VERSION,
+		.size          = XT_ALIGN(sizeof (struct xt_quota_mtinfo2)),
+		.userspacesize = offsetof(struct xt_quota_mtinfo2, quota),
+		.help          = quota_mt2_help,
+		.parse         = quota_mt2_parse,
+		.final_check   = quota_mt2_check,
+		.print         = quota_mt2_print,
+		.save          = quota_mt2_save,
+		.extra_opts    = quota_mt2_opts,
+	},
 };
 
 static __attribute__((constructor)) void quota2_mt_ldr(void)
 {
-	xtables_register_match(&quota_mt2_reg);
+	xtables_register_matches(quota_mt2_reg,
+		sizeof(quota_mt2_reg) / sizeof(*quota_mt2_reg));
 }
@@ -1,4 +1,19 @@
+/*
+ * Receives xt_pknock notifications and prints them, or hands them to a
+ * handler program, one line per peer: "<rule> <ip>".
+ *
+ * The module sends its notifications in batches. They are drained with
+ * recvmmsg into large buffers, so that mass reconnects do not overflow
+ * the socket.
+ *
+ * This program is released under the terms of GNU GPL version 2.
+ */
+#define _GNU_SOURCE 1
 #include <sys/socket.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,85 +22,216 @@
 #include <arpa/inet.h>
 #include <linux/netlink.h>
 #include <linux/connector.h>
+#include <linux/netfilter.h>
 
 #include "xt_pknock.h"
 
-#define GROUP 1
+#ifndef SOL_NETLINK
+#	define SOL_NETLINK 270
+#endif
 
-static struct sockaddr_nl src_addr, dest_addr;
-static int sock_fd;
+enum {
+	DEFAULT_GROUP   = 1,
+	DEFAULT_RCVBUF  = 4 << 20,
+	/* datagrams per recvmmsg call, and room for each */
+	RECV_VLEN       = 32,
+	RECV_SIZE       = 16384,
+};
 
-static unsigned char *buf;
+static unsigned long long recv_batches, recv_events, kernel_dropped;
+static unsigned long long overruns;
 
-static struct xt_pknock_nl_msg *nlmsg;
-
-int main(void)
+static void pknlusr_usage(const char *name)
 {
-	socklen_t addrlen;
-	int status;
-	int group = GROUP;
-
-	int buf_size;
-
-	const char *ip;
-	char ipbuf[48];
+	fprintf(stderr,
+"Usage: %s [-g group] [-b rcvbuf] [-x handler]\n"
+"  -g group    netlink multicast group (module parameter nl_multicast_group;\n"
+"              default %d)\n"
+"  -b rcvbuf   socket receive buffer in bytes (default %d)\n"
+"  -x handler  start handler and feed it one line per event on stdin,\n"
+"              instead of printing them\n",
+	        name, DEFAULT_GROUP, DEFAULT_RCVBUF);
+}
 
-	sock_fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
+static int pknlusr_socket(int group, int rcvbuf)
+{
+	struct sockaddr_nl addr;
+	int fd;
 
-	if (sock_fd == -1) {
+	fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
+	if (fd < 0) {
 		perror("socket()");
-		return 1;
+		return -1;
 	}
 
-	memset(&src_addr, 0, sizeof(src_addr));
-	src_addr.nl_family = AF_NETLINK;
-	src_addr.nl_pid = getpid();
-	src_addr.nl_groups = group;
-
-	status = bind(sock_fd, (struct sockaddr*)&src_addr, sizeof(src_addr));
-
-	if (status == -1) {
-		close(sock_fd);
+	/* Going past rmem_max needs CAP_NET_ADMIN; try anyway. */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+	    &rcvbuf, sizeof(rcvbuf)) < 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+	    &rcvbuf, sizeof(rcvbuf)) < 0)
+		perror("setsockopt(SO_RCVBUF)");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid    = 0;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		perror("bind()");
-		return 1;
+		close(fd);
+		return -1;
 	}
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+	    &group, sizeof(group)) < 0) {
+		perror("setsockopt(NETLINK_ADD_MEMBERSHIP)");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-	memset(&dest_addr, 0, sizeof(dest_addr));
-	dest_addr.nl_family = AF_NETLINK;
-	dest_addr.nl_pid = 0;
-	dest_addr.nl_groups = group;
-
-	buf_size = sizeof(struct xt_pknock_nl_msg) + sizeof(struct cn_msg) + sizeof(struct nlmsghdr);
-	buf = malloc(buf_size);
+static void pknlusr_event(FILE *out, const struct xt_pknock_nl_msg *msg)
+{
+	char ipbuf[INET6_ADDRSTRLEN];
+	char rule_name[sizeof(msg->rule_name)];
+	const char *ip;
 
-	if (!buf) {
-		perror("malloc()");
-		return 1;
-	}
+	memcpy(rule_name, msg->rule_name, sizeof(rule_name));
+	rule_name[sizeof(rule_name)-1] = '\0';
 
-	addrlen = sizeof(dest_addr);
+	if (msg->family == NFPROTO_IPV6)
+		ip = inet_ntop(AF_INET6, msg->peer_ip6, ipbuf, sizeof(ipbuf));
+	else
+		ip = inet_ntop(AF_INET, &msg->peer_ip, ipbuf, sizeof(ipbuf));
+	if (ip == NULL)
+		return;
 
-	while(1) {
+	fprintf(out, "%s %s\n", rule_name, ip);
+	++recv_events;
+}
 
-		memset(buf, 0, buf_size);
+/*
+ * One datagram holds one netlink message from the connector, which holds
+ * a batch of records.
+ */
+static void pknlusr_datagram(FILE *out, const void *buf, size_t len)
+{
+	const struct nlmsghdr *nlh;
+	const struct cn_msg *cn;
+	const struct xt_pknock_nl_msg *msg;
+	unsigned int count, i;
+
+	for (nlh = buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type != NLMSG_DONE)
+			continue;
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*cn)))
+			continue;
+		cn = NLMSG_DATA(nlh);
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*cn) + cn->len))
+			continue;
+
+		if (cn->ack != 0) {
+			fprintf(stderr, "pknlusr: kernel dropped %u events\n",
+			        cn->ack);
+			kernel_dropped += cn->ack;
+		}
+		++recv_batches;
+		msg   = (const void *)cn->data;
+		count = cn->len / sizeof(*msg);
+		for (i = 0; i < count; ++i)
+			pknlusr_event(out, &msg[i]);
+	}
+}
 
-		status = recvfrom(sock_fd, buf, buf_size, 0, (struct sockaddr *)&dest_addr, &addrlen);
+static int pknlusr_loop(int fd, FILE *out)
+{
+	static unsigned char buf[RECV_VLEN][RECV_SIZE];
+	struct mmsghdr msgs[RECV_VLEN];
+	struct iovec iov[RECV_VLEN];
+	unsigned int i;
+	int n;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RECV_VLEN; ++i) {
+		iov[i].iov_base            = buf[i];
+		iov[i].iov_len             = sizeof(buf[i]);
+		msgs[i].msg_hdr.msg_iov    = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-		if (status <= 0) {
-			perror("recvfrom()");
+	while (true) {
+		n = recvmmsg(fd, msgs, RECV_VLEN, MSG_WAITFORONE, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* The socket overflowed; events were lost. */
+				fprintf(stderr, "pknlusr: receive buffer "
+				        "overrun, events lost\n");
+				++overruns;
+				continue;
+			}
+			perror("recvmmsg()");
+			return 1;
+		}
+		for (i = 0; i < (unsigned int)n; ++i)
+			pknlusr_datagram(out, buf[i], msgs[i].msg_len);
+		if (fflush(out) != 0) {
+			perror("write");
 			return 1;
 		}
+	}
+	return 0;
+}
 
-	nlmsg = (struct xt_pknock_nl_msg *) (buf + sizeof(struct cn_msg) + sizeof(struct nlmsghdr));
+int main(int argc, char **argv)
+{
+	const char *handler = NULL;
+	int group = DEFAULT_GROUP, rcvbuf = DEFAULT_RCVBUF;
+	FILE *out = stdout;
+	int c, fd, ret;
+
+	while ((c = getopt(argc, argv, "b:g:hx:")) != -1) {
+		switch (c) {
+		case 'b':
+			rcvbuf = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			group = strtol(optarg, NULL, 0);
+			break;
+		case 'x':
+			handler = optarg;
+			break;
+		default:
+			pknlusr_usage(*argv);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (group <= 0) {
+		fprintf(stderr, "pknlusr: group must be positive\n");
+		return 1;
+	}
 
-		ip = inet_ntop(AF_INET, &nlmsg->peer_ip, ipbuf, sizeof(ipbuf));
-		printf("rule_name: %s - ip %s\n", nlmsg->rule_name, ip);
+	fd = pknlusr_socket(group, rcvbuf);
+	if (fd < 0)
+		return 1;
 
+	if (handler != NULL) {
+		/* A handler that dies should end us, not kill us silently. */
+		signal(SIGPIPE, SIG_IGN);
+		out = popen(handler, "w");
+		if (out == NULL) {
+			perror("popen()");
+			close(fd);
+			return 1;
+		}
 	}
 
-	close(sock_fd);
+	ret = pknlusr_loop(fd, out);
 
-	free(buf);
-
-	return 0;
+	fprintf(stderr, "pknlusr: %llu events in %llu batches, %llu dropped "
+	        "by the kernel, %llu overruns\n", recv_events, recv_batches,
+	        kernel_dropped, overruns);
+	if (handler != NULL)
+		pclose(out);
+	close(fd);
+	return ret;
 }
@@ -11,10 +11,13 @@
 #include <linux/version.h>
 #include <linux/skbuff.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/in.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
 #include <linux/jhash.h>
@@ -27,8 +30,12 @@
 #include <linux/timer.h>
 #include <linux/seq_file.h>
 #include <linux/connector.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include <linux/netfilter/x_tables.h>
+#include <net/ipv6.h>
 #include "xt_pknock.h"
 #include "compat_xtables.h"
 
@@ -36,6 +43,15 @@
 #	define PK_CRYPTO 1
 #endif
 
+enum {
+	PK_DIGEST_OPEN = 0,
+	PK_DIGEST_CLOSE,
+	PK_DIGEST_MAX,
+
+	/* large enough for hmac(sha256) */
+	PK_DIGEST_SIZE = 32,
+};
+
 enum status {
 	ST_INIT = 1,
 	ST_MATCHING,
@@ -43,39 +59,93 @@ enum status {
 };
 
 /**
+ * @addr:	source address; IPv4 addresses leave the rest of it zeroed
  * @timestamp:	seconds, but not since epoch (uses jiffies/HZ)
  * @login_sec: seconds at login since the epoch
+ * @digest_min:	minute since the epoch that @digest was computed for
+ * @digest_valid: bitmask of the PK_DIGEST_* entries of @digest in use
+ *
+ * Peers are looked up under RCU. Changes to a peer, and adding it to or
+ * removing it from the table, happen under the rule's lock.
+ * A peer is linked into its table through head[table->ver]; the other
+ * head is used to link it into the next table while the table is resized.
  */
 struct peer {
-	struct list_head head;
-	__be32 ip;
+	struct list_head head[2];
+	struct rcu_head rcu;
+	union nf_inet_addr addr;
+	uint8_t family;
 	uint32_t accepted_knock_count;
 	unsigned long timestamp;
 	unsigned long login_sec;
 	enum status status;
 	uint8_t proto;
+#ifdef PK_CRYPTO
+	uint8_t digest_valid;
+	unsigned long digest_min;
+	unsigned char digest[PK_DIGEST_MAX][PK_DIGEST_SIZE];
+#endif
+};
+
+/**
+ * @ver:	index of the peers' list heads used by this table
+ */
+struct peer_table {
+	unsigned int size;
+	unsigned int ver;
+	struct list_head head[0];
 };
 
 /**
+ * @lock:	protects the peer table and state changes of the peers
+ * @gc_bucket:	bucket the next garbage collector batch starts at
+ * @peers:	peer hash table, replaced by resize_work as the rule's load
+ *		changes
+ * @peer_count:	peers in @peers
+ * @resizing:	resize_work is pending or running
+ * @nl_batch:	notifications not sent yet, or NULL if they are disabled
+ * @nl_dropped:	notifications lost since the last batch that went out
+ * @nl_timer:	sends @nl_batch when it does not fill up soon enough
  * @timer:	garbage collector timer
  * @max_time:	max matching time between ports
+ * @tfm:	transforms keyed with the open and close secret; only used
+ *		with @lock held, as they keep their state in the tfm
+ * @secret:	the secrets @tfm is keyed with
+ *
+ * Rules are looked up under RCU, and added or removed with rule_mutex held.
  */
 struct xt_pknock_rule {
 	struct list_head head;
+	spinlock_t lock;
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	int rule_name_len;
 	unsigned int ref_count;
 	struct timer_list timer;
-	struct list_head *peer_head;
+	unsigned int gc_bucket;
+	struct peer_table *peers;
+	unsigned int peer_count;
+	bool resizing;
+	struct work_struct resize_work;
+	struct cn_msg *nl_batch;
+	unsigned int nl_dropped;
+	struct timer_list nl_timer;
 	struct proc_dir_entry *status_proc;
 	unsigned long max_time;
 	unsigned long autoclose_time;
+#ifdef PK_CRYPTO
+	struct crypto_hash *tfm[PK_DIGEST_MAX];
+	char secret[PK_DIGEST_MAX][XT_PKNOCK_MAX_PASSWD_LEN+1];
+	unsigned int secret_len[PK_DIGEST_MAX];
+#endif
 };
 
 /**
  * @port:	destination port
+ * @saddr:	source address, zero-padded for IPv4
  */
 struct transport_data {
+	union nf_inet_addr saddr;
+	uint8_t family;
 	uint8_t proto;
 	uint16_t port;
 	int payload_len;
@@ -86,42 +156,54 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("J. Federico Hernandez Scarso, Luis A. Floreani");
 MODULE_DESCRIPTION("netfilter match for Port Knocking and SPA");
 MODULE_ALIAS("ipt_pknock");
+MODULE_ALIAS("ip6t_pknock");
 
 enum {
 	DEFAULT_GC_EXPIRATION_TIME = 65000, /* in msecs */
 	DEFAULT_RULE_HASH_SIZE  = 8,
 	DEFAULT_PEER_HASH_SIZE  = 16,
-};
+	DEFAULT_PEER_HASH_MAX   = 16384,
 
-#define hashtable_for_each_safe(pos, n, head, size, i)	\
-	for ((i) = 0; (i) < (size); ++(i)) \
-		list_for_each_safe((pos), (n), (&head[(i)]))
+	/* The garbage collector visits this many buckets at a time... */
+	GC_BATCH_BUCKETS        = 256,
+	/* ...and then lets the rule alone for this long (msecs). */
+	GC_BATCH_DELAY          = 100,
 
-#define pk_debug(msg, peer) pr_debug( \
-			"(S) peer: " NIPQUAD_FMT " - %s.\n", \
-			NIPQUAD((peer)->ip), msg)
+	/* Notifications per connector message, and how long (msecs)
+	 * the first one may wait for the others. */
+	NL_BATCH_MAX            = 32,
+	NL_BATCH_DELAY          = 10,
+};
+
+#define pk_debug(msg, peer) do { \
+	if ((peer)->family == NFPROTO_IPV6) \
+		pr_debug("(S) peer: " NIP6_FMT " - %s.\n", \
+			NIP6((peer)->addr.in6), msg); \
+	else \
+		pr_debug("(S) peer: " NIPQUAD_FMT " - %s.\n", \
+			NIPQUAD((peer)->addr.ip), msg); \
+} while (false)
 
 static uint32_t ipt_pknock_hash_rnd;
 
 static unsigned int rule_hashsize	= DEFAULT_RULE_HASH_SIZE;
 static unsigned int peer_hashsize	= DEFAULT_PEER_HASH_SIZE;
+static unsigned int peer_hashsize_max = DEFAULT_PEER_HASH_MAX;
 static unsigned int gc_expir_time = DEFAULT_GC_EXPIRATION_TIME;
 static int nl_multicast_group		= -1;
 
 static struct list_head *rule_hashtable;
 static struct proc_dir_entry *pde;
+static struct kmem_cache *peer_cachep __read_mostly;
 
-static DEFINE_SPINLOCK(list_lock);
+static DEFINE_MUTEX(rule_mutex);
 
 #ifdef PK_CRYPTO
 static struct {
 	const char *algo;
-	struct crypto_hash	*tfm;
 	unsigned int size;
-	struct hash_desc	desc;
 } crypto = {
 	.algo	= "hmac(sha256)",
-	.tfm	= NULL,
 	.size	= 0
 };
 #endif
@@ -129,9 +211,11 @@ static struct {
 module_param(rule_hashsize, int, S_IRUGO);
 MODULE_PARM_DESC(rule_hashsize, "Buckets in rule hash table (default: 8)");
 module_param(peer_hashsize, int, S_IRUGO);
-MODULE_PARM_DESC(peer_hashsize, "Buckets in peer hash table (default: 16)");
+MODULE_PARM_DESC(peer_hashsize, "Initial and least buckets in peer hash table (default: 16)");
+module_param(peer_hashsize_max, int, S_IRUGO);
+MODULE_PARM_DESC(peer_hashsize_max, "Most buckets a peer hash table grows to (default: 16384)");
 module_param(gc_expir_time, int, S_IRUGO);
-MODULE_PARM_DESC(gc_expir_time, "Time until garbage collection after valid knock packet (default: 65000 msec)");
+MODULE_PARM_DESC(gc_expir_time, "Interval between garbage collection passes (default: 65000 msec)");
 module_param(nl_multicast_group, int, S_IRUGO);
 MODULE_PARM_DESC(nl_multicast_group, "Netlink multicast group number for pknock messages");
 
@@ -150,6 +234,22 @@ pknock_hash(const void *key, uint32_t len, uint32_t initval, uint32_t max)
 	return jhash(key, len, initval) % max;
 }
 
+/**
+ * Hashes a peer address. IPv4 addresses are zero-padded, so both families
+ * cost the same.
+ *
+ * @addr
+ * @family
+ * @size
+ * @return: bucket index
+ */
+static inline uint32_t
+peer_hash(const union nf_inet_addr *addr, uint8_t family, uint32_t size)
+{
+	return jhash2((const uint32_t *)addr->all, ARRAY_SIZE(addr->all),
+	       ipt_pknock_hash_rnd ^ family) % size;
+}
+
 /**
  * Alloc a hashtable with n buckets.
  *
@@ -171,6 +271,42 @@ alloc_hashtable(unsigned int size)
 	return hash;
 }
 
+/**
+ * Alloc a peer table with n buckets.
+ *
+ * @size
+ * @ver
+ * @return: peer table
+ */
+static struct peer_table *
+alloc_peer_table(unsigned int size, unsigned int ver)
+{
+	struct peer_table *table;
+	size_t len = sizeof(*table) + sizeof(table->head[0]) * size;
+	unsigned int i;
+
+	if (len <= PAGE_SIZE)
+		table = kmalloc(len, GFP_KERNEL);
+	else
+		table = vmalloc(len);
+	if (table == NULL)
+		return NULL;
+
+	table->size = size;
+	table->ver  = ver;
+	for (i = 0; i < size; ++i)
+		INIT_LIST_HEAD(&table->head[i]);
+	return table;
+}
+
+static void free_peer_table(struct peer_table *table)
+{
+	if (sizeof(*table) + sizeof(table->head[0]) * table->size <= PAGE_SIZE)
+		kfree(table);
+	else
+		vfree(table);
+}
+
 /**
  * This function converts the status from integer to string.
  *
@@ -188,6 +324,15 @@ status_itoa(enum status status)
 	}
 }
 
+/**
+ * The listing is walked under RCU, so reading it never holds up packets.
+ * The table is remembered across one read, as a resize may replace it.
+ */
+struct pknock_seq_iter {
+	const struct xt_pknock_rule *rule;
+	const struct peer_table *table;
+};
+
 /**
  * @s
  * @pos
@@ -195,16 +340,17 @@ status_itoa(enum status status)
  */
 static void *
 pknock_seq_start(struct seq_file *s, loff_t *pos)
+	__acquires(RCU)
 {
-	const struct proc_dir_entry *pde = s->private;
-	const struct xt_pknock_rule *rule = pde->data;
+	struct pknock_seq_iter *iter = s->private;
 
-	spin_lock_bh(&list_lock);
+	rcu_read_lock();
+	iter->table = rcu_dereference(iter->rule->peers);
 
-	if (*pos >= peer_hashsize)
+	if (*pos >= iter->table->size)
 		return NULL;
 
-	return rule->peer_head + *pos;
+	return (void *)(iter->table->head + *pos);
 }
 
 /**
@@ -216,14 +362,13 @@ pknock_seq_start(struct seq_file *s, loff_t *pos)
 static void *
 pknock_seq_next(struct seq_file *s, void *v, loff_t *pos)
 {
-	const struct proc_dir_entry *pde = s->private;
-	const struct xt_pknock_rule *rule = pde->data;
+	const struct pknock_seq_iter *iter = s->private;
 
 	++*pos;
-	if (*pos >= peer_hashsize)
+	if (*pos >= iter->table->size)
 		return NULL;
 
-	return rule->peer_head + *pos;
+	return (void *)(iter->table->head + *pos);
 }
 
 /**
@@ -232,8 +377,9 @@ pknock_seq_next(struct seq_file *s, void *v, loff_t *pos)
  */
 static void
 pknock_seq_stop(struct seq_file *s, void *v)
+	__releases(RCU)
 {
-	spin_unlock_bh(&list_lock);
+	rcu_read_unlock();
 }
 
 /**
@@ -244,18 +390,20 @@ pknock_seq_stop(struct seq_file *s, void *v)
 static int
 pknock_seq_show(struct seq_file *s, void *v)
 {
-	const struct list_head *pos, *n;
 	const struct peer *peer;
 	unsigned long time;
 	const struct list_head *peer_head = v;
 
-	const struct proc_dir_entry *pde = s->private;
-	const struct xt_pknock_rule *rule = pde->data;
-
-	list_for_each_safe(pos, n, peer_head) {
-		peer = list_entry(pos, struct peer, head);
+	const struct pknock_seq_iter *iter = s->private;
+	const struct xt_pknock_rule *rule = iter->rule;
+	unsigned int ver = iter->table->ver;
 
-		seq_printf(s, "src=" NIPQUAD_FMT " ", NIPQUAD(peer->ip));
+	list_for_each_entry_rcu(peer, peer_head, head[ver]) {
+		if (peer->family == NFPROTO_IPV6)
+			seq_printf(s, "src=" NIP6_FMT " ", NIP6(peer->addr.in6));
+		else
+			seq_printf(s, "src=" NIPQUAD_FMT " ",
+			           NIPQUAD(peer->addr.ip));
 		seq_printf(s, "proto=%s ", (peer->proto == IPPROTO_TCP) ?
                                                 "TCP" : "UDP");
 		seq_printf(s, "status=%s ", status_itoa(peer->status));
@@ -298,12 +446,13 @@ static const struct seq_operations pknock_seq_ops = {
 static int
 pknock_proc_open(struct inode *inode, struct file *file)
 {
-	int ret = seq_open(file, &pknock_seq_ops);
-	if (ret == 0) {
-		struct seq_file *sf = file->private_data;
-		sf->private = PDE(inode);
-	}
-	return ret;
+	struct pknock_seq_iter *iter;
+
+	iter = __seq_open_private(file, &pknock_seq_ops, sizeof(*iter));
+	if (iter == NULL)
+		return -ENOMEM;
+	iter->rule = PDE(inode)->data;
+	return 0;
 }
 
 static const struct file_operations pknock_proc_ops = {
@@ -311,23 +460,9 @@ static const struct file_operations pknock_proc_ops = {
 	.open = pknock_proc_open,
 	.read = seq_read,
 	.llseek = seq_lseek,
-	.release = seq_release
+	.release = seq_release_private
 };
 
-/**
- * It updates the rule timer to execute garbage collector.
- *
- * @rule
- */
-static void update_rule_gc_timer(struct xt_pknock_rule *rule)
-{
-	if (timer_pending(&rule->timer))
-		del_timer(&rule->timer);
-
-	rule->timer.expires = jiffies + msecs_to_jiffies(gc_expir_time);
-	add_timer(&rule->timer);
-}
-
 /**
  * @peer
  * @autoclose_time
@@ -363,38 +498,366 @@ has_logged_during_this_minute(const struct peer *peer)
 	return peer != NULL && peer->login_sec / 60 == get_seconds() / 60;
 }
 
+/**
+ * Schedules a resize of the rule's peer table if it holds more than two
+ * peers per bucket, or fewer than one per eight buckets.
+ * Must be called with rule->lock held.
+ *
+ * @rule
+ */
+static void check_peer_load(struct xt_pknock_rule *rule)
+{
+	unsigned int size = rule->peers->size;
+
+	if (rule->resizing)
+		return;
+	if ((rule->peer_count > size * 2 && size < peer_hashsize_max) ||
+	    (rule->peer_count < size / 8 && size > peer_hashsize)) {
+		rule->resizing = true;
+		schedule_work(&rule->resize_work);
+	}
+}
+
+/**
+ * Moves the peers of a rule into a table sized for their number. The
+ * peers are linked into the new table through their other list head, so
+ * lockless readers can keep walking the old table until it is freed.
+ *
+ * @work
+ */
+static void peer_table_resize(struct work_struct *work)
+{
+	struct xt_pknock_rule *rule =
+		container_of(work, struct xt_pknock_rule, resize_work);
+	struct peer_table *old, *new;
+	struct peer *peer;
+	unsigned int size, i, hash;
+
+	spin_lock_bh(&rule->lock);
+	size = rule->peers->size;
+	while (rule->peer_count > size * 2 && size < peer_hashsize_max)
+		size = min(size * 2, peer_hashsize_max);
+	while (rule->peer_count < size / 8 && size > peer_hashsize)
+		size = max(size / 2, peer_hashsize);
+	i = rule->peers->ver;
+	spin_unlock_bh(&rule->lock);
+
+	if (size == rule->peers->size)
+		goto out;
+	new = alloc_peer_table(size, !i);
+	if (new == NULL) {
+		/*
+		 * Retrying right away would only spin on the allocator; the
+		 * next peer added or removed tries again.
+		 */
+		spin_lock_bh(&rule->lock);
+		rule->resizing = false;
+		spin_unlock_bh(&rule->lock);
+		return;
+	}
+
+	spin_lock_bh(&rule->lock);
+	old = rule->peers;
+	for (i = 0; i < old->size; ++i)
+		list_for_each_entry(peer, &old->head[i], head[old->ver]) {
+			hash = peer_hash(&peer->addr, peer->family, new->size);
+			list_add_rcu(&peer->head[new->ver], &new->head[hash]);
+		}
+	rcu_assign_pointer(rule->peers, new);
+	spin_unlock_bh(&rule->lock);
+
+	pr_debug("(R) rule %s: %u peers, %u -> %u buckets\n", rule->rule_name,
+		 rule->peer_count, old->size, new->size);
+
+	/* The old heads may only be reused once nobody walks @old anymore. */
+	synchronize_rcu();
+	free_peer_table(old);
+ out:
+	spin_lock_bh(&rule->lock);
+	rule->resizing = false;
+	check_peer_load(rule);
+	spin_unlock_bh(&rule->lock);
+}
+
+static void peer_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(peer_cachep, container_of(head, struct peer, rcu));
+}
+
+/**
+ * It removes a peer matching status. Lockless readers may still look at
+ * the peer, so it is only freed after a grace period.
+ * Must be called with rule->lock held.
+ *
+ * @rule
+ * @peer
+ */
+static void remove_peer(struct xt_pknock_rule *rule, struct peer *peer)
+{
+	list_del_rcu(&peer->head[rule->peers->ver]);
+	call_rcu(&peer->rcu, peer_free_rcu);
+	--rule->peer_count;
+	check_peer_load(rule);
+}
+
 /**
  * Garbage collector. It removes the old entries after tis timers have expired.
+ * Every gc_expir_time it makes a pass over the rule's peer table, in batches
+ * of GC_BATCH_BUCKETS buckets, so the rule's lock is never held for long.
+ * The timer is deferrable; an idle system is not woken up just for this.
  *
  * @r: rule
  */
 static void
 peer_gc(unsigned long r)
 {
-	unsigned int i;
+	unsigned int i, end;
 	struct xt_pknock_rule *rule = (struct xt_pknock_rule *)r;
-	struct peer *peer;
-	struct list_head *pos, *n;
+	struct peer_table *table;
+	struct peer *peer, *n;
+	unsigned long next;
 
 	pr_debug("(S) running %s\n", __func__);
-	hashtable_for_each_safe(pos, n, rule->peer_head, peer_hashsize, i) {
-		peer = list_entry(pos, struct peer, head);
-
-		/*
-		 * Remove any peer whose (inter-knock) max_time
-		 * or autoclose_time passed.
-		 */
-		if ((peer->status != ST_ALLOWED &&
-		    is_interknock_time_exceeded(peer, rule->max_time)) ||
-		    (peer->status == ST_ALLOWED &&
-		    autoclose_time_passed(peer, rule->autoclose_time)))
-		{
-			pk_debug("GC-DELETED", peer);
-			list_del(pos);
-			kfree(peer);
+	spin_lock(&rule->lock);
+	table = rule->peers;
+	end   = min_t(unsigned int, rule->gc_bucket + GC_BATCH_BUCKETS,
+	        table->size);
+	for (i = rule->gc_bucket; i < end; ++i)
+		list_for_each_entry_safe(peer, n, &table->head[i],
+		    head[table->ver]) {
+			/*
+			 * Remove any peer whose (inter-knock) max_time
+			 * or autoclose_time passed.
+			 */
+			if ((peer->status != ST_ALLOWED &&
+			    is_interknock_time_exceeded(peer, rule->max_time)) ||
+			    (peer->status == ST_ALLOWED &&
+			    autoclose_time_passed(peer, rule->autoclose_time)))
+			{
+				pk_debug("GC-DELETED", peer);
+				remove_peer(rule, peer);
+			}
 		}
+
+	/* A resize may have shrunk the table under the cursor. */
+	if (end < table->size) {
+		rule->gc_bucket = end;
+		next = msecs_to_jiffies(GC_BATCH_DELAY);
+	} else {
+		rule->gc_bucket = 0;
+		next = msecs_to_jiffies(gc_expir_time);
+	}
+	spin_unlock(&rule->lock);
+
+	mod_timer(&rule->timer, jiffies + next);
+}
+
+/**
+ * Sends the notifications queued on the rule to user space through netlink
+ * sockets, as one connector message. Its seq counts the batches of the rule,
+ * and its ack carries the number of notifications lost since the batch
+ * before. Must be called with rule->lock held.
+ *
+ * @rule
+ */
+static void nl_flush(struct xt_pknock_rule *rule)
+{
+#if defined(CONFIG_CONNECTOR) || defined(CONFIG_CONNECTOR_MODULE)
+	struct cn_msg *m = rule->nl_batch;
+	unsigned int count;
+	int ret;
+
+	if (m == NULL || m->len == 0)
+		return;
+
+	count  = m->len / sizeof(struct xt_pknock_nl_msg);
+	m->ack = rule->nl_dropped;
+	ret    = cn_netlink_send(m, nl_multicast_group, GFP_ATOMIC);
+	/*
+	 * Nobody listening is no loss, but the count of earlier losses
+	 * waits for a batch that is actually delivered.
+	 */
+	if (ret >= 0)
+		rule->nl_dropped = 0;
+	else if (ret != -ESRCH)
+		rule->nl_dropped += count;
+
+	++m->seq;
+	m->len = 0;
+#endif
+}
+
+static void nl_flush_timer(unsigned long r)
+{
+	struct xt_pknock_rule *rule = (struct xt_pknock_rule *)r;
+
+	spin_lock(&rule->lock);
+	nl_flush(rule);
+	spin_unlock(&rule->lock);
+}
+
+/**
+ * Queues a notification about the peer on the rule. The batch goes out once
+ * it holds NL_BATCH_MAX of them, or NL_BATCH_DELAY after the first.
+ * Must be called with rule->lock held.
+ *
+ * @rule
+ * @peer
+ */
+static void
+queue_nl_msg(struct xt_pknock_rule *rule, const struct peer *peer)
+{
+	struct cn_msg *m = rule->nl_batch;
+	struct xt_pknock_nl_msg *msg;
+
+	if (m == NULL)
+		return;
+
+	msg = (void *)(m + 1) + m->len;
+	memset(msg, 0, sizeof(*msg));
+	msg->family = peer->family;
+	if (peer->family == NFPROTO_IPV6)
+		memcpy(msg->peer_ip6, &peer->addr.in6, sizeof(msg->peer_ip6));
+	else
+		msg->peer_ip = peer->addr.ip;
+	memcpy(msg->rule_name, rule->rule_name, rule->rule_name_len);
+
+	if (m->len == 0)
+		mod_timer(&rule->nl_timer,
+		          jiffies + msecs_to_jiffies(NL_BATCH_DELAY));
+	m->len += sizeof(*msg);
+	if (m->len == NL_BATCH_MAX * sizeof(*msg))
+		nl_flush(rule);
+}
+
+#ifdef PK_CRYPTO
+/**
+ * Allocates a transform keyed with the given secret.
+ *
+ * @secret
+ * @secret_len
+ * @return: transform or ERR_PTR
+ */
+static struct crypto_hash *
+alloc_keyed_tfm(const char *secret, unsigned int secret_len)
+{
+	struct crypto_hash *tfm;
+	int ret;
+
+	tfm = crypto_alloc_hash(crypto.algo, 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm))
+		return tfm;
+
+	ret = crypto_hash_setkey(tfm, secret, secret_len);
+	if (ret != 0) {
+		crypto_free_hash(tfm);
+		return ERR_PTR(ret);
+	}
+	return tfm;
+}
+
+/**
+ * Tells whether the rule's transforms are keyed with the secrets of @info.
+ */
+static inline bool
+rule_secrets_equal(const struct xt_pknock_rule *rule,
+                   const struct xt_pknock_mtinfo *info)
+{
+	return rule->tfm[PK_DIGEST_OPEN] != NULL &&
+	       rule->secret_len[PK_DIGEST_OPEN] == info->open_secret_len &&
+	       rule->secret_len[PK_DIGEST_CLOSE] == info->close_secret_len &&
+	       memcmp(rule->secret[PK_DIGEST_OPEN], info->open_secret,
+	       info->open_secret_len) == 0 &&
+	       memcmp(rule->secret[PK_DIGEST_CLOSE], info->close_secret,
+	       info->close_secret_len) == 0;
+}
+
+/**
+ * Gives the rule its own transforms for the open and close secret, so that
+ * the key is set once here rather than for every SPA packet. When a match
+ * brings other secrets than the rule has, as iptables-restore does when
+ * they were changed, the rule is keyed anew, and digests the peers keep
+ * from the old secrets are dropped.
+ * Must be called with rule_mutex held.
+ *
+ * @rule
+ * @info
+ * @return: 1 success, 0 failure
+ */
+static bool
+set_rule_secrets(struct xt_pknock_rule *rule,
+                const struct xt_pknock_mtinfo *info)
+{
+	struct crypto_hash *tfm[PK_DIGEST_MAX], *old;
+	struct peer_table *table;
+	struct peer *peer;
+	unsigned int i;
+
+	if (!(info->option & XT_PKNOCK_OPENSECRET) ||
+	    rule_secrets_equal(rule, info))
+		return true;
+
+	tfm[PK_DIGEST_OPEN] = alloc_keyed_tfm(info->open_secret,
+	                      info->open_secret_len);
+	if (IS_ERR(tfm[PK_DIGEST_OPEN])) {
+		printk(KERN_ERR PKNOCK "failed to key transform for %s: %ld\n",
+		       crypto.algo, PTR_ERR(tfm[PK_DIGEST_OPEN]));
+		return false;
 	}
+	tfm[PK_DIGEST_CLOSE] = alloc_keyed_tfm(info->close_secret,
+	                       info->close_secret_len);
+	if (IS_ERR(tfm[PK_DIGEST_CLOSE])) {
+		printk(KERN_ERR PKNOCK "failed to key transform for %s: %ld\n",
+		       crypto.algo, PTR_ERR(tfm[PK_DIGEST_CLOSE]));
+		crypto_free_hash(tfm[PK_DIGEST_OPEN]);
+		return false;
+	}
+
+	spin_lock_bh(&rule->lock);
+	for (i = 0; i < PK_DIGEST_MAX; ++i) {
+		old = rule->tfm[i];
+		rule->tfm[i] = tfm[i];
+		tfm[i] = old;
+	}
+	memcpy(rule->secret[PK_DIGEST_OPEN], info->open_secret,
+	       info->open_secret_len);
+	rule->secret_len[PK_DIGEST_OPEN] = info->open_secret_len;
+	memcpy(rule->secret[PK_DIGEST_CLOSE], info->close_secret,
+	       info->close_secret_len);
+	rule->secret_len[PK_DIGEST_CLOSE] = info->close_secret_len;
+	table = rule->peers;
+	for (i = 0; i < table->size; ++i)
+		list_for_each_entry(peer, &table->head[i], head[table->ver])
+			peer->digest_valid = 0;
+	spin_unlock_bh(&rule->lock);
+
+	/* The transforms are only used under the lock; the old ones are idle. */
+	for (i = 0; i < PK_DIGEST_MAX; ++i)
+		if (tfm[i] != NULL)
+			crypto_free_hash(tfm[i]);
+	return true;
+}
+
+static void free_rule_secrets(struct xt_pknock_rule *rule)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(rule->tfm); ++i)
+		if (rule->tfm[i] != NULL)
+			crypto_free_hash(rule->tfm[i]);
+}
+#else
+static inline bool
+set_rule_secrets(struct xt_pknock_rule *rule,
+                const struct xt_pknock_mtinfo *info)
+{
+	return true;
+}
+
+static inline void free_rule_secrets(struct xt_pknock_rule *rule)
+{
 }
+#endif /* PK_CRYPTO */
 
 /**
  * Compares length and name equality for the rules.
@@ -418,15 +881,12 @@ rulecmp(const struct xt_pknock_mtinfo *info, const struct xt_pknock_rule *rule)
 static struct xt_pknock_rule *search_rule(const struct xt_pknock_mtinfo *info)
 {
 	struct xt_pknock_rule *rule;
-	struct list_head *pos, *n;
 	unsigned int hash = pknock_hash(info->rule_name, info->rule_name_len,
 					ipt_pknock_hash_rnd, rule_hashsize);
 
-	list_for_each_safe(pos, n, &rule_hashtable[hash]) {
-		rule = list_entry(pos, struct xt_pknock_rule, head);
+	list_for_each_entry_rcu(rule, &rule_hashtable[hash], head)
 		if (rulecmp(info, rule))
 			return rule;
-	}
 	return NULL;
 }
 
@@ -449,6 +909,8 @@ add_rule(struct xt_pknock_mtinfo *info)
 
 		if (!rulecmp(info, rule))
 			continue;
+		if (!set_rule_secrets(rule, info))
+			return false;
 		++rule->ref_count;
 
 		if (info->option & XT_PKNOCK_OPENSECRET) {
@@ -463,11 +925,12 @@ add_rule(struct xt_pknock_mtinfo *info)
 		return true;
 	}
 
-	rule = kmalloc(sizeof(*rule), GFP_KERNEL);
+	rule = kzalloc(sizeof(*rule), GFP_KERNEL);
 	if (rule == NULL)
 		return false;
 
 	INIT_LIST_HEAD(&rule->head);
+	spin_lock_init(&rule->lock);
 
 	memset(rule->rule_name, 0, sizeof(rule->rule_name));
 	strncpy(rule->rule_name, info->rule_name, info->rule_name_len);
@@ -476,14 +939,27 @@ add_rule(struct xt_pknock_mtinfo *info)
 	rule->ref_count      = 1;
 	rule->max_time       = info->max_time;
 	rule->autoclose_time = info->autoclose_time;
-	rule->peer_head      = alloc_hashtable(peer_hashsize);
-	if (rule->peer_head == NULL)
+	rule->peers          = alloc_peer_table(peer_hashsize, 0);
+	if (rule->peers == NULL)
+		goto out;
+	INIT_WORK(&rule->resize_work, peer_table_resize);
+	if (!set_rule_secrets(rule, info))
 		goto out;
 
-	init_timer(&rule->timer);
+	init_timer_deferrable(&rule->timer);
 	rule->timer.function	= peer_gc;
 	rule->timer.data	= (unsigned long)rule;
 
+#if defined(CONFIG_CONNECTOR) || defined(CONFIG_CONNECTOR_MODULE)
+	if (nl_multicast_group > 0) {
+		rule->nl_batch = kzalloc(sizeof(*rule->nl_batch) + NL_BATCH_MAX *
+		                 sizeof(struct xt_pknock_nl_msg), GFP_KERNEL);
+		if (rule->nl_batch == NULL)
+			goto out;
+	}
+#endif
+	setup_timer(&rule->nl_timer, nl_flush_timer, (unsigned long)rule);
+
 	rule->status_proc = create_proc_entry(info->rule_name, 0, pde);
 	if (rule->status_proc == NULL)
 		goto out;
@@ -491,11 +967,15 @@ add_rule(struct xt_pknock_mtinfo *info)
 	rule->status_proc->proc_fops = &pknock_proc_ops;
 	rule->status_proc->data = rule;
 
-	list_add(&rule->head, &rule_hashtable[hash]);
+	list_add_rcu(&rule->head, &rule_hashtable[hash]);
+	mod_timer(&rule->timer, jiffies + msecs_to_jiffies(gc_expir_time));
 	pr_debug("(A) rule_name: %s - created.\n", rule->rule_name);
 	return true;
  out:
-	kfree(rule->peer_head);
+	kfree(rule->nl_batch);
+	free_rule_secrets(rule);
+	if (rule->peers != NULL)
+		free_peer_table(rule->peers);
 	kfree(rule);
 	return false;
 }
@@ -510,7 +990,8 @@ remove_rule(struct xt_pknock_mtinfo *info)
 {
 	struct xt_pknock_rule *rule = NULL;
 	struct list_head *pos, *n;
-	struct peer *peer;
+	struct peer_table *table;
+	struct peer *peer, *next;
 	unsigned int i;
 	int found = 0;
 	unsigned int hash = pknock_hash(info->rule_name, info->rule_name_len,
@@ -535,44 +1016,67 @@ remove_rule(struct xt_pknock_mtinfo *info)
 	if (rule == NULL || rule->ref_count != 0)
 		return;
 
-	hashtable_for_each_safe(pos, n, rule->peer_head, peer_hashsize, i) {
-		peer = list_entry(pos, struct peer, head);
-		pk_debug("DELETED", peer);
-		list_del(pos);
-		kfree(peer);
-	}
-
 	if (rule->status_proc != NULL)
 		remove_proc_entry(info->rule_name, pde);
+	list_del_rcu(&rule->head);
+
+	/*
+	 * Once no packet can see the rule any more, and the garbage collector
+	 * (which rearms itself; del_timer_sync copes with that) and any
+	 * resize are stopped, the peers can go without further locking.
+	 */
+	synchronize_rcu();
+	del_timer_sync(&rule->timer);
+	cancel_work_sync(&rule->resize_work);
+	del_timer_sync(&rule->nl_timer);
+
+	/* Whatever is still queued goes out now. */
+	spin_lock_bh(&rule->lock);
+	nl_flush(rule);
+	spin_unlock_bh(&rule->lock);
+	kfree(rule->nl_batch);
+
+	table = rule->peers;
+	for (i = 0; i < table->size; ++i)
+		list_for_each_entry_safe(peer, next, &table->head[i],
+		    head[table->ver]) {
+			pk_debug("DELETED", peer);
+			list_del(&peer->head[table->ver]);
+			kmem_cache_free(peer_cachep, peer);
+		}
 	pr_debug("(D) rule deleted: %s.\n", rule->rule_name);
-	if (timer_pending(&rule->timer))
-		del_timer(&rule->timer);
 
-	list_del(&rule->head);
-	kfree(rule->peer_head);
+	free_rule_secrets(rule);
+	free_peer_table(table);
 	kfree(rule);
 }
 
 /**
  * If peer status exist in the list it returns peer status, if not it returns NULL.
+ * Must be called under rcu_read_lock or with rule->lock held.
  *
  * @rule
- * @ip
+ * @addr
+ * @family
  * @return: peer or NULL
  */
-static struct peer *get_peer(struct xt_pknock_rule *rule, __be32 ip)
+static struct peer *
+get_peer(struct xt_pknock_rule *rule, const union nf_inet_addr *addr,
+         uint8_t family)
 {
+	const struct peer_table *table = rcu_dereference(rule->peers);
 	struct peer *peer;
-	struct list_head *pos, *n;
 	unsigned int hash;
 
-	hash = pknock_hash(&ip, sizeof(ip), ipt_pknock_hash_rnd, peer_hashsize);
+	hash = peer_hash(addr, family, table->size);
 
-	list_for_each_safe(pos, n, &rule->peer_head[hash]) {
-		peer = list_entry(pos, struct peer, head);
-		if (peer->ip == ip)
+	list_for_each_entry_rcu(peer, &table->head[hash], head[table->ver])
+		if (peer->family == family &&
+		    ((peer->addr.all[0] ^ addr->all[0]) |
+		    (peer->addr.all[1] ^ addr->all[1]) |
+		    (peer->addr.all[2] ^ addr->all[2]) |
+		    (peer->addr.all[3] ^ addr->all[3])) == 0)
 			return peer;
-	}
 	return NULL;
 }
 
@@ -590,23 +1094,24 @@ static void reset_knock_status(struct peer *peer)
 /**
  * It creates a new peer matching status.
  *
- * @rule
- * @ip
- * @proto
+ * @hdr
  * @return: peer or NULL
  */
-static struct peer *new_peer(__be32 ip, uint8_t proto)
+static struct peer *new_peer(const struct transport_data *hdr)
 {
-	struct peer *peer = kmalloc(sizeof(*peer), GFP_ATOMIC);
+	struct peer *peer = kmem_cache_alloc(peer_cachep, GFP_ATOMIC);
 
 	if (peer == NULL)
 		return NULL;
 
-	INIT_LIST_HEAD(&peer->head);
-	peer->ip	= ip;
-	peer->proto	= proto;
+	peer->addr	= hdr->saddr;
+	peer->family	= hdr->family;
+	peer->proto	= hdr->proto;
 	peer->timestamp = jiffies/HZ;
 	peer->login_sec = 0;
+#ifdef PK_CRYPTO
+	peer->digest_valid = 0;
+#endif
 	reset_knock_status(peer);
 
 	return peer;
@@ -614,28 +1119,20 @@ static struct peer *new_peer(__be32 ip, uint8_t proto)
 
 /**
  * It adds a new peer matching status to the list.
+ * Must be called with rule->lock held.
  *
  * @peer
  * @rule
  */
 static void add_peer(struct peer *peer, struct xt_pknock_rule *rule)
 {
-	unsigned int hash = pknock_hash(&peer->ip, sizeof(peer->ip),
-                                ipt_pknock_hash_rnd, peer_hashsize);
-	list_add(&peer->head, &rule->peer_head[hash]);
+	struct peer_table *table = rule->peers;
+	unsigned int hash = peer_hash(&peer->addr, peer->family, table->size);
+	list_add_rcu(&peer->head[table->ver], &table->head[hash]);
+	++rule->peer_count;
+	check_peer_load(rule);
 }
 
-/**
- * It removes a peer matching status.
- *
- * @peer
- */
-static void remove_peer(struct peer *peer)
-{
-	list_del(&peer->head);
-	if (peer != NULL)
-		kfree(peer);
-}
 
 /**
  * @peer
@@ -684,139 +1181,128 @@ is_allowed(const struct peer *peer)
 	return peer != NULL && peer->status == ST_ALLOWED;
 }
 
+#ifdef PK_CRYPTO
 /**
- * Sends a message to user space through netlink sockets.
+ * Transforms a lowercase hexadecimal sequence back to binary.
  *
- * @info
- * @peer
- * @return: 1 success, 0 otherwise
+ * @out: the binary result
+ * @hex: the hexadecimal sequence, twice as long as @size
+ * @size
+ * @return: 1 success, 0 if @hex has other characters
  */
 static bool
-msg_to_userspace_nl(const struct xt_pknock_mtinfo *info,
-                const struct peer *peer, int multicast_group)
+hex_to_crypt(unsigned char *out, const unsigned char *hex, unsigned int size)
 {
-#if defined(CONFIG_CONNECTOR) || defined(CONFIG_CONNECTOR_MODULE)
-	struct cn_msg *m;
-	struct xt_pknock_nl_msg msg;
-
-	m = kmalloc(sizeof(*m) + sizeof(msg), GFP_ATOMIC);
-	if (m == NULL)
-		return false;
-
-	memset(m, 0, sizeof(*m) + sizeof(msg));
-	m->seq = 0;
-	m->len = sizeof(msg);
-
-	msg.peer_ip = peer->ip;
-	scnprintf(msg.rule_name, info->rule_name_len + 1, info->rule_name);
-
-	memcpy(m + 1, &msg, m->len);
-
-	cn_netlink_send(m, multicast_group, GFP_ATOMIC);
+	unsigned int i, j;
+	unsigned char c, v;
 
-	kfree(m);
-#endif
+	for (i = 0; i < size; ++i) {
+		v = 0;
+		for (j = 0; j < 2; ++j) {
+			c = *hex++;
+			if (c >= '0' && c <= '9')
+				v = (v << 4) | (c - '0');
+			else if (c >= 'a' && c <= 'f')
+				v = (v << 4) | (c - 'a' + 10);
+			else
+				return false;
+		}
+		*out++ = v;
+	}
 	return true;
 }
 
-#ifdef PK_CRYPTO
 /**
- * Transforms a sequence of characters to hexadecimal.
+ * Computes hmac(secret, ipsrc+epoch_min) with a transform already keyed
+ * with the secret.
  *
- * @out: the hexadecimal result
- * @crypt: the original sequence
- * @size
+ * @tfm
+ * @peer: gives ipsrc, 4 bytes for IPv4 and 16 bytes for IPv6
+ * @epoch_min
+ * @result
+ * @return: 1 success, 0 failure
  */
-static void
-crypt_to_hex(char *out, const char *crypt, unsigned int size)
+static bool
+pk_digest(struct crypto_hash *tfm, const struct peer *peer, uint32_t epoch_min,
+    unsigned char *result)
 {
-	unsigned int i;
-	for (i = 0; i < size; ++i) {
-		unsigned char c = crypt[i];
-		*out++ = '0' + ((c&0xf0)>>4) + (c>=0xa0)*('a'-'9'-1);
-		*out++ = '0' + (c&0x0f) + ((c&0x0f)>=0x0a)*('a'-'9'-1);
+	struct hash_desc desc = {.tfm = tfm, .flags = 0};
+	struct scatterlist sg[2];
+	unsigned int addr_len = (peer->family == NFPROTO_IPV6) ?
+	                        sizeof(peer->addr.in6) : sizeof(peer->addr.ip);
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
+	sg_init_table(sg, ARRAY_SIZE(sg));
+#endif
+	sg_set_buf(&sg[0], &peer->addr, addr_len);
+	sg_set_buf(&sg[1], &epoch_min, sizeof(epoch_min));
+
+	/*
+	 * The third parameter is the number of bytes INSIDE the sg!
+	 * 4 bytes IPv4 (32 bits) or 16 bytes IPv6 (128 bits) +
+	 * 4 bytes int epoch_min (32 bits)
+	 */
+	ret = crypto_hash_digest(&desc, sg, addr_len + sizeof(epoch_min),
+	      result);
+	if (ret != 0) {
+		printk("crypto_hash_digest() failed ret=%d\n", ret);
+		return false;
 	}
+	return true;
 }
 
 /**
- * Checks that the payload has the hmac(secret+ipsrc+epoch_min).
+ * Checks that the payload has the hmac(secret+ipsrc+epoch_min). The digest
+ * only changes once a minute, so it is kept in the peer, and the payload
+ * is compared to it in binary. Junk payloads are turned away before any
+ * hashing is done. Must be called with rule->lock held.
  *
- * @secret
- * @secret_len
- * @ipsrc
+ * @rule
+ * @peer
+ * @which: PK_DIGEST_OPEN or PK_DIGEST_CLOSE
  * @payload
  * @payload_len
  * @return: 1 success, 0 failure
  */
 static bool
-has_secret(const unsigned char *secret, unsigned int secret_len, uint32_t ipsrc,
-    const unsigned char *payload, unsigned int payload_len)
+has_secret(const struct xt_pknock_rule *rule, struct peer *peer,
+    unsigned int which, const unsigned char *payload, unsigned int payload_len)
 {
-	struct scatterlist sg[2];
-	char result[64]; // 64 bytes * 8 = 512 bits
-	char *hexresult;
-	unsigned int hexa_size;
-	int ret;
-	bool fret = false;
-	unsigned int epoch_min;
+	unsigned char given[PK_DIGEST_SIZE];
+	unsigned long epoch_min;
 
-	if (payload_len == 0)
+	if (rule->tfm[which] == NULL)
 		return false;
 
 	/*
 	 * hexa:  4bits
 	 * ascii: 8bits
 	 * hexa = ascii * 2
+	 * + 1 cause we MUST add NULL in the payload
 	 */
-	hexa_size = crypto.size * 2;
-
-	/* + 1 cause we MUST add NULL in the payload */
-	if (payload_len != hexa_size + 1)
+	if (payload_len != crypto.size * 2 + 1)
 		return false;
-
-	hexresult = kmalloc(hexa_size, GFP_ATOMIC);
-	if (hexresult == NULL)
+	if (!hex_to_crypt(given, payload, crypto.size))
 		return false;
 
-	memset(result, 0, sizeof(result));
-	memset(hexresult, 0, hexa_size);
-
 	epoch_min = get_seconds() / 60;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24)
-	sg_init_table(sg, ARRAY_SIZE(sg));
-#endif
-	sg_set_buf(&sg[0], &ipsrc, sizeof(ipsrc));
-	sg_set_buf(&sg[1], &epoch_min, sizeof(epoch_min));
-
-	ret = crypto_hash_setkey(crypto.tfm, secret, secret_len);
-	if (ret != 0) {
-		printk("crypto_hash_setkey() failed ret=%d\n", ret);
-		goto out;
+	if (peer->digest_min != epoch_min) {
+		peer->digest_min   = epoch_min;
+		peer->digest_valid = 0;
 	}
-
-	/*
-	 * The third parameter is the number of bytes INSIDE the sg!
-	 * 4 bytes IP (32 bits) +
-	 * 4 bytes int epoch_min (32 bits)
-	 */
-	ret = crypto_hash_digest(&crypto.desc, sg,
-	      sizeof(ipsrc) + sizeof(epoch_min), result);
-	if (ret != 0) {
-		printk("crypto_hash_digest() failed ret=%d\n", ret);
-		goto out;
+	if (!(peer->digest_valid & (1 << which))) {
+		if (!pk_digest(rule->tfm[which], peer, epoch_min,
+		    peer->digest[which]))
+			return false;
+		peer->digest_valid |= 1 << which;
 	}
 
-	crypt_to_hex(hexresult, result, crypto.size);
-
-	if (memcmp(hexresult, payload, hexa_size) != 0)
+	if (memcmp(given, peer->digest[which], crypto.size) != 0) {
 		pr_debug("secret match failed\n");
-	else
-		fret = true;
-
- out:
-	kfree(hexresult);
-	return fret;
+		return false;
+	}
+	return true;
 }
 #endif /* PK_CRYPTO */
 
@@ -830,7 +1316,7 @@ has_secret(const unsigned char *secret, unsigned int secret_len, uint32_t ipsrc,
  * @return: 1 if pass security, 0 otherwise
  */
 static bool
-pass_security(struct peer *peer, const struct xt_pknock_mtinfo *info,
+pass_security(struct peer *peer, const struct xt_pknock_rule *rule,
         const unsigned char *payload, unsigned int payload_len)
 {
 	if (is_allowed(peer))
@@ -843,9 +1329,7 @@ pass_security(struct peer *peer, const struct xt_pknock_mtinfo *info,
 	}
 #ifdef PK_CRYPTO
 	/* Check for OPEN secret */
-	if (has_secret(info->open_secret,
-					info->open_secret_len, peer->ip,
-					payload, payload_len))
+	if (has_secret(rule, peer, PK_DIGEST_OPEN, payload, payload_len))
 		return true;
 #endif
 
@@ -874,7 +1358,7 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 		pk_debug("DIDN'T MATCH", peer);
 		/* Peer must start the sequence from scratch. */
 		if (info->option & XT_PKNOCK_STRICT)
-			remove_peer(peer);
+			remove_peer(rule, peer);
 
 		return false;
 	}
@@ -884,13 +1368,10 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 		if (hdr->proto != IPPROTO_UDP && hdr->proto != IPPROTO_UDPLITE)
 			return false;
 
-		if (!pass_security(peer, info, hdr->payload, hdr->payload_len))
+		if (!pass_security(peer, rule, hdr->payload, hdr->payload_len))
 			return false;
 	}
 
-	/* Update the gc timer when there is a state change. */
-	update_rule_gc_timer(rule);
-
 	++peer->accepted_knock_count;
 
 	if (is_last_knock(peer, info)) {
@@ -899,8 +1380,7 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 		pk_debug("ALLOWED", peer);
 		peer->login_sec = get_seconds();
 
-		if (nl_multicast_group > 0)
-			msg_to_userspace_nl(info, peer, nl_multicast_group);
+		queue_nl_msg(rule, peer);
 
 		return true;
 	}
@@ -915,7 +1395,7 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
 			pr_debug("max_time: %ld - time: %ld\n",
 					peer->timestamp + info->max_time,
 					time);
-			remove_peer(peer);
+			remove_peer(rule, peer);
 			return false;
 		}
 		peer->timestamp = time;
@@ -930,20 +1410,18 @@ update_peer(struct peer *peer, const struct xt_pknock_mtinfo *info,
  * closure.
  *
  * @peer
- * @info
+ * @rule
  * @payload
  * @payload_len
  * @return: 1 if close knock, 0 otherwise
  */
 static bool
-is_close_knock(const struct peer *peer, const struct xt_pknock_mtinfo *info,
+is_close_knock(struct peer *peer, const struct xt_pknock_rule *rule,
 		const unsigned char *payload, unsigned int payload_len)
 {
 #ifdef PK_CRYPTO
 	/* Check for CLOSE secret. */
-	if (has_secret(info->close_secret,
-				info->close_secret_len, peer->ip,
-				payload, payload_len))
+	if (has_secret(rule, peer, PK_DIGEST_CLOSE, payload, payload_len))
 	{
 		pk_debug("BLOCKED", peer);
 		return true;
@@ -952,20 +1430,26 @@ is_close_knock(const struct peer *peer, const struct xt_pknock_mtinfo *info,
 	return false;
 }
 
-static bool pknock_mt(const struct sk_buff *skb,
-    struct xt_action_param *par)
+/**
+ * @skb
+ * @par
+ * @hdr:	transport data with source address, family and protocol filled in
+ * @thoff:	offset of the transport header
+ */
+static bool
+pknock_mt_common(const struct sk_buff *skb, struct xt_action_param *par,
+    struct transport_data *hdr, unsigned int thoff)
 {
 	const struct xt_pknock_mtinfo *info = par->matchinfo;
 	struct xt_pknock_rule *rule;
 	struct peer *peer;
-	const struct iphdr *iph = ip_hdr(skb);
-	unsigned int hdr_len = 0;
 	__be16 _ports[2];
 	const __be16 *pptr;
-	struct transport_data hdr = {0, 0, 0, NULL};
+	unsigned char _payload[PK_DIGEST_SIZE * 2 + 1];
+	unsigned int hdr_len = 0;
 	bool ret = false;
 
-	pptr = skb_header_pointer(skb, par->thoff, sizeof _ports, &_ports);
+	pptr = skb_header_pointer(skb, thoff, sizeof _ports, &_ports);
 	if (pptr == NULL) {
 		/* We've been asked to examine this packet, and we
 		 * can't. Hence, no choice but to drop.
@@ -974,17 +1458,16 @@ static bool pknock_mt(const struct sk_buff *skb,
 		return false;
 	}
 
-	hdr.port = ntohs(pptr[1]);
-	hdr.proto = iph->protocol;
+	hdr->port = ntohs(pptr[1]);
 
-	switch (hdr.proto) {
+	switch (hdr->proto) {
 	case IPPROTO_TCP:
 		break;
 
 	case IPPROTO_UDP:
 	case IPPROTO_UDPLITE:
 #ifdef PK_CRYPTO
-		hdr_len = (iph->ihl * 4) + sizeof(struct udphdr);
+		hdr_len = thoff + sizeof(struct udphdr);
 		break;
 #else
 		pr_debug("UDP protocol not supported\n");
@@ -996,7 +1479,7 @@ static bool pknock_mt(const struct sk_buff *skb,
 		return false;
 	}
 
-	spin_lock_bh(&list_lock);
+	rcu_read_lock();
 
 	/* Searches a rule from the list depending on info structure options. */
 	rule = search_rule(info);
@@ -1007,43 +1490,52 @@ static bool pknock_mt(const struct sk_buff *skb,
 	}
 
 	/* Gives the peer matching status added to rule depending on ip src. */
-	peer = get_peer(rule, iph->saddr);
+	peer = get_peer(rule, &hdr->saddr, hdr->family);
 
 	if (info->option & XT_PKNOCK_CHECKIP) {
 		ret = is_allowed(peer);
 		goto out;
 	}
 
-	if (iph->protocol == IPPROTO_UDP || iph->protocol == IPPROTO_UDPLITE) {
-		hdr.payload = (void *)iph + hdr_len;
-		hdr.payload_len = skb->len - hdr_len;
+	/*
+	 * Only SPA payloads are ever looked at, and those have a fixed
+	 * length; anything longer is rejected on its length alone.
+	 */
+	if (hdr_len != 0 && skb->len > hdr_len) {
+		hdr->payload_len = skb->len - hdr_len;
+		hdr->payload = skb_header_pointer(skb, hdr_len,
+		               min_t(unsigned int, hdr->payload_len,
+		               sizeof(_payload)), _payload);
+		if (hdr->payload == NULL)
+			hdr->payload_len = 0;
 	}
 
 	/* Sets, updates, removes or checks the peer matching status. */
 	if (info->option & XT_PKNOCK_KNOCKPORT) {
+		spin_lock_bh(&rule->lock);
+		/* Look again; the peer may have changed since the lookup above. */
+		peer = get_peer(rule, &hdr->saddr, hdr->family);
 		if ((ret = is_allowed(peer))) {
 			if (info->option & XT_PKNOCK_CLOSESECRET &&
-			    (iph->protocol == IPPROTO_UDP ||
-			    iph->protocol == IPPROTO_UDPLITE))
+			    (hdr->proto == IPPROTO_UDP ||
+			    hdr->proto == IPPROTO_UDPLITE))
 			{
-				if (is_close_knock(peer, info, hdr.payload, hdr.payload_len))
+				if (is_close_knock(peer, rule, hdr->payload, hdr->payload_len))
 				{
 					reset_knock_status(peer);
 					ret = false;
 				}
 			}
-			goto out;
-		}
-
-		if (is_first_knock(peer, info, hdr.port)) {
-			peer = new_peer(iph->saddr, iph->protocol);
-			add_peer(peer, rule);
+		} else {
+			if (is_first_knock(peer, info, hdr->port)) {
+				peer = new_peer(hdr);
+				if (peer != NULL)
+					add_peer(peer, rule);
+			}
+			if (peer != NULL)
+				update_peer(peer, info, rule, hdr);
 		}
-
-		if (peer == NULL)
-			goto out;
-
-		update_peer(peer, info, rule, &hdr);
+		spin_unlock_bh(&rule->lock);
 	}
 
 out:
@@ -1051,31 +1543,73 @@ out:
 	if (ret && autoclose_time_passed(peer, rule->autoclose_time)) {
 		pk_debug("AUTOCLOSE TIME PASSED => BLOCKED", peer);
 		ret = false;
-		if (iph->protocol == IPPROTO_TCP ||
-		    !has_logged_during_this_minute(peer))
-			remove_peer(peer);
+		if (hdr->proto == IPPROTO_TCP ||
+		    !has_logged_during_this_minute(peer)) {
+			spin_lock_bh(&rule->lock);
+			/* Unless another CPU was faster */
+			if (get_peer(rule, &hdr->saddr, hdr->family) == peer)
+				remove_peer(rule, peer);
+			spin_unlock_bh(&rule->lock);
+		}
 	}
 
 	if (ret)
 		pk_debug("PASS OK", peer);
-	spin_unlock_bh(&list_lock);
+	rcu_read_unlock();
 	return ret;
 }
 
+static bool pknock_mt4(const struct sk_buff *skb,
+    struct xt_action_param *par)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	struct transport_data hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.saddr.ip = iph->saddr;
+	hdr.family   = NFPROTO_IPV4;
+	hdr.proto    = iph->protocol;
+	return pknock_mt_common(skb, par, &hdr, par->thoff);
+}
+
+static bool pknock_mt6(const struct sk_buff *skb,
+    struct xt_action_param *par)
+{
+	struct transport_data hdr;
+	unsigned int thoff = 0;
+	unsigned short fragoff = 0;
+	int proto;
+
+	proto = ipv6_find_hdr(skb, &thoff, -1, &fragoff);
+	if (proto < 0 || fragoff != 0)
+		return false;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.saddr.in6 = ipv6_hdr(skb)->saddr;
+	hdr.family    = NFPROTO_IPV6;
+	hdr.proto     = proto;
+	return pknock_mt_common(skb, par, &hdr, thoff);
+}
+
 #define RETURN_ERR(err) do { printk(KERN_ERR PKNOCK err); return -EINVAL; } while (false)
 
 static int pknock_mt_check(const struct xt_mtchk_param *par)
 {
 	struct xt_pknock_mtinfo *info = par->matchinfo;
+	bool added;
 
 	/* Singleton. */
+	mutex_lock(&rule_mutex);
 	if (rule_hashtable == NULL) {
 		rule_hashtable = alloc_hashtable(rule_hashsize);
-		if (rule_hashtable == NULL)
+		if (rule_hashtable == NULL) {
+			mutex_unlock(&rule_mutex);
 			RETURN_ERR("alloc_hashtable() error in checkentry()\n");
+		}
 
 		get_random_bytes(&ipt_pknock_hash_rnd, sizeof (ipt_pknock_hash_rnd));
 	}
+	mutex_unlock(&rule_mutex);
 
 	if (!(info->option & XT_PKNOCK_NAME))
 		RETURN_ERR("You must specify --name option.\n");
@@ -1113,13 +1647,19 @@ static int pknock_mt_check(const struct xt_mtchk_param *par)
 		RETURN_ERR("you must specify --time.\n");
 	}
 
+	if (info->open_secret_len > XT_PKNOCK_MAX_PASSWD_LEN ||
+	    info->close_secret_len > XT_PKNOCK_MAX_PASSWD_LEN)
+		RETURN_ERR("opensecret or closesecret too long.\n");
 	if (info->option & XT_PKNOCK_OPENSECRET &&
 	    info->open_secret_len == info->close_secret_len &&
 	    memcmp(info->open_secret, info->close_secret,
 	    info->open_secret_len) == 0)
 		RETURN_ERR("opensecret & closesecret cannot be equal.\n");
 
-	if (!add_rule(info))
+	mutex_lock(&rule_mutex);
+	added = add_rule(info);
+	mutex_unlock(&rule_mutex);
+	if (!added)
 		/* should ENOMEM here */
 		RETURN_ERR("add_rule() error in checkentry() function.\n");
 
@@ -1130,22 +1670,41 @@ static void pknock_mt_destroy(const struct xt_mtdtor_param *par)
 {
 	struct xt_pknock_mtinfo *info = par->matchinfo;
 	/* Removes a rule only if it exits and ref_count is equal to 0. */
+	mutex_lock(&rule_mutex);
 	remove_rule(info);
+	mutex_unlock(&rule_mutex);
 }
 
-static struct xt_match xt_pknock_mt_reg __read_mostly = {
-	.name		= "pknock",
-	.revision   = 1,
-	.family		= NFPROTO_IPV4,
-	.matchsize  = sizeof(struct xt_pknock_mtinfo),
-	.match      = pknock_mt,
-	.checkentry = pknock_mt_check,
-	.destroy    = pknock_mt_destroy,
-	.me			= THIS_MODULE
+static struct xt_match xt_pknock_mt_reg[] __read_mostly = {
+	{
+		.name		= "pknock",
+		.revision	= 1,
+		.family		= NFPROTO_IPV4,
+		.matchsize	= sizeof(struct xt_pknock_mtinfo),
+		.match		= pknock_mt4,
+		.checkentry	= pknock_mt_check,
+		.destroy	= pknock_mt_destroy,
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "pknock",
+		.revision	= 1,
+		.family		= NFPROTO_IPV6,
+		.matchsize	= sizeof(struct xt_pknock_mtinfo),
+		.match		= pknock_mt6,
+		.checkentry	= pknock_mt_check,
+		.destroy	= pknock_mt_destroy,
+		.me		= THIS_MODULE,
+	},
 };
 
 static int __init xt_pknock_mt_init(void)
 {
+	int ret;
+#ifdef PK_CRYPTO
+	struct crypto_hash *tfm;
+#endif
+
 #if !defined(CONFIG_CONNECTOR) && !defined(CONFIG_CONNECTOR_MODULE)
 	if (nl_multicast_group != -1)
 		pr_info("CONFIG_CONNECTOR not present; "
@@ -1154,6 +1713,10 @@ static int __init xt_pknock_mt_init(void)
 
 	if (gc_expir_time < DEFAULT_GC_EXPIRATION_TIME)
 		gc_expir_time = DEFAULT_GC_EXPIRATION_TIME;
+	if (peer_hashsize == 0)
+		peer_hashsize = DEFAULT_PEER_HASH_SIZE;
+	if (peer_hashsize_max < peer_hashsize)
+		peer_hashsize_max = peer_hashsize;
 #ifdef PK_CRYPTO
 	if (request_module(crypto.algo) < 0) {
 		printk(KERN_ERR PKNOCK "request_module('%s') error.\n",
@@ -1161,38 +1724,55 @@ static int __init xt_pknock_mt_init(void)
 		return -ENXIO;
 	}
 
-	crypto.tfm = crypto_alloc_hash(crypto.algo, 0, CRYPTO_ALG_ASYNC);
-	if (IS_ERR(crypto.tfm)) {
+	tfm = crypto_alloc_hash(crypto.algo, 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(tfm)) {
 		printk(KERN_ERR PKNOCK "failed to load transform for %s\n",
 						crypto.algo);
-		return PTR_ERR(crypto.tfm);
+		return PTR_ERR(tfm);
 	}
 
-	crypto.size = crypto_hash_digestsize(crypto.tfm);
-	crypto.desc.tfm = crypto.tfm;
-	crypto.desc.flags = 0;
+	/* Rules get their own keyed transforms; this one only tells the size. */
+	crypto.size = crypto_hash_digestsize(tfm);
+	crypto_free_hash(tfm);
+	if (crypto.size > PK_DIGEST_SIZE) {
+		printk(KERN_ERR PKNOCK "digest of %s too large\n", crypto.algo);
+		return -EINVAL;
+	}
 #else
 	pr_info("No crypto support for < 2.6.19\n");
 #endif
 
+	peer_cachep = kmem_cache_create("xt_pknock_peer", sizeof(struct peer),
+	              0, 0, NULL);
+	if (peer_cachep == NULL)
+		return -ENOMEM;
+
 	pde = proc_mkdir("xt_pknock", init_net__proc_net);
 	if (pde == NULL) {
 		printk(KERN_ERR PKNOCK "proc_mkdir() error in _init().\n");
-		return -ENXIO;
+		ret = -ENXIO;
+		goto out_cache;
 	}
-	return xt_register_match(&xt_pknock_mt_reg);
+	ret = xt_register_matches(xt_pknock_mt_reg, ARRAY_SIZE(xt_pknock_mt_reg));
+	if (ret < 0)
+		goto out_proc;
+	return 0;
+
+ out_proc:
+	remove_proc_entry("xt_pknock", init_net__proc_net);
+ out_cache:
+	kmem_cache_destroy(peer_cachep);
+	return ret;
 }
 
 static void __exit xt_pknock_mt_exit(void)
 {
 	remove_proc_entry("xt_pknock", init_net__proc_net);
-	xt_unregister_match(&xt_pknock_mt_reg);
+	xt_unregister_matches(xt_pknock_mt_reg, ARRAY_SIZE(xt_pknock_mt_reg));
+	/* Wait for peers still queued for freeing. */
+	rcu_barrier();
+	kmem_cache_destroy(peer_cachep);
 	kfree(rule_hashtable);
-
-#ifdef PK_CRYPTO
-	if (crypto.tfm != NULL)
-		crypto_free_hash(crypto.tfm);
-#endif
 }
 
 module_init(xt_pknock_mt_init);
@@ -45,9 +45,15 @@ struct xt_pknock_mtinfo {
 	uint32_t autoclose_time;
 };
 
+/*
+ * peer_ip is set for IPv4 peers only. The fields after it were appended
+ * for IPv6, so consumers that only know the first two still work for IPv4.
+ */
 struct xt_pknock_nl_msg {
 	char rule_name[XT_PKNOCK_MAX_BUF_LEN+1];
 	__be32 peer_ip;
+	__be32 peer_ip6[4];
+	uint8_t family;		/* NFPROTO_IPV4 or NFPROTO_IPV6 */
 };
 
 #endif /* _XT_PKNOCK_H */
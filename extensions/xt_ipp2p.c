@@ -1,6 +1,15 @@
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/version.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
+#include <net/ipv6.h>
 #include <net/tcp.h>
 #include <net/udp.h>
 #include <asm/unaligned.h>
@@ -19,9 +28,203 @@ MODULE_AUTHOR("Eicke Friedrich/Klaus Degner <ipp2p@ipp2p.org>");
 MODULE_DESCRIPTION("An extension to iptables to identify P2P traffic.");
 MODULE_LICENSE("GPL");
 
+static unsigned int reorder_interval __read_mostly;
+module_param(reorder_interval, uint, S_IRUGO);
+MODULE_PARM_DESC(reorder_interval, "sort signatures by hits every this many seconds (0 = keep their order)");
+
+/*
+ * Payload that is not in the linear area of the skb (GRO, scatter-gather)
+ * is copied, up to this many bytes, into a per-CPU scratch buffer.
+ */
+enum {
+	IPP2P_SCRATCH_SIZE = 2048,
+};
+
+/*
+ * @miss_skb, @miss_ct, @miss_mask, @miss_rule: the packet last counted as
+ * a miss in the connmark, and the rule that counted it (see ipp2p_ct_counted)
+ */
+struct ipp2p_scratch {
+	unsigned char buf[IPP2P_SCRATCH_SIZE];
+	const struct sk_buff *miss_skb;
+	const struct nf_conn *miss_ct;
+	const void *miss_rule;
+	unsigned int miss_mask;
+};
+
+static struct ipp2p_scratch *ipp2p_scratch __read_mostly;
+
+/*
+ * Strings that TCP signatures look for anywhere in the payload, rather than
+ * at fixed offsets. They all go into one Aho-Corasick automaton, so that a
+ * packet is scanned at most once, however many protocols are enabled.
+ *
+ * @min_start:	occurrences starting earlier are not of interest
+ * @count:	number of occurrences the signature needs to see (1 or 2)
+ */
+enum {
+	NEEDLE_WINMX_QUOTE,
+	NEEDLE_BIT_INFO_HASH,
+	NEEDLE_BIT_PEER_ID,
+	NEEDLE_BIT_PASSKEY,
+	NEEDLE_GNU_XGNUTELLA,
+	NEEDLE_GNU_XQUEUE,
+	NEEDLE_KAZAA_USERNAME,
+	NEEDLE_KAZAA_PEERENABLER,
+	NEEDLE_XDCC_SEND,
+	NEEDLE_MAX,
+
+	IPP2P_AC_STATES  = 256,
+	IPP2P_AC_CLASSES = 64,
+};
+
+static const struct {
+	const char *str;
+	unsigned int min_start, count;
+} ipp2p_needles[NEEDLE_MAX] = {
+	[NEEDLE_WINMX_QUOTE]       = {" \"", 4, 2},
+	[NEEDLE_BIT_INFO_HASH]     = {"info_hash", 0, 1},
+	[NEEDLE_BIT_PEER_ID]       = {"peer_id=", 0, 1},
+	[NEEDLE_BIT_PASSKEY]       = {"passkey=", 0, 1},
+	[NEEDLE_GNU_XGNUTELLA]     = {"\r\nX-Gnutella-", 0, 1},
+	[NEEDLE_GNU_XQUEUE]        = {"\r\nX-Queue:", 0, 1},
+	[NEEDLE_KAZAA_USERNAME]    = {"\r\nX-Kazaa-Username: ", 5, 1},
+	[NEEDLE_KAZAA_PEERENABLER] = {"\r\nUser-Agent: PeerEnabler/", 5, 1},
+	[NEEDLE_XDCC_SEND]         = {":xdcc send #", 10, 1},
+};
+
+/*
+ * The automaton as a DFA. Bytes that occur in no needle share class 0,
+ * which keeps the transition table small.
+ */
+static struct {
+	uint8_t class[256];
+	uint8_t next[IPP2P_AC_STATES][IPP2P_AC_CLASSES];
+	uint16_t out[IPP2P_AC_STATES];
+	unsigned int states;
+} ipp2p_ac __read_mostly;
+
+/*
+ * What the scan of one packet found: the start of the first (and second)
+ * occurrence of each needle at or after its min_start, or UINT_MAX.
+ * @avail:	bytes of payload that can be looked at; fewer than the packet
+ *		has if it was cut short by ipp2p_payload
+ */
+struct ipp2p_scan {
+	const unsigned char *payload;
+	unsigned int avail;
+	bool done;
+	unsigned int pos[NEEDLE_MAX][2];
+};
+
+static int __init ipp2p_ac_build(void)
+{
+	uint8_t fail[IPP2P_AC_STATES], queue[IPP2P_AC_STATES];
+	unsigned int classes = 1, head = 0, tail = 0;
+	unsigned int n, i, c, state, f;
+	const unsigned char *p;
+
+	memset(&ipp2p_ac, 0, sizeof(ipp2p_ac));
+	for (n = 0; n < NEEDLE_MAX; ++n)
+		for (p = (const void *)ipp2p_needles[n].str; *p != '\0'; ++p)
+			if (ipp2p_ac.class[*p] == 0) {
+				if (classes == IPP2P_AC_CLASSES)
+					return -E2BIG;
+				ipp2p_ac.class[*p] = classes++;
+			}
+
+	/* The trie; 0 in next[] means "no edge" until the DFA is filled in. */
+	ipp2p_ac.states = 1;
+	for (n = 0; n < NEEDLE_MAX; ++n) {
+		state = 0;
+		for (p = (const void *)ipp2p_needles[n].str; *p != '\0'; ++p) {
+			c = ipp2p_ac.class[*p];
+			if (ipp2p_ac.next[state][c] == 0) {
+				if (ipp2p_ac.states == IPP2P_AC_STATES)
+					return -E2BIG;
+				ipp2p_ac.next[state][c] = ipp2p_ac.states++;
+			}
+			state = ipp2p_ac.next[state][c];
+		}
+		ipp2p_ac.out[state] |= 1 << n;
+	}
+
+	/* Breadth-first, turn failure links into DFA transitions. */
+	fail[0] = 0;
+	for (c = 0; c < classes; ++c)
+		if (ipp2p_ac.next[0][c] != 0) {
+			fail[ipp2p_ac.next[0][c]] = 0;
+			queue[tail++] = ipp2p_ac.next[0][c];
+		}
+	while (head < tail) {
+		state = queue[head++];
+		f = fail[state];
+		ipp2p_ac.out[state] |= ipp2p_ac.out[f];
+		for (c = 0; c < classes; ++c) {
+			i = ipp2p_ac.next[state][c];
+			if (i == 0) {
+				ipp2p_ac.next[state][c] = ipp2p_ac.next[f][c];
+				continue;
+			}
+			fail[i] = ipp2p_ac.next[f][c];
+			queue[tail++] = i;
+		}
+	}
+	return 0;
+}
+
+/* Scans the payload once, on behalf of all signatures that need it. */
+static void ipp2p_ac_scan(struct ipp2p_scan *scan)
+{
+	const unsigned char *payload = scan->payload;
+	unsigned int pending = (1 << NEEDLE_MAX) - 1;
+	unsigned int i, n, start, out, state = 0;
+
+	scan->done = true;
+	for (n = 0; n < NEEDLE_MAX; ++n)
+		scan->pos[n][0] = scan->pos[n][1] = UINT_MAX;
+
+	for (i = 0; i < scan->avail; ++i) {
+		state = ipp2p_ac.next[state][ipp2p_ac.class[payload[i]]];
+		out   = ipp2p_ac.out[state] & pending;
+		if (likely(out == 0))
+			continue;
+		for (n = 0; n < NEEDLE_MAX; ++n) {
+			if (!(out & (1 << n)))
+				continue;
+			start = i + 1 - strlen(ipp2p_needles[n].str);
+			if (start < ipp2p_needles[n].min_start)
+				continue;
+			if (scan->pos[n][0] == UINT_MAX) {
+				scan->pos[n][0] = start;
+				if (ipp2p_needles[n].count == 1)
+					pending &= ~(1 << n);
+			} else {
+				scan->pos[n][1] = start;
+				pending &= ~(1 << n);
+			}
+		}
+		if (pending == 0)
+			break;
+	}
+}
+
+/*
+ * Returns where the @nth (0 or 1) occurrence of @needle starts,
+ * or UINT_MAX if there is none.
+ */
+static unsigned int
+ipp2p_needle(struct ipp2p_scan *scan, unsigned int needle, unsigned int nth)
+{
+	if (!scan->done)
+		ipp2p_ac_scan(scan);
+	return scan->pos[needle][nth];
+}
+
 /* Search for UDP eDonkey/eMule/Kad commands */
 static unsigned int
-udp_search_edk(const unsigned char *t, const unsigned int packet_len)
+udp_search_edk(const unsigned char *t, const unsigned int packet_len,
+    const unsigned int avail)
 {
 	if (packet_len < 4)
 		return 0;
@@ -139,7 +342,8 @@ udp_search_edk(const unsigned char *t, const unsigned int packet_len)
 
 /* Search for UDP Gnutella commands */
 static unsigned int
-udp_search_gnu(const unsigned char *t, const unsigned int packet_len)
+udp_search_gnu(const unsigned char *t, const unsigned int packet_len,
+    const unsigned int avail)
 {
 	if (packet_len >= 3 && memcmp(t, "GND", 3) == 0)
 		return IPP2P_GNU * 100 + 51;
@@ -150,9 +354,10 @@ udp_search_gnu(const unsigned char *t, const unsigned int packet_len)
 
 /* Search for UDP KaZaA commands */
 static unsigned int
-udp_search_kazaa(const unsigned char *t, const unsigned int packet_len)
+udp_search_kazaa(const unsigned char *t, const unsigned int packet_len,
+    const unsigned int avail)
 {
-	if (packet_len < 6)
+	if (packet_len < 6 || avail < packet_len)
 		return 0;
 	if (memcmp(t + packet_len - 6, "KaZaA\x00", 6) == 0)
 		return IPP2P_KAZAA * 100 + 50;
@@ -161,9 +366,10 @@ udp_search_kazaa(const unsigned char *t, const unsigned int packet_len)
 
 /* Search for UDP DirectConnect commands */
 static unsigned int udp_search_directconnect(const unsigned char *t,
-                                             const unsigned int packet_len)
+                                             const unsigned int packet_len,
+                                             const unsigned int avail)
 {
-	if (packet_len < 5)
+	if (packet_len < 5 || avail < packet_len)
 		return 0;
 	if (t[0] == 0x24 && t[packet_len-1] == 0x7c) {
 		if (memcmp(&t[1], "SR ", 3) == 0)
@@ -176,7 +382,8 @@ static unsigned int udp_search_directconnect(const unsigned char *t,
 
 /* Search for UDP BitTorrent commands */
 static unsigned int
-udp_search_bit(const unsigned char *haystack, const unsigned int packet_len)
+udp_search_bit(const unsigned char *haystack, const unsigned int packet_len,
+    const unsigned int avail)
 {
 	switch (packet_len) {
 	case 16:
@@ -260,7 +467,8 @@ udp_search_bit(const unsigned char *haystack, const unsigned int packet_len)
 
 /* Search for Ares commands */
 static unsigned int
-search_ares(const unsigned char *payload, const unsigned int plen)
+search_ares(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen < 3)
 		return 0;
@@ -312,7 +520,8 @@ search_ares(const unsigned char *payload, const unsigned int plen)
 
 /* Search for SoulSeek commands */
 static unsigned int
-search_soul(const unsigned char *payload, const unsigned int plen)
+search_soul(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen < 8)
 		return 0;
@@ -415,7 +624,7 @@ search_soul(const unsigned char *payload, const unsigned int plen)
 		uint32_t y = get_u32(payload, 5);
 
 		/* we need 19 chars + string */
-		if (y + 19 <= plen) {
+		if (scan->avail >= 19 && y <= scan->avail - 19) {
 			const unsigned char *w = payload + 9 + y;
 			if (get_u32(w, 0) == 0x01 &&
 			    (get_u16(w, 4) == 0x4600 ||
@@ -433,7 +642,8 @@ search_soul(const unsigned char *payload, const unsigned int plen)
 
 /* Search for WinMX commands */
 static unsigned int
-search_winmx(const unsigned char *payload, const unsigned int plen)
+search_winmx(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen == 4 && memcmp(payload, "SEND", 4) == 0)
 		return IPP2P_WINMX * 100 + 1;
@@ -446,21 +656,10 @@ search_winmx(const unsigned char *payload, const unsigned int plen)
 	if (plen < 10)
 		return 0;
 
-	if (memcmp(payload, "SEND", 4) == 0 || memcmp(payload, "GET", 3) == 0) {
-		uint16_t c = 4;
-		const uint16_t end = plen - 2;
-		uint8_t count = 0;
-
-		while (c < end) {
-			if (payload[c] == 0x20 && payload[c+1] == 0x22) {
-				c++;
-				count++;
-				if (count >= 2)
-					return IPP2P_WINMX * 100 + 3;
-			}
-			c++;
-		}
-	}
+	/* two times 0x20 0x22 */
+	if ((memcmp(payload, "SEND", 4) == 0 || memcmp(payload, "GET", 3) == 0) &&
+	    ipp2p_needle(scan, NEEDLE_WINMX_QUOTE, 1) < plen - 2)
+		return IPP2P_WINMX * 100 + 3;
 
 	if (plen == 149 && payload[0] == '8') {
 #ifdef IPP2P_DEBUG_WINMX
@@ -487,7 +686,8 @@ search_winmx(const unsigned char *payload, const unsigned int plen)
 
 /* Search for appleJuice commands */
 static unsigned int
-search_apple(const unsigned char *payload, const unsigned int plen)
+search_apple(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen > 7 && payload[6] == 0x0d && payload[7] == 0x0a &&
 	    memcmp(payload, "ajprot", 6) == 0)
@@ -498,7 +698,8 @@ search_apple(const unsigned char *payload, const unsigned int plen)
 
 /* Search for BitTorrent commands */
 static unsigned int
-search_bittorrent(const unsigned char *payload, const unsigned int plen)
+search_bittorrent(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen > 20) {
 		/* test for match 0x13+"BitTorrent protocol" */
@@ -511,11 +712,11 @@ search_bittorrent(const unsigned char *payload, const unsigned int plen)
 		 * but *must have* one (or more) of strings listed below (true for scrape and announce)
 		 */
 		if (memcmp(payload, "GET /", 5) == 0) {
-			if (HX_memmem(payload, plen, "info_hash=", 9) != NULL)
+			if (ipp2p_needle(scan, NEEDLE_BIT_INFO_HASH, 0) != UINT_MAX)
 				return IPP2P_BIT * 100 + 1;
-			if (HX_memmem(payload, plen, "peer_id=", 8) != NULL)
+			if (ipp2p_needle(scan, NEEDLE_BIT_PEER_ID, 0) != UINT_MAX)
 				return IPP2P_BIT * 100 + 2;
-			if (HX_memmem(payload, plen, "passkey=", 8) != NULL)
+			if (ipp2p_needle(scan, NEEDLE_BIT_PASSKEY, 0) != UINT_MAX)
 				return IPP2P_BIT * 100 + 4;
 		}
 	} else {
@@ -541,9 +742,10 @@ search_bittorrent(const unsigned char *payload, const unsigned int plen)
 
 /* check for Kazaa get command */
 static unsigned int
-search_kazaa(const unsigned char *payload, const unsigned int plen)
+search_kazaa(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
-	if (plen < 13)
+	if (plen < 13 || scan->avail < plen)
 		return 0;
 	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a &&
 	    memcmp(payload, "GET /.hash=", 11) == 0)
@@ -554,9 +756,10 @@ search_kazaa(const unsigned char *payload, const unsigned int plen)
 
 /* check for gnutella get command */
 static unsigned int
-search_gnu(const unsigned char *payload, const unsigned int plen)
+search_gnu(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
-	if (plen < 11)
+	if (plen < 11 || scan->avail < plen)
 		return 0;
 	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
 		if (memcmp(payload, "GET /get/", 9) == 0)
@@ -569,9 +772,10 @@ search_gnu(const unsigned char *payload, const unsigned int plen)
 
 /* check for gnutella get commands and other typical data */
 static unsigned int
-search_all_gnu(const unsigned char *payload, const unsigned int plen)
+search_all_gnu(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
-	if (plen < 11)
+	if (plen < 11 || scan->avail < plen)
 		return 0;
 	if (payload[plen-2] == 0x0d && payload[plen-1] == 0x0a) {
 		if (plen >= 19 && memcmp(payload, "GNUTELLA CONNECT/", 17) == 0)
@@ -579,18 +783,12 @@ search_all_gnu(const unsigned char *payload, const unsigned int plen)
 		if (memcmp(payload, "GNUTELLA/", 9) == 0)
 			return IPP2P_GNU * 100 + 2;
 
+		/* a header line starting with X-Gnutella- or X-Queue: */
 		if (plen >= 22 && (memcmp(payload, "GET /get/", 9) == 0 ||
-		    memcmp(payload, "GET /uri-res/", 13) == 0))
-		{
-			unsigned int c;
-
-			for (c = 0; c < plen - 22; ++c)
-				if (payload[c] == 0x0d &&
-				    payload[c+1] == 0x0a &&
-				    (memcmp(&payload[c+2], "X-Gnutella-", 11) == 0 ||
-				    memcmp(&payload[c+2], "X-Queue:", 8) == 0))
-					return IPP2P_GNU * 100 + 3;
-		}
+		    memcmp(payload, "GET /uri-res/", 13) == 0) &&
+		    (ipp2p_needle(scan, NEEDLE_GNU_XGNUTELLA, 0) < plen - 22 ||
+		    ipp2p_needle(scan, NEEDLE_GNU_XQUEUE, 0) < plen - 22))
+			return IPP2P_GNU * 100 + 3;
 	}
 	return 0;
 }
@@ -598,11 +796,10 @@ search_all_gnu(const unsigned char *payload, const unsigned int plen)
 /* check for KaZaA download commands and other typical data */
 /* plen is guaranteed to be >= 5 (see @matchlist) */
 static unsigned int
-search_all_kazaa(const unsigned char *payload, const unsigned int plen)
+search_all_kazaa(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
-	uint16_t c, end, rem;
-
-	if (plen < 7)
+	if (plen < 7 || scan->avail < plen)
 		/* too short for anything we test for - early bailout */
 		return 0;
 
@@ -619,27 +816,19 @@ search_all_kazaa(const unsigned char *payload, const unsigned int plen)
 		/* The next tests would not succeed anyhow. */
 		return 0;
 
-	end = plen - 18;
-	rem = plen - 5;
-	for (c = 5; c < end; ++c, --rem) {
-		if (payload[c] != 0x0d)
-			continue;
-		if (payload[c+1] != 0x0a)
-			continue;
-		if (rem >= 18 &&
-		    memcmp(&payload[c+2], "X-Kazaa-Username: ", 18) == 0)
-			return IPP2P_KAZAA * 100 + 2;
-		if (rem >= 24 &&
-		    memcmp(&payload[c+2], "User-Agent: PeerEnabler/", 24) == 0)
-			return IPP2P_KAZAA * 100 + 2;
-	}
+	/* a header line starting with X-Kazaa-Username: or User-Agent: ... */
+	if (ipp2p_needle(scan, NEEDLE_KAZAA_USERNAME, 0) < plen - 18 ||
+	    (plen >= 24 &&
+	    ipp2p_needle(scan, NEEDLE_KAZAA_PEERENABLER, 0) <= plen - 24))
+		return IPP2P_KAZAA * 100 + 2;
 
 	return 0;
 }
 
 /* fast check for edonkey file segment transfer command */
 static unsigned int
-search_edk(const unsigned char *payload, const unsigned int plen)
+search_edk(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen < 6)
 		return 0;
@@ -655,7 +844,8 @@ search_edk(const unsigned char *payload, const unsigned int plen)
 
 /* intensive but slower search for some edonkey packets including size-check */
 static unsigned int
-search_all_edk(const unsigned char *payload, const unsigned int plen)
+search_all_edk(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen < 6)
 		return 0;
@@ -680,7 +870,8 @@ search_all_edk(const unsigned char *payload, const unsigned int plen)
 
 /* fast check for Direct Connect send command */
 static unsigned int
-search_dc(const unsigned char *payload, const unsigned int plen)
+search_dc(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen < 6)
 		return 0;
@@ -696,9 +887,10 @@ search_dc(const unsigned char *payload, const unsigned int plen)
 
 /* intensive but slower check for all direct connect packets */
 static unsigned int
-search_all_dc(const unsigned char *payload, const unsigned int plen)
+search_all_dc(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
-	if (plen < 7)
+	if (plen < 7 || scan->avail < plen)
 		return 0;
 	if (payload[0] == 0x24 && payload[plen-1] == 0x7c) {
 		const unsigned char *t = &payload[1];
@@ -719,7 +911,8 @@ search_all_dc(const unsigned char *payload, const unsigned int plen)
 
 /* check for mute */
 static unsigned int
-search_mute(const unsigned char *payload, const unsigned int plen)
+search_mute(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen == 209 || plen == 345 || plen == 473 || plen == 609 ||
 	    plen == 1121) {
@@ -737,32 +930,25 @@ search_mute(const unsigned char *payload, const unsigned int plen)
 
 /* check for xdcc */
 static unsigned int
-search_xdcc(const unsigned char *payload, const unsigned int plen)
+search_xdcc(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	/* search in small packets only */
+	/*
+	 * is seems to be a irc private massage, chedck for
+	 * xdcc command
+	 */
 	if (plen > 20 && plen < 200 && payload[plen-1] == 0x0a &&
-	    payload[plen-2] == 0x0d && memcmp(payload, "PRIVMSG ", 8) == 0)
-	{
-		uint16_t x = 10;
-		const uint16_t end = plen - 13;
-
-		/*
-		 * is seems to be a irc private massage, chedck for
-		 * xdcc command
-		 */
-		while (x < end)	{
-			if (payload[x] == ':')
-				if (memcmp(&payload[x+1], "xdcc send #", 11) == 0)
-					return IPP2P_XDCC * 100 + 0;
-			x++;
-		}
-	}
+	    payload[plen-2] == 0x0d && memcmp(payload, "PRIVMSG ", 8) == 0 &&
+	    ipp2p_needle(scan, NEEDLE_XDCC_SEND, 0) < plen - 13)
+		return IPP2P_XDCC * 100 + 0;
 	return 0;
 }
 
 /* search for waste */
 static unsigned int
-search_waste(const unsigned char *payload, const unsigned int plen)
+search_waste(const unsigned char *payload, const unsigned int plen,
+    struct ipp2p_scan *scan)
 {
 	if (plen >= 8 && memcmp(payload, "GET.sha1:", 9) == 0)
 		return IPP2P_WASTE * 100 + 0;
@@ -773,7 +959,8 @@ search_waste(const unsigned char *payload, const unsigned int plen)
 static const struct {
 	unsigned int command;
 	unsigned int packet_len;
-	unsigned int (*function_name)(const unsigned char *, const unsigned int);
+	unsigned int (*function_name)(const unsigned char *, const unsigned int,
+	                              struct ipp2p_scan *);
 } matchlist[] = {
 	{IPP2P_EDK,         20, search_all_edk},
 	{IPP2P_DATA_KAZAA, 200, search_kazaa}, /* exp */
@@ -797,7 +984,8 @@ static const struct {
 static const struct {
 	unsigned int command;
 	unsigned int packet_len;
-	unsigned int (*function_name)(const unsigned char *, const unsigned int);
+	unsigned int (*function_name)(const unsigned char *, const unsigned int,
+	                              const unsigned int);
 } udp_list[] = {
 	{IPP2P_KAZAA, 14, udp_search_kazaa},
 	{IPP2P_BIT,   23, udp_search_bit},
@@ -807,42 +995,152 @@ static const struct {
 	{0},
 };
 
-static bool
-ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
+enum {
+	IPP2P_TCP_SIGS = ARRAY_SIZE(matchlist) - 1,
+	IPP2P_UDP_SIGS = ARRAY_SIZE(udp_list) - 1,
+	IPP2P_MAX_SIGS = IPP2P_TCP_SIGS > IPP2P_UDP_SIGS ?
+	                 IPP2P_TCP_SIGS : IPP2P_UDP_SIGS,
+};
+
+/* Signature names in /proc/net/xt_ipp2p, by IPP2N_* */
+static const char *const ipp2p_names[] = {
+	[IPP2N_EDK]        = "edk",
+	[IPP2N_DATA_KAZAA] = "kazaa-data",
+	[IPP2N_DATA_EDK]   = "edk-data",
+	[IPP2N_DATA_DC]    = "dc-data",
+	[IPP2N_DC]         = "dc",
+	[IPP2N_DATA_GNU]   = "gnu-data",
+	[IPP2N_GNU]        = "gnu",
+	[IPP2N_KAZAA]      = "kazaa",
+	[IPP2N_BIT]        = "bit",
+	[IPP2N_APPLE]      = "apple",
+	[IPP2N_SOUL]       = "soul",
+	[IPP2N_WINMX]      = "winmx",
+	[IPP2N_ARES]       = "ares",
+	[IPP2N_MUTE]       = "mute",
+	[IPP2N_WASTE]      = "waste",
+	[IPP2N_XDCC]       = "xdcc",
+};
+
+/*
+ * Per-CPU counters for each entry of matchlist and udp_list: how often it
+ * was run, how often it matched, and how many payload bytes it was given.
+ */
+struct ipp2p_stat {
+	u64 calls, hits, bytes;
+};
+
+struct ipp2p_stats {
+	struct ipp2p_stat tcp[IPP2P_TCP_SIGS], udp[IPP2P_UDP_SIGS];
+};
+
+static struct ipp2p_stats *ipp2p_stats __read_mostly;
+
+/*
+ * The order in which the lists are tried, as indices into them. With
+ * reorder_interval set, a new order is computed into the spare copy and
+ * swapped in under RCU.
+ */
+struct ipp2p_order {
+	uint8_t tcp[IPP2P_TCP_SIGS], udp[IPP2P_UDP_SIGS];
+};
+
+static struct ipp2p_order ipp2p_orders[2];
+static const struct ipp2p_order *ipp2p_order __read_mostly;
+static struct delayed_work ipp2p_reorder_work;
+
+/*
+ * Returns the @*len bytes of payload at @offset. If they are not all in the
+ * linear area, they are copied into this CPU's scratch buffer, and @*len is
+ * cut down to what fits there. Matches run with BHs disabled, so nobody else
+ * can use the buffer meanwhile.
+ */
+static const unsigned char *
+ipp2p_payload(const struct sk_buff *skb, unsigned int offset,
+    unsigned int *len)
 {
-	const struct ipt_p2p_info *info = par->matchinfo;
-	const unsigned char  *haystack;
-	const struct iphdr *ip = ip_hdr(skb);
-	bool p2p_result = false;
-	int i = 0;
-	unsigned int hlen = ntohs(ip->tot_len) - ip_hdrlen(skb);	/* hlen = packet-data length */
+	struct ipp2p_scratch *scratch;
 
-	/* must not be a fragment */
-	if (par->fragoff != 0) {
-		if (info->debug)
-			printk("IPP2P.match: offset found %d\n", par->fragoff);
-		return 0;
-	}
+	if (offset + *len > skb_headlen(skb))
+		*len = min_t(unsigned int, *len, IPP2P_SCRATCH_SIZE);
+	scratch = per_cpu_ptr(ipp2p_scratch, smp_processor_id());
+	return skb_header_pointer(skb, offset, *len, scratch->buf);
+}
 
-	/* make sure that skb is linear */
-	if (skb_is_nonlinear(skb)) {
-		if (info->debug)
-			printk("IPP2P.match: nonlinear skb found\n");
-		return 0;
-	}
+/*
+ * What connections are classified against when the verdict is cached:
+ * every protocol that iptables can select (the -data variants it cannot).
+ */
+enum {
+	IPP2P_CT_ALL = IPP2P_EDK | IPP2P_DC | IPP2P_GNU | IPP2P_KAZAA |
+	               IPP2P_BIT | IPP2P_APPLE | IPP2P_SOUL | IPP2P_WINMX |
+	               IPP2P_ARES | IPP2P_MUTE | IPP2P_WASTE | IPP2P_XDCC,
+};
+
+/*
+ * Where the transport header is, as IPv4 and IPv6 find it.
+ * @len:	length of transport header and payload
+ */
+struct ipp2p_packet {
+	unsigned int proto, thoff, len;
+};
+
+static void
+ipp2p_debug(const struct sk_buff *skb, const struct xt_action_param *par,
+    const char *proto, unsigned int result, __be16 sport, __be16 dport,
+    unsigned int hlen)
+{
+	if (par->family == NFPROTO_IPV6) {
+		const struct ipv6hdr *ip6 = ipv6_hdr(skb);
 
-	haystack = skb_network_header(skb) + ip_hdrlen(skb);
+		printk("IPP2P.debug:%s-match: %u from: [" NIP6_FMT "]:%u to: ["
+		       NIP6_FMT "]:%u Length: %u\n", proto, result,
+		       NIP6(ip6->saddr), ntohs(sport), NIP6(ip6->daddr),
+		       ntohs(dport), hlen);
+	} else {
+		const struct iphdr *ip = ip_hdr(skb);
+
+		printk("IPP2P.debug:%s-match: %u from: %u.%u.%u.%u:%u to: "
+		       "%u.%u.%u.%u:%u Length: %u\n", proto, result,
+		       NIPQUAD(ip->saddr), ntohs(sport), NIPQUAD(ip->daddr),
+		       ntohs(dport), hlen);
+	}
+}
 
-	switch (ip->protocol) {
+/*
+ * Runs the signatures of @cmd over the payload. Returns the first hit
+ * (IPP2P_xxx * 100 + signature) or 0, and the payload length in @*plen.
+ * Signatures get the real payload length, and separately how much of the
+ * payload they may look at.
+ */
+static unsigned int
+ipp2p_inspect(const struct sk_buff *skb, const struct xt_action_param *par,
+    const struct ipp2p_packet *pkt, unsigned int cmd, unsigned int *plen)
+{
+	const struct ipt_p2p_info *info = par->matchinfo;
+	const unsigned char  *haystack;
+	const struct ipp2p_order *order;
+	struct ipp2p_stats *stats;
+	unsigned int p2p_result = 0;
+	unsigned int i, k;
+	unsigned int hlen = pkt->len;	/* hlen = packet-data length */
+	unsigned int avail;		/* what of it can be looked at */
+
+	*plen = 0;
+	switch (pkt->proto) {
 	case IPPROTO_TCP:	/* what to do with a TCP packet */
 	{
-		const struct tcphdr *tcph = (const void *)ip + ip_hdrlen(skb);
+		struct tcphdr _tcph;
+		const struct tcphdr *tcph;
+		struct ipp2p_scan scan;
 
+		tcph = skb_header_pointer(skb, pkt->thoff, sizeof(_tcph), &_tcph);
+		if (tcph == NULL)
+			return 0;
 		if (tcph->fin) return 0;  /* if FIN bit is set bail out */
 		if (tcph->syn) return 0;  /* if SYN bit is set bail out */
 		if (tcph->rst) return 0;  /* if RST bit is set bail out */
 
-		haystack += tcph->doff * 4; /* get TCP-Header-Size */
 		if (tcph->doff * 4 > hlen) {
 			if (info->debug)
 				pr_info("TCP header indicated packet larger than it is\n");
@@ -850,19 +1148,33 @@ ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		} else {
 			hlen -= tcph->doff * 4;
 		}
-		while (matchlist[i].command) {
-			if ((info->cmd & matchlist[i].command) == matchlist[i].command &&
+		avail    = hlen;
+		haystack = ipp2p_payload(skb, pkt->thoff + tcph->doff * 4, &avail);
+		if (haystack == NULL)
+			return 0;
+		*plen        = hlen;
+		scan.payload = haystack;
+		scan.avail   = avail;
+		scan.done    = false;
+
+		order = rcu_dereference(ipp2p_order);
+		stats = per_cpu_ptr(ipp2p_stats, smp_processor_id());
+		for (k = 0; k < IPP2P_TCP_SIGS; ++k) {
+			i = order->tcp[k];
+			if ((cmd & matchlist[i].command) == matchlist[i].command &&
 			    hlen > matchlist[i].packet_len)
 			{
-				p2p_result = matchlist[i].function_name(haystack, hlen);
+				p2p_result = matchlist[i].function_name(haystack, hlen, &scan);
+				++stats->tcp[i].calls;
+				stats->tcp[i].bytes += avail;
 				if (p2p_result)	{
+					++stats->tcp[i].hits;
 					if (info->debug)
-						printk("IPP2P.debug:TCP-match: %i from: %u.%u.%u.%u:%i to: %u.%u.%u.%u:%i Length: %i\n",
-						       p2p_result, NIPQUAD(ip->saddr),ntohs(tcph->source), NIPQUAD(ip->daddr),ntohs(tcph->dest),hlen);
+						ipp2p_debug(skb, par, "TCP", p2p_result,
+						            tcph->source, tcph->dest, hlen);
 					return p2p_result;
 				}
 			}
-			i++;
 		}
 		return p2p_result;
 	}
@@ -870,9 +1182,13 @@ ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	case IPPROTO_UDP:	/* what to do with an UDP packet */
 	case IPPROTO_UDPLITE:
 	{
-		const struct udphdr *udph = (const void *)ip + ip_hdrlen(skb);
+		struct udphdr _udph;
+		const struct udphdr *udph;
+
+		udph = skb_header_pointer(skb, pkt->thoff, sizeof(_udph), &_udph);
+		if (udph == NULL)
+			return 0;
 
-		haystack += sizeof(*udph);
 		if (sizeof(*udph) > hlen) {
 			if (info->debug)
 				pr_info("UDP header indicated packet larger than it is\n");
@@ -880,20 +1196,30 @@ ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		} else {
 			hlen -= sizeof(*udph);
 		}
+		avail    = hlen;
+		haystack = ipp2p_payload(skb, pkt->thoff + sizeof(*udph), &avail);
+		if (haystack == NULL)
+			return 0;
+		*plen = hlen;
 
-		while (udp_list[i].command) {
-			if ((info->cmd & udp_list[i].command) == udp_list[i].command &&
+		order = rcu_dereference(ipp2p_order);
+		stats = per_cpu_ptr(ipp2p_stats, smp_processor_id());
+		for (k = 0; k < IPP2P_UDP_SIGS; ++k) {
+			i = order->udp[k];
+			if ((cmd & udp_list[i].command) == udp_list[i].command &&
 			    hlen > udp_list[i].packet_len)
 			{
-				p2p_result = udp_list[i].function_name(haystack, hlen);
+				p2p_result = udp_list[i].function_name(haystack, hlen, avail);
+				++stats->udp[i].calls;
+				stats->udp[i].bytes += avail;
 				if (p2p_result) {
+					++stats->udp[i].hits;
 					if (info->debug)
-						printk("IPP2P.debug:UDP-match: %i from: %u.%u.%u.%u:%i to: %u.%u.%u.%u:%i Length: %i\n",
-						       p2p_result, NIPQUAD(ip->saddr), ntohs(udph->source), NIPQUAD(ip->daddr), ntohs(udph->dest), hlen);
+						ipp2p_debug(skb, par, "UDP", p2p_result,
+						            udph->source, udph->dest, hlen);
 					return p2p_result;
 				}
 			}
-			i++;
 		}
 		return p2p_result;
 	}
@@ -903,25 +1229,374 @@ ipp2p_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	}
 }
 
-static struct xt_match ipp2p_mt_reg __read_mostly = {
-	.name       = "ipp2p",
-	.revision   = 1,
-	.family     = NFPROTO_IPV4,
-	.match      = ipp2p_mt,
-	.matchsize  = sizeof(struct ipt_p2p_info),
-	.me         = THIS_MODULE,
+static inline bool ipp2p_ct_tracked(const struct nf_conn *ct)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 36)
+	return !nf_ct_is_untracked(ct);
+#else
+	return ct != &nf_conntrack_untracked;
+#endif
+}
+
+/*
+ * Tells whether another rule with the same connmark bits has already
+ * counted this packet as a miss, and otherwise notes that this rule does.
+ * A packet goes through all rules of a table on one CPU with BHs disabled,
+ * so only it can be seen in between. The same rule seeing the same skb
+ * again means that the skb is being reused for a later packet.
+ */
+static bool ipp2p_ct_counted(const struct sk_buff *skb,
+    const struct nf_conn *ct, const struct ipt_p2p_info *info)
+{
+	struct ipp2p_scratch *scratch;
+
+	scratch = per_cpu_ptr(ipp2p_scratch, smp_processor_id());
+	if (scratch->miss_skb == skb && scratch->miss_ct == ct &&
+	    scratch->miss_mask == info->ct_mask && scratch->miss_rule != info)
+		return true;
+	scratch->miss_skb  = skb;
+	scratch->miss_ct   = ct;
+	scratch->miss_mask = info->ct_mask;
+	scratch->miss_rule = info;
+	return false;
+}
+
+/*
+ * Looks up, and updates, the verdict cached in the connmark (see
+ * IPP2P_CT_PROTO in xt_ipp2p.h). Connections are classified against all
+ * protocols, so that rules asking for different protocols can share the
+ * same bits; a rule matches if the protocol found is one of its own.
+ */
+static bool
+ipp2p_mt_ct(const struct sk_buff *skb, struct xt_action_param *par,
+    const struct ipp2p_packet *pkt, struct nf_conn *ct)
+{
+	const struct ipt_p2p_info *info = par->matchinfo;
+	unsigned int shift = ffs(info->ct_mask) - 1;
+	unsigned int state, result, plen;
+
+	state = (ct->mark & info->ct_mask) >> shift;
+	if (state >= IPP2P_CT_PROTO && state < IPP2P_CT_MISS)
+		return info->cmd & (1 << (state - IPP2P_CT_PROTO));
+	if (state >= IPP2P_CT_MISS + info->ct_packets)
+		return false;
+
+	result = ipp2p_inspect(skb, par, pkt, IPP2P_CT_ALL, &plen);
+	if (result != 0)
+		state = IPP2P_CT_PROTO + ffs(result / 100) - 1;
+	else if (plen == 0)
+		/* packets without payload tell nothing */
+		return false;
+	else if (ipp2p_ct_counted(skb, ct, info))
+		return false;
+	else if (state == 0)
+		state = IPP2P_CT_MISS + 1;
+	else
+		++state;
+
+	ct->mark = (ct->mark & ~info->ct_mask) | (state << shift);
+	return info->cmd & (result / 100);
+}
+
+/*
+ * Revision 1 rules have only @cmd and @debug, which are laid out as in
+ * struct ipt_p2p_info; @v2 tells whether the rest is there.
+ */
+static bool
+ipp2p_mt_common(const struct sk_buff *skb, struct xt_action_param *par,
+    const struct ipp2p_packet *pkt, bool v2)
+{
+	const struct ipt_p2p_info *info = par->matchinfo;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	unsigned int plen;
+
+	if (v2 && info->ct_mask != 0) {
+		ct = nf_ct_get(skb, &ctinfo);
+		if (ct != NULL && ipp2p_ct_tracked(ct))
+			return ipp2p_mt_ct(skb, par, pkt, ct);
+	}
+	return ipp2p_inspect(skb, par, pkt, info->cmd, &plen) != 0;
+}
+
+static bool
+ipp2p_mt4_rev(const struct sk_buff *skb, struct xt_action_param *par, bool v2)
+{
+	const struct ipt_p2p_info *info = par->matchinfo;
+	const struct iphdr *ip = ip_hdr(skb);
+	struct ipp2p_packet pkt;
+
+	/* must not be a fragment */
+	if (par->fragoff != 0) {
+		if (info->debug)
+			printk("IPP2P.match: offset found %d\n", par->fragoff);
+		return 0;
+	}
+
+	pkt.proto = ip->protocol;
+	pkt.thoff = par->thoff;
+	pkt.len   = ntohs(ip->tot_len) - ip_hdrlen(skb);
+	return ipp2p_mt_common(skb, par, &pkt, v2);
+}
+
+/*
+ * ip6tables only finds the transport header for rules with -p, so walk the
+ * extension headers here.
+ */
+static bool
+ipp2p_mt6_rev(const struct sk_buff *skb, struct xt_action_param *par, bool v2)
+{
+	const struct ipt_p2p_info *info = par->matchinfo;
+	struct ipp2p_packet pkt;
+	unsigned int thoff = 0;
+	unsigned short fragoff = 0;
+	int proto;
+
+	proto = ipv6_find_hdr(skb, &thoff, -1, &fragoff);
+	if (proto < 0)
+		return false;
+	if (fragoff != 0) {
+		if (info->debug)
+			printk("IPP2P.match: offset found %u\n", fragoff);
+		return false;
+	}
+
+	pkt.proto = proto;
+	pkt.thoff = thoff;
+	pkt.len   = sizeof(struct ipv6hdr) + ntohs(ipv6_hdr(skb)->payload_len);
+	if (pkt.len < thoff)
+		return false;
+	pkt.len  -= thoff;
+	return ipp2p_mt_common(skb, par, &pkt, v2);
+}
+
+static bool
+ipp2p_mt4_v1(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	return ipp2p_mt4_rev(skb, par, false);
+}
+
+static bool
+ipp2p_mt4(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	return ipp2p_mt4_rev(skb, par, true);
+}
+
+static bool
+ipp2p_mt6_v1(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	return ipp2p_mt6_rev(skb, par, false);
+}
+
+static bool
+ipp2p_mt6(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	return ipp2p_mt6_rev(skb, par, true);
+}
+
+static int ipp2p_mt_check(const struct xt_mtchk_param *par)
+{
+	const struct ipt_p2p_info *info = par->matchinfo;
+	unsigned int field;
+
+	if (info->ct_mask == 0)
+		return 0;
+	field = info->ct_mask >> (ffs(info->ct_mask) - 1);
+	if ((field & (field + 1)) != 0) {
+		printk(KERN_WARNING KBUILD_MODNAME
+		       ": connmark mask must be a contiguous range of bits\n");
+		return -EINVAL;
+	}
+	if (info->ct_packets == 0 || field < IPP2P_CT_MISS ||
+	    info->ct_packets > field - IPP2P_CT_MISS) {
+		printk(KERN_WARNING KBUILD_MODNAME
+		       ": connmark mask too narrow for %u packets\n",
+		       info->ct_packets);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void
+ipp2p_stat_sum(struct ipp2p_stat *sum, bool tcp, unsigned int i)
+{
+	const struct ipp2p_stats *stats;
+	const struct ipp2p_stat *stat;
+	unsigned int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(ipp2p_stats, cpu);
+		stat  = tcp ? &stats->tcp[i] : &stats->udp[i];
+		sum->calls += stat->calls;
+		sum->hits  += stat->hits;
+		sum->bytes += stat->bytes;
+	}
+}
+
+/* Sorts by hits, descending; ties keep their place in the list. */
+static void ipp2p_sort(uint8_t *order, bool tcp, unsigned int n)
+{
+	u64 hits[IPP2P_MAX_SIGS];
+	struct ipp2p_stat sum;
+	unsigned int i, j;
+	uint8_t x;
+
+	for (i = 0; i < n; ++i) {
+		ipp2p_stat_sum(&sum, tcp, i);
+		hits[i]  = sum.hits;
+		order[i] = i;
+	}
+	for (i = 1; i < n; ++i) {
+		x = order[i];
+		for (j = i; j > 0 && hits[order[j-1]] < hits[x]; --j)
+			order[j] = order[j-1];
+		order[j] = x;
+	}
+}
+
+static void ipp2p_reorder(struct work_struct *work)
+{
+	struct ipp2p_order *next;
+
+	next = &ipp2p_orders[ipp2p_order == &ipp2p_orders[0]];
+	ipp2p_sort(next->tcp, true, IPP2P_TCP_SIGS);
+	ipp2p_sort(next->udp, false, IPP2P_UDP_SIGS);
+	rcu_assign_pointer(ipp2p_order, next);
+	/* The old order becomes the spare; nobody may still be reading it. */
+	synchronize_rcu();
+	schedule_delayed_work(&ipp2p_reorder_work, reorder_interval * HZ);
+}
+
+static int ipp2p_stat_show(struct seq_file *seq, void *v)
+{
+	struct ipp2p_stat sum;
+	unsigned int i;
+
+	seq_printf(seq, "proto signature calls hits bytes\n");
+	for (i = 0; i < IPP2P_TCP_SIGS; ++i) {
+		ipp2p_stat_sum(&sum, true, i);
+		seq_printf(seq, "tcp %s %llu %llu %llu\n",
+		           ipp2p_names[ffs(matchlist[i].command) - 1],
+		           (unsigned long long)sum.calls,
+		           (unsigned long long)sum.hits,
+		           (unsigned long long)sum.bytes);
+	}
+	for (i = 0; i < IPP2P_UDP_SIGS; ++i) {
+		ipp2p_stat_sum(&sum, false, i);
+		seq_printf(seq, "udp %s %llu %llu %llu\n",
+		           ipp2p_names[ffs(udp_list[i].command) - 1],
+		           (unsigned long long)sum.calls,
+		           (unsigned long long)sum.hits,
+		           (unsigned long long)sum.bytes);
+	}
+	return 0;
+}
+
+static int ipp2p_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ipp2p_stat_show, NULL);
+}
+
+static const struct file_operations ipp2p_stat_fops = {
+	.open    = ipp2p_stat_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.owner   = THIS_MODULE,
+};
+
+static struct xt_match ipp2p_mt_reg[] __read_mostly = {
+	{
+		.name       = "ipp2p",
+		.revision   = 1,
+		.family     = NFPROTO_IPV4,
+		.match      = ipp2p_mt4_v1,
+		.matchsize  = sizeof(struct ipt_p2p_info_v1),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "ipp2p",
+		.revision   = 1,
+		.family     = NFPROTO_IPV6,
+		.match      = ipp2p_mt6_v1,
+		.matchsize  = sizeof(struct ipt_p2p_info_v1),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "ipp2p",
+		.revision   = 2,
+		.family     = NFPROTO_IPV4,
+		.match      = ipp2p_mt4,
+		.checkentry = ipp2p_mt_check,
+		.matchsize  = sizeof(struct ipt_p2p_info),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "ipp2p",
+		.revision   = 2,
+		.family     = NFPROTO_IPV6,
+		.match      = ipp2p_mt6,
+		.checkentry = ipp2p_mt_check,
+		.matchsize  = sizeof(struct ipt_p2p_info),
+		.me         = THIS_MODULE,
+	},
 };
 
 static int __init ipp2p_mt_init(void)
 {
-	return xt_register_match(&ipp2p_mt_reg);
+	unsigned int i;
+	int ret;
+
+	ret = ipp2p_ac_build();
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < IPP2P_TCP_SIGS; ++i)
+		ipp2p_orders[0].tcp[i] = i;
+	for (i = 0; i < IPP2P_UDP_SIGS; ++i)
+		ipp2p_orders[0].udp[i] = i;
+	ipp2p_order = &ipp2p_orders[0];
+
+	ret = -ENOMEM;
+	ipp2p_scratch = alloc_percpu(struct ipp2p_scratch);
+	if (ipp2p_scratch == NULL)
+		goto out;
+	ipp2p_stats = alloc_percpu(struct ipp2p_stats);
+	if (ipp2p_stats == NULL)
+		goto out_scratch;
+	if (proc_create("xt_ipp2p", S_IRUGO, init_net__proc_net,
+	    &ipp2p_stat_fops) == NULL)
+		goto out_stats;
+	ret = xt_register_matches(ipp2p_mt_reg, ARRAY_SIZE(ipp2p_mt_reg));
+	if (ret < 0)
+		goto out_proc;
+
+	INIT_DELAYED_WORK(&ipp2p_reorder_work, ipp2p_reorder);
+	if (reorder_interval != 0)
+		schedule_delayed_work(&ipp2p_reorder_work,
+		                      reorder_interval * HZ);
+	return 0;
+
+ out_proc:
+	remove_proc_entry("xt_ipp2p", init_net__proc_net);
+ out_stats:
+	free_percpu(ipp2p_stats);
+ out_scratch:
+	free_percpu(ipp2p_scratch);
+ out:
+	return ret;
 }
 
 static void __exit ipp2p_mt_exit(void)
 {
-	xt_unregister_match(&ipp2p_mt_reg);
+	xt_unregister_matches(ipp2p_mt_reg, ARRAY_SIZE(ipp2p_mt_reg));
+	cancel_delayed_work_sync(&ipp2p_reorder_work);
+	remove_proc_entry("xt_ipp2p", init_net__proc_net);
+	free_percpu(ipp2p_stats);
+	free_percpu(ipp2p_scratch);
 }
 
 module_init(ipp2p_mt_init);
 module_exit(ipp2p_mt_exit);
 MODULE_ALIAS("ipt_ipp2p");
+MODULE_ALIAS("ip6t_ipp2p");
@@ -38,9 +38,28 @@ enum {
 	IPP2P_XDCC       = 1 << IPP2N_XDCC,
 };
 
+/*
+ * With a non-zero @ct_mask, the verdict on a connection is kept in these
+ * (contiguous) bits of its connmark: 0 while unknown, IPP2P_CT_PROTO + n
+ * once it matched protocol IPP2N_n, and IPP2P_CT_MISS + k after k packets
+ * with payload did not match. At k == @ct_packets, it is taken to be no P2P.
+ */
+enum {
+	IPP2P_CT_PROTO = 1,
+	IPP2P_CT_MISS  = IPP2P_CT_PROTO + IPP2N_XDCC + 1,
+};
+
+/* Revision 2; revision 1 ends after @debug. */
 struct ipt_p2p_info {
     int cmd;
     int debug;
+    unsigned int ct_mask;
+    unsigned int ct_packets;
+};
+
+struct ipt_p2p_info_v1 {
+    int cmd;
+    int debug;
 };
 
 #endif //__IPT_IPP2P_H
@@ -178,6 +178,7 @@ lscan_mt(const struct sk_buff *skb, struct xt_action_param *par)
 	const struct tcphdr *tcph;
 	struct nf_conn *ctdata;
 	struct tcphdr tcph_buf;
+	unsigned int state;
 
 	tcph = skb_header_pointer(skb, par->thoff, sizeof(tcph_buf), &tcph_buf);
 	if (tcph == NULL)
@@ -194,26 +195,38 @@ lscan_mt(const struct sk_buff *skb, struct xt_action_param *par)
 		return false;
 	}
 
+	/*
+	 * Connections found to be valid stay so. Leave them alone right away,
+	 * without touching either mark.
+	 */
+	state = ctdata->mark & connmark_mask;
+	if (state == mark_valid)
+		return false;
+
 	/*
 	 * If -m lscan was previously applied to this packet, the rules we
-	 * simulate must not be run through again. And for speedup, do not call
-	 * it either when the connection is already VALID.
+	 * simulate must not be run through again. Only packets that move the
+	 * connection to another state are marked for this; running the rules
+	 * again for one that did not would just yield the same state.
 	 */
-	if ((ctdata->mark & connmark_mask) == mark_valid ||
-	     (skb_nfmark(skb) & packet_mask) != mark_seen) {
+	if ((skb_nfmark(skb) & packet_mask) != mark_seen) {
 		unsigned int n;
 
-		n = lscan_mt_full(ctdata->mark & connmark_mask, ctstate,
+		n = lscan_mt_full(state, ctstate,
 		    par->in == init_net__loopback_dev, tcph,
 		    skb->len - par->thoff - 4 * tcph->doff);
 
-		ctdata->mark = (ctdata->mark & ~connmark_mask) | n;
-		skb_nfmark(skb) = (skb_nfmark(skb) & ~packet_mask) ^ mark_seen;
+		if (n != state) {
+			ctdata->mark = (ctdata->mark & ~connmark_mask) | n;
+			skb_nfmark(skb) = (skb_nfmark(skb) & ~packet_mask) ^
+			                  mark_seen;
+			state = n;
+		}
 	}
 
-	return (info->match_syn && ctdata->mark == mark_synscan) ||
-	       (info->match_cn && ctdata->mark == mark_cnscan) ||
-	       (info->match_gr && ctdata->mark == mark_grscan);
+	return (info->match_syn && state == mark_synscan) ||
+	       (info->match_cn && state == mark_cnscan) ||
+	       (info->match_gr && state == mark_grscan);
 }
 
 static int lscan_mt_check(const struct xt_mtchk_param *par)
@@ -21,12 +21,28 @@
 */
 
 #define pr_fmt(x) KBUILD_MODNAME ": " x
+#include <linux/jhash.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/ratelimit.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <net/dsfield.h>
+#include <net/genetlink.h>
+#include <net/ipv6.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+#	include <net/net_namespace.h>
+#	include <net/netns/generic.h>
+#endif
 #include <net/tcp.h>
 #include <linux/spinlock.h>
+#include <linux/netfilter.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter/x_tables.h>
 #include "xt_psd.h"
@@ -39,6 +55,7 @@ MODULE_AUTHOR("Jan Rekorajski <baggins@pld.org.pl>");
 MODULE_AUTHOR(" Mohd Nawawi Mohamad Jamili <nawawi@tracenetworkcorporation.com>");
 MODULE_DESCRIPTION("Xtables: PSD - portscan detection");
 MODULE_ALIAS("ipt_psd");
+MODULE_ALIAS("ip6t_psd");
 
 #define HF_DADDR_CHANGING   0x01
 #define HF_SPORT_CHANGING   0x02
@@ -61,8 +78,8 @@ struct port {
 struct host {
 	struct host *next;						/* Next entry with the same hash */
 	unsigned long timestamp;					/* Last update time */
-	struct in_addr src_addr;				/* Source address */
-	struct in_addr dest_addr;				/* Destination address */
+	union nf_inet_addr src_addr;			/* Source address (or prefix) */
+	union nf_inet_addr dest_addr;			/* Destination address */
 	unsigned short src_port;				/* Source port */
 	int count;								/* Number of ports in the list */
 	int weight;								/* Total weight of ports in the list */
@@ -70,110 +87,176 @@ struct host {
 	unsigned char tos;						/* TOS */
 	unsigned char ttl;						/* TTL */
 	unsigned char flags;					/* HF_ flags bitmask */
+	u_int8_t family;						/* NFPROTO_*, 0 if unused */
 };
 
 /*
- * State information.
+ * The parts of a packet that the scan detection looks at.
  */
-static struct {
+struct psd_packet {
+	struct net *net;
+	union nf_inet_addr src_addr, dest_addr;
+	const struct tcphdr *tcph;	/* NULL for UDP */
+	u_int16_t src_port, dest_port;
+	u_int8_t family, proto, tcp_flags, tos, ttl;
+};
+
+/*
+ * State information. The source addresses are partitioned by hash value
+ * into independently locked shards, so that packets from different sources
+ * rarely contend for the same lock. Each shard owns an equal part of the
+ * list and of the hash table. Every network namespace has its own set of
+ * shards, sized from the module parameters at the time it is created.
+ */
+#define SHARD_LOG			4
+#define SHARD_COUNT			(1 << SHARD_LOG)
+
+struct psd_shard {
 	spinlock_t lock;
-	struct host list[LIST_SIZE];	/* List of source addresses */
-	struct host *hash[HASH_SIZE];	/* Hash: pointers into the list */
-	int index;						/* Oldest entry to be replaced */
-} state;
+	struct host *list;		/* List of source addresses */
+	struct host **hash;		/* Hash: pointers into the list */
+	unsigned int list_size;		/* Number of entries in list */
+	unsigned int hash_size;		/* Number of buckets in hash */
+	unsigned int index;		/* Oldest entry to be replaced */
+	unsigned long evicted;		/* Entries in use that were replaced */
+	unsigned long chain_drops;	/* Entries unhashed due to HASH_MAX */
+} ____cacheline_aligned_in_smp;
+
+struct psd_net {
+	struct psd_shard shard[SHARD_COUNT];
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+static int psd_net_id;
+static inline struct psd_net *psd_pernet(struct net *net)
+{
+	return net_generic(net, psd_net_id);
+}
+#else
+static struct psd_net psd_net;
+#define psd_pernet(x) (&psd_net)
+#endif
+
+static u_int32_t psd_hash_rnd;
+
+static unsigned int list_size = LIST_SIZE;
+static unsigned int hash_size = HASH_SIZE;
+module_param(list_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(list_size, "number of source addresses to keep track of "
+	"(for namespaces created after the change)");
+module_param(hash_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hash_size, "number of hash buckets for source lookup "
+	"(for namespaces created after the change)");
+
+static unsigned int psd_notify_burst = 100;
+module_param_named(notify_burst, psd_notify_burst, uint, S_IRUGO);
+MODULE_PARM_DESC(notify_burst, "maximum number of events sent per second");
+
+static DEFINE_RATELIMIT_STATE(psd_notify_rs, HZ, 100);
+
+static struct genl_family psd_genl_family = {
+	.id      = GENL_ID_GENERATE,
+	.name    = XT_PSD_GENL_NAME,
+	.version = 1,
+	.maxattr = XT_PSD_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	.netnsok = true,
+#endif
+};
+
+static struct genl_multicast_group psd_genl_mcgrp = {
+	.name = XT_PSD_GENL_MCGRP,
+};
 
 /*
- * Convert an IP address into a hash table index.
+ * Convert an IP address into a hash value. The value is keyed with a
+ * random seed, so that sources colliding in the table cannot be chosen
+ * up front. The low SHARD_LOG bits select the shard, the remaining ones
+ * the bucket within it (see shard_bucket).
  */
-static inline int hashfunc(struct in_addr addr)
+static inline u_int32_t hashfunc(const union nf_inet_addr *addr,
+    u_int8_t family)
 {
-	unsigned int value;
-	int hash;
+	return jhash2((const u_int32_t *)addr->ip6, 4, psd_hash_rnd ^ family);
+}
 
-	value = addr.s_addr;
-	hash = 0;
-	do {
-		hash ^= value;
-	} while ((value >>= HASH_LOG) != 0);
+static inline struct host **
+shard_bucket(struct psd_shard *shard, u_int32_t hash)
+{
+	return &shard->hash[(hash >> SHARD_LOG) % shard->hash_size];
+}
 
-	return hash & (HASH_SIZE - 1);
+/*
+ * Announce a newly detected scanner. Events beyond notify_burst per second
+ * are dropped; the rule keeps matching regardless.
+ */
+static void psd_notify(const struct psd_packet *pkt, unsigned int ports,
+    unsigned int weight)
+{
+	unsigned int addrlen = (pkt->family == NFPROTO_IPV6) ?
+	                       sizeof(pkt->src_addr.in6) : sizeof(pkt->src_addr.in);
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!__ratelimit(&psd_notify_rs))
+		return;
+	skb = genlmsg_new(nla_total_size(sizeof(u_int8_t)) +
+	      nla_total_size(addrlen) +
+	      2 * nla_total_size(sizeof(u_int32_t)), GFP_ATOMIC);
+	if (skb == NULL)
+		return;
+	hdr = genlmsg_put(skb, 0, 0, &psd_genl_family, 0, XT_PSD_CMD_SCANNER);
+	if (hdr == NULL)
+		goto nla_put_failure;
+	NLA_PUT_U8(skb, XT_PSD_ATTR_FAMILY, pkt->family);
+	NLA_PUT(skb, XT_PSD_ATTR_SRC, addrlen, &pkt->src_addr);
+	NLA_PUT_U32(skb, XT_PSD_ATTR_PORTS, ports);
+	NLA_PUT_U32(skb, XT_PSD_ATTR_WEIGHT, weight);
+	genlmsg_end(skb, hdr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	genlmsg_multicast_netns(pkt->net, skb, 0, psd_genl_mcgrp.id, GFP_ATOMIC);
+#else
+	genlmsg_multicast(skb, 0, psd_genl_mcgrp.id, GFP_ATOMIC);
+#endif
+	return;
+
+ nla_put_failure:
+	kfree_skb(skb);
 }
 
+/*
+ * Run the scan detection for one packet. Common to IPv4 and IPv6.
+ */
 static bool
-xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
+psd_process(const struct psd_packet *pkt, const struct xt_psd_info *psdinfo)
 {
-	const struct iphdr *iph;
-	const struct tcphdr *tcph = NULL;
-	const struct udphdr *udph;
-	union {
-		struct tcphdr tcph;
-		struct udphdr udph;
-	} _buf;
-	struct in_addr addr;
-	u_int16_t src_port,dest_port;
-  	u_int8_t tcp_flags, proto;
+	const struct tcphdr *tcph = pkt->tcph;
+	u_int16_t src_port = pkt->src_port, dest_port = pkt->dest_port;
+	u_int8_t tcp_flags = pkt->tcp_flags, proto = pkt->proto;
 	unsigned long now;
-	struct host *curr, *last, **head;
-	int hash, index, count;
-	/* Parameters from userspace */
-	const struct xt_psd_info *psdinfo = match->matchinfo;
-
-	/* IP header */
-	iph = ip_hdr(pskb);
-
-	/* Sanity check */
-	if (iph->frag_off & htons(IP_OFFSET)) {
-		pr_debug("sanity check failed\n");
-		return false;
-	}
-
-	/* TCP or UDP ? */
-	proto = iph->protocol;
-	/* Get the source address, source & destination ports, and TCP flags */
-
-	addr.s_addr = iph->saddr;
-	/* We're using IP address 0.0.0.0 for a special purpose here, so don't let
-	 * them spoof us. [DHCP needs this feature - HW] */
-	if (addr.s_addr == 0) {
-		pr_debug("spoofed source address (0.0.0.0)\n");
-		return false;
-	}
-
-	if (proto == IPPROTO_TCP) {
-		tcph = skb_header_pointer(pskb, match->thoff,
-		       sizeof(_buf.tcph), &_buf.tcph);
-		if (tcph == NULL)
-			return false;
-
-		/* Yep, it's dirty */
-		src_port = tcph->source;
-		dest_port = tcph->dest;
-		tcp_flags = *((u_int8_t*)tcph + 13);
-	} else if (proto == IPPROTO_UDP || proto == IPPROTO_UDPLITE) {
-		udph = skb_header_pointer(pskb, match->thoff,
-		       sizeof(_buf.udph), &_buf.udph);
-		if (udph == NULL)
-			return false;
-		src_port  = udph->source;
-		dest_port = udph->dest;
-		tcp_flags = 0;
-	} else {
-		pr_debug("protocol not supported\n");
-		return false;
-	}
+	struct host *curr, *last, **head, **bucket;
+	struct psd_shard *shard;
+	u_int32_t hash;
+	int index, count;
+	unsigned int ports, weight;
 
 	/* Use jiffies here not to depend on someone setting the time while we're
 	 * running; we need to be careful with possible return value overflows. */
 	now = jiffies;
 
-	spin_lock(&state.lock);
+	hash  = hashfunc(&pkt->src_addr, pkt->family);
+	shard = &psd_pernet(pkt->net)->shard[hash & (SHARD_COUNT - 1)];
+	spin_lock(&shard->lock);
 
 	/* Do we know this source address already? */
 	count = 0;
 	last = NULL;
-	if ((curr = *(head = &state.hash[hash = hashfunc(addr)])) != NULL)
+	bucket = shard_bucket(shard, hash);
+	if ((curr = *(head = bucket)) != NULL)
 		do {
-			if (curr->src_addr.s_addr == addr.s_addr)
+			if (curr->family == pkt->family &&
+			    memcmp(&curr->src_addr, &pkt->src_addr,
+			    sizeof(curr->src_addr)) == 0)
 				break;
 			count++;
 			if (curr->next != NULL)
@@ -208,13 +291,14 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 				goto out_match;
 
 			/* Specify if destination address, source port, TOS or TTL are not fixed */
-			if (curr->dest_addr.s_addr != iph->daddr)
+			if (memcmp(&curr->dest_addr, &pkt->dest_addr,
+			    sizeof(curr->dest_addr)) != 0)
 				curr->flags |= HF_DADDR_CHANGING;
 			if (curr->src_port != src_port)
 				curr->flags |= HF_SPORT_CHANGING;
-			if (curr->tos != iph->tos)
+			if (curr->tos != pkt->tos)
 				curr->flags |= HF_TOS_CHANGING;
-			if (curr->ttl != iph->ttl)
+			if (curr->ttl != pkt->ttl)
 				curr->flags |= HF_TTL_CHANGING;
 
 			/* Update the total weight */
@@ -223,8 +307,11 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 
 			/* Got enough destination ports to decide that this is a scan? */
 			/* Then log it and drop the packet. */
-			if (curr->weight >= psdinfo->weight_threshold)
-				goto out_match;
+			if (curr->weight >= psdinfo->weight_threshold) {
+				ports  = curr->count + 1;
+				weight = curr->weight;
+				goto out_detected;
+			}
 
 			/* Remember the new port */
 			if (curr->count < SCAN_MAX_COUNT) {
@@ -241,7 +328,7 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 		/* We know this address, but the entry is outdated. Mark it unused, and
 		 * remove from the hash table. We'll allocate a new entry instead since
 		 * this one might get re-used too soon. */
-		curr->src_addr.s_addr = 0;
+		curr->family = 0;
 		if (last != NULL)
 			last->next = last->next->next;
 		else if (*head != NULL)
@@ -256,22 +343,28 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 	/* Got too many source addresses with the same hash value? Then remove the
 	 * oldest one from the hash table, so that they can't take too much of our
 	 * CPU time even with carefully chosen spoofed IP addresses. */
-	if (count >= HASH_MAX && last != NULL)
+	if (count >= HASH_MAX && last != NULL) {
 		last->next = NULL;
+		++shard->chain_drops;
+	}
 
 	/* We're going to re-use the oldest list entry, so remove it from the hash
 	 * table first (if it is really already in use, and isn't removed from the
 	 * hash table already because of the HASH_MAX check above). */
 
 	/* First, find it */
-	if (state.list[state.index].src_addr.s_addr != 0)
-		head = &state.hash[hashfunc(state.list[state.index].src_addr)];
-	else
+	if (shard->list[shard->index].family != 0) {
+		head = shard_bucket(shard,
+		       hashfunc(&shard->list[shard->index].src_addr,
+		       shard->list[shard->index].family));
+		++shard->evicted;
+	} else {
 		head = &last;
+	}
 	last = NULL;
 	if ((curr = *head) != NULL)
 		do {
-			if (curr == &state.list[state.index])
+			if (curr == &shard->list[shard->index])
 				break;
 			last = curr;
 		} while ((curr = curr->next) != NULL);
@@ -285,19 +378,20 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 	}
 
 	/* Get our list entry */
-	curr = &state.list[state.index++];
-	if (state.index >= LIST_SIZE)
-		state.index = 0;
+	curr = &shard->list[shard->index++];
+	if (shard->index >= shard->list_size)
+		shard->index = 0;
 
 	/* Link it into the hash table */
-	head = &state.hash[hash];
+	head = bucket;
 	curr->next = *head;
 	*head = curr;
 
 	/* And fill in the fields */
 	curr->timestamp = now;
-	curr->src_addr = addr;
-	curr->dest_addr.s_addr = iph->daddr;
+	curr->family = pkt->family;
+	curr->src_addr = pkt->src_addr;
+	curr->dest_addr = pkt->dest_addr;
 	curr->src_port = src_port;
 	curr->count = 1;
 	curr->weight = (ntohs(dest_port) < 1024) ? psdinfo->lo_ports_weight : psdinfo->hi_ports_weight;
@@ -305,36 +399,344 @@ xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
 	curr->ports[0].proto = proto;
 	curr->ports[0].and_flags = tcp_flags;
 	curr->ports[0].or_flags = tcp_flags;
-	curr->tos = iph->tos;
-	curr->ttl = iph->ttl;
+	curr->tos = pkt->tos;
+	curr->ttl = pkt->ttl;
 
 out_no_match:
-	spin_unlock(&state.lock);
+	spin_unlock(&shard->lock);
 	return false;
 
 out_match:
-	spin_unlock(&state.lock);
+	spin_unlock(&shard->lock);
+	return true;
+
+out_detected:
+	spin_unlock(&shard->lock);
+	if (psdinfo->flags & XT_PSD_NOTIFY)
+		psd_notify(pkt, ports, weight);
+	return true;
+}
+
+/*
+ * Fill in the transport part of @pkt; the TCP header is copied to @tcpbuf.
+ */
+static bool psd_get_ports(const struct sk_buff *skb, unsigned int thoff,
+    struct psd_packet *pkt, struct tcphdr *tcpbuf)
+{
+	const struct udphdr *udph;
+	struct udphdr _udph;
+
+	if (pkt->proto == IPPROTO_TCP) {
+		pkt->tcph = skb_header_pointer(skb, thoff, sizeof(*tcpbuf), tcpbuf);
+		if (pkt->tcph == NULL)
+			return false;
+
+		/* Yep, it's dirty */
+		pkt->src_port  = pkt->tcph->source;
+		pkt->dest_port = pkt->tcph->dest;
+		pkt->tcp_flags = *((u_int8_t*)pkt->tcph + 13);
+	} else if (pkt->proto == IPPROTO_UDP || pkt->proto == IPPROTO_UDPLITE) {
+		udph = skb_header_pointer(skb, thoff, sizeof(_udph), &_udph);
+		if (udph == NULL)
+			return false;
+		pkt->src_port  = udph->source;
+		pkt->dest_port = udph->dest;
+		pkt->tcp_flags = 0;
+	} else {
+		pr_debug("protocol not supported\n");
+		return false;
+	}
 	return true;
 }
 
-static struct xt_match xt_psd_reg __read_mostly = {
-	.name		= "psd",
-	.family    = NFPROTO_IPV4,
-	.revision  = 1,
-	.match		= xt_psd_match,
-	.matchsize	= sizeof(struct xt_psd_info),
-	.me			= THIS_MODULE,
+static bool
+xt_psd_match_info(const struct sk_buff *pskb, struct xt_action_param *match,
+    const struct xt_psd_info *psdinfo)
+{
+	const struct iphdr *iph;
+	struct psd_packet pkt;
+	struct tcphdr _tcph;
+
+	/* IP header */
+	iph = ip_hdr(pskb);
+
+	/* Sanity check */
+	if (iph->frag_off & htons(IP_OFFSET)) {
+		pr_debug("sanity check failed\n");
+		return false;
+	}
+
+	/* We're using IP address 0.0.0.0 for a special purpose here, so don't let
+	 * them spoof us. [DHCP needs this feature - HW] */
+	if (iph->saddr == 0) {
+		pr_debug("spoofed source address (0.0.0.0)\n");
+		return false;
+	}
+
+	/* Get the source address, source & destination ports, and TCP flags */
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.net          = dev_net(match->in ? match->in : match->out);
+	pkt.family       = NFPROTO_IPV4;
+	pkt.proto        = iph->protocol;
+	pkt.src_addr.ip  = iph->saddr;
+	pkt.dest_addr.ip = iph->daddr;
+	pkt.tos          = iph->tos;
+	pkt.ttl          = iph->ttl;
+	if (!psd_get_ports(pskb, match->thoff, &pkt, &_tcph))
+		return false;
+
+	return psd_process(&pkt, psdinfo);
+}
+
+static bool
+xt_psd_match(const struct sk_buff *pskb, struct xt_action_param *match)
+{
+	return xt_psd_match_info(pskb, match, match->matchinfo);
+}
+
+/* Revision 1 rules are handled as revision 2 ones with the new fields 0. */
+static bool
+xt_psd_match_v1(const struct sk_buff *pskb, struct xt_action_param *match)
+{
+	struct xt_psd_info psdinfo;
+
+	memset(&psdinfo, 0, sizeof(psdinfo));
+	memcpy(&psdinfo, match->matchinfo, sizeof(struct xt_psd_info_v1));
+	return xt_psd_match_info(pskb, match, &psdinfo);
+}
+
+static bool
+xt_psd_match6(const struct sk_buff *pskb, struct xt_action_param *match)
+{
+	const struct ipv6hdr *ip6h = ipv6_hdr(pskb);
+	const struct xt_psd_info *psdinfo = match->matchinfo;
+	unsigned int thoff = 0;
+	unsigned short fragoff = 0;
+	struct psd_packet pkt;
+	struct tcphdr _tcph;
+	int proto;
+
+	proto = ipv6_find_hdr(pskb, &thoff, -1, &fragoff);
+	if (proto < 0 || fragoff != 0)
+		return false;
+
+	/* The unspecified address is used by DAD; treat like 0.0.0.0 */
+	if (ipv6_addr_any(&ip6h->saddr))
+		return false;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.net    = dev_net(match->in ? match->in : match->out);
+	pkt.family = NFPROTO_IPV6;
+	pkt.proto  = proto;
+	pkt.tos    = ipv6_get_dsfield(ip6h);
+	pkt.ttl    = ip6h->hop_limit;
+	pkt.dest_addr.in6 = ip6h->daddr;
+	/* Optionally track whole prefixes, so scanners cannot just rotate
+	 * through the addresses of their network. */
+	if (psdinfo->ipv6_prefix != 0 && psdinfo->ipv6_prefix < 128)
+		ipv6_addr_prefix(&pkt.src_addr.in6, &ip6h->saddr,
+		                 psdinfo->ipv6_prefix);
+	else
+		pkt.src_addr.in6 = ip6h->saddr;
+	if (!psd_get_ports(pskb, thoff, &pkt, &_tcph))
+		return false;
+
+	return psd_process(&pkt, psdinfo);
+}
+
+static int psd_mt_check(const struct xt_mtchk_param *par)
+{
+	const struct xt_psd_info *psdinfo = par->matchinfo;
+
+	if (psdinfo->ipv6_prefix > 128)
+		return -EINVAL;
+	if (psdinfo->flags & ~XT_PSD_NOTIFY)
+		return -EINVAL;
+	return 0;
+}
+
+static struct xt_match xt_psd_reg[] __read_mostly = {
+	{
+		.name		= "psd",
+		.family		= NFPROTO_IPV4,
+		.revision	= 1,
+		.match		= xt_psd_match_v1,
+		.matchsize	= sizeof(struct xt_psd_info_v1),
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "psd",
+		.family		= NFPROTO_IPV4,
+		.revision	= 2,
+		.checkentry	= psd_mt_check,
+		.match		= xt_psd_match,
+		.matchsize	= sizeof(struct xt_psd_info),
+		.me		= THIS_MODULE,
+	},
+	{
+		.name		= "psd",
+		.family		= NFPROTO_IPV6,
+		.revision	= 2,
+		.checkentry	= psd_mt_check,
+		.match		= xt_psd_match6,
+		.matchsize	= sizeof(struct xt_psd_info),
+		.me		= THIS_MODULE,
+	},
 };
 
+static int psd_stat_show(struct seq_file *seq, void *v)
+{
+	struct psd_net *pn = seq->private;
+	unsigned long evicted = 0, chain_drops = 0;
+	struct psd_shard *shard;
+	unsigned int i;
+
+	for (i = 0; i < SHARD_COUNT; ++i) {
+		shard = &pn->shard[i];
+		spin_lock_bh(&shard->lock);
+		evicted     += shard->evicted;
+		chain_drops += shard->chain_drops;
+		spin_unlock_bh(&shard->lock);
+	}
+	seq_printf(seq, "list_size: %u\n", pn->shard[0].list_size * SHARD_COUNT);
+	seq_printf(seq, "hash_size: %u\n", pn->shard[0].hash_size * SHARD_COUNT);
+	seq_printf(seq, "evicted: %lu\n", evicted);
+	seq_printf(seq, "chain_drops: %lu\n", chain_drops);
+	return 0;
+}
+
+static int psd_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, psd_stat_show, PDE(inode)->data);
+}
+
+static const struct file_operations psd_stat_fops = {
+	.open    = psd_stat_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.owner   = THIS_MODULE,
+};
+
+static void psd_free_state(struct psd_net *pn)
+{
+	unsigned int i;
+
+	for (i = 0; i < SHARD_COUNT; ++i) {
+		vfree(pn->shard[i].list);
+		vfree(pn->shard[i].hash);
+		pn->shard[i].list = NULL;
+		pn->shard[i].hash = NULL;
+	}
+}
+
+static int psd_net_setup(struct psd_net *pn, struct proc_dir_entry *parent)
+{
+	unsigned int shard_list_size, shard_hash_size, i;
+	struct psd_shard *shard;
+
+	shard_list_size = max(list_size / SHARD_COUNT, 1U);
+	shard_hash_size = max(hash_size / SHARD_COUNT, 1U);
+	for (i = 0; i < SHARD_COUNT; ++i) {
+		shard = &pn->shard[i];
+		spin_lock_init(&shard->lock);
+		shard->list_size = shard_list_size;
+		shard->hash_size = shard_hash_size;
+		shard->list = vmalloc(shard_list_size * sizeof(*shard->list));
+		shard->hash = vmalloc(shard_hash_size * sizeof(*shard->hash));
+		if (shard->list == NULL || shard->hash == NULL)
+			goto out_state;
+		memset(shard->list, 0, shard_list_size * sizeof(*shard->list));
+		memset(shard->hash, 0, shard_hash_size * sizeof(*shard->hash));
+	}
+
+	if (proc_create_data("xt_psd", S_IRUGO, parent,
+	    &psd_stat_fops, pn) == NULL)
+		goto out_state;
+	return 0;
+
+ out_state:
+	psd_free_state(pn);
+	return -ENOMEM;
+}
+
+static void psd_net_teardown(struct psd_net *pn, struct proc_dir_entry *parent)
+{
+	remove_proc_entry("xt_psd", parent);
+	psd_free_state(pn);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+static int __net_init psd_net_init(struct net *net)
+{
+	return psd_net_setup(psd_pernet(net), net->proc_net);
+}
+
+static void __net_exit psd_net_exit(struct net *net)
+{
+	psd_net_teardown(psd_pernet(net), net->proc_net);
+}
+
+static struct pernet_operations psd_net_ops = {
+	.init = psd_net_init,
+	.exit = psd_net_exit,
+	.id   = &psd_net_id,
+	.size = sizeof(struct psd_net),
+};
+
+static inline int psd_register_pernet(void)
+{
+	return register_pernet_subsys(&psd_net_ops);
+}
+
+static inline void psd_unregister_pernet(void)
+{
+	unregister_pernet_subsys(&psd_net_ops);
+}
+#else
+static inline int psd_register_pernet(void)
+{
+	return psd_net_setup(&psd_net, init_net__proc_net);
+}
+
+static inline void psd_unregister_pernet(void)
+{
+	psd_net_teardown(&psd_net, init_net__proc_net);
+}
+#endif
+
 static int __init xt_psd_init(void)
 {
-	spin_lock_init(&(state.lock));
-	return xt_register_match(&xt_psd_reg);
+	int ret;
+
+	get_random_bytes(&psd_hash_rnd, sizeof(psd_hash_rnd));
+	psd_notify_rs.burst = psd_notify_burst;
+	ret = genl_register_family(&psd_genl_family);
+	if (ret < 0)
+		return ret;
+	ret = genl_register_mc_group(&psd_genl_family, &psd_genl_mcgrp);
+	if (ret < 0)
+		goto out_family;
+	ret = psd_register_pernet();
+	if (ret < 0)
+		goto out_family;
+	ret = xt_register_matches(xt_psd_reg, ARRAY_SIZE(xt_psd_reg));
+	if (ret < 0)
+		goto out_pernet;
+	return 0;
+
+ out_pernet:
+	psd_unregister_pernet();
+ out_family:
+	genl_unregister_family(&psd_genl_family);
+	return ret;
 }
 
 static void __exit xt_psd_exit(void)
 {
-        xt_unregister_match(&xt_psd_reg);
+	xt_unregister_matches(xt_psd_reg, ARRAY_SIZE(xt_psd_reg));
+	psd_unregister_pernet();
+	genl_unregister_family(&psd_genl_family);
 }
 
 module_init(xt_psd_init);
@@ -24,18 +24,59 @@
 /*
  * Keep track of up to LIST_SIZE source addresses, using a hash table of
  * HASH_SIZE entries for faster lookups, but limiting hash collisions to
- * HASH_MAX source addresses per the same hash value.
+ * HASH_MAX source addresses per the same hash value. LIST_SIZE and
+ * HASH_SIZE are defaults for the module parameters of the same name.
  */
 #define LIST_SIZE			0x100
-#define HASH_LOG			9
-#define HASH_SIZE			(1 << HASH_LOG)
+#define HASH_SIZE			0x200
 #define HASH_MAX			0x10
 
+enum {
+	XT_PSD_NOTIFY = 1 << 0,
+};
+
+/*
+ * When a rule has XT_PSD_NOTIFY set, each newly detected scanner is
+ * announced as XT_PSD_CMD_SCANNER to the XT_PSD_GENL_MCGRP multicast group
+ * of the XT_PSD_GENL_NAME generic netlink family.
+ */
+#define XT_PSD_GENL_NAME  "xt_psd"
+#define XT_PSD_GENL_MCGRP "scanners"
+
+enum {
+	XT_PSD_CMD_UNSPEC,
+	XT_PSD_CMD_SCANNER,
+};
+
+enum {
+	XT_PSD_ATTR_UNSPEC,
+	XT_PSD_ATTR_FAMILY,      /* u8, NFPROTO_IPV4 or NFPROTO_IPV6 */
+	XT_PSD_ATTR_SRC,         /* binary, 4 or 16 byte source address */
+	XT_PSD_ATTR_PORTS,       /* u32, number of ports probed */
+	XT_PSD_ATTR_WEIGHT,      /* u32, total weight of the probes */
+	__XT_PSD_ATTR_MAX,
+};
+#define XT_PSD_ATTR_MAX (__XT_PSD_ATTR_MAX - 1)
+
+/*
+ * Revision 2; revision 1 ends after @hi_ports_weight.
+ * @ipv6_prefix:	track IPv6 sources by this prefix length (0 = 128)
+ * @flags:		XT_PSD_*
+ */
 struct xt_psd_info {
 	__u32 weight_threshold;
 	__u32 delay_threshold;
 	__u16 lo_ports_weight;
 	__u16 hi_ports_weight;
+	__u8 ipv6_prefix;
+	__u8 flags;
+};
+
+struct xt_psd_info_v1 {
+	__u32 weight_threshold;
+	__u32 delay_threshold;
+	__u16 lo_ports_weight;
+	__u16 hi_ports_weight;
 };
 
 #endif /*_LINUX_NETFILTER_XT_PSD_H*/
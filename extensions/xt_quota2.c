@@ -11,34 +11,93 @@
  *	it under the terms of the GNU General Public License
  *	version 2, as published by the Free Software Foundation.
  */
+#include <linux/err.h>
+#include <linux/jhash.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/proc_fs.h>
+#include <linux/random.h>
+#include <linux/ratelimit.h>
+#include <linux/seq_file.h>
 #include <linux/skbuff.h>
 #include <linux/spinlock.h>
+#include <linux/time.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <asm/atomic.h>
+#include <net/genetlink.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+#	include <net/net_namespace.h>
+#	include <net/netns/generic.h>
+#endif
 
 #include <linux/netfilter/x_tables.h>
 #include "xt_quota2.h"
 #include "compat_xtables.h"
 
 /**
- * @lock:	lock to protect quota writers from each other
+ * @lock:	lock to protect quota writers from each other; a hierarchy of
+ * 		counters shares the lock of its topmost counter (@root)
+ * @limit:	value that @quota is reset to when a period begins
+ * @expires:	time (in seconds) of the next reset or bucket rollover
+ * @head:	index of the current sub-interval in @bucket
+ * @bucket:	change applied to @quota per sub-interval (sliding window only)
+ * @notified:	bitmask of thresholds for which an event was already sent
+ * @grow:	counts up (--grow), so thresholds are crossed from below
+ * @parent:	next counter up in the hierarchy, or NULL
+ * @depth:	number of ancestors
  */
 struct xt_quota_counter {
 	u_int64_t quota;
 	spinlock_t lock;
-	struct list_head list;
+	u_int64_t limit;
+	unsigned long expires;
+	unsigned int interval, nbuckets, head;
+	s64 *bucket;
+	unsigned int nthresh, notified;
+	bool grow;
+	u_int64_t thresh[XT_QUOTA_MAX_NOTIFY];
+	struct xt_quota_counter *root, *parent;
+	unsigned int depth;
+	struct hlist_node node;
 	atomic_t ref;
 	char name[sizeof(((struct xt_quota_mtinfo2 *)NULL)->name)];
 	struct proc_dir_entry *procfs_entry;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	struct net *net;
+#endif
 };
 
-static LIST_HEAD(counter_list);
-static DEFINE_SPINLOCK(counter_list_lock);
+/**
+ * @counter_hash:	named counters, indexed by name
+ * @counter_mutex:	protects @counter_hash; only used from process context
+ */
+struct quota_net {
+	struct hlist_head *counter_hash;
+	struct mutex counter_mutex;
+	struct proc_dir_entry *proc_xt_quota;
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+static int quota_net_id;
+static inline struct quota_net *quota_pernet(struct net *net)
+{
+	return net_generic(net, quota_net_id);
+}
+#else
+static struct quota_net quota_net;
+#define quota_pernet(x) (&quota_net)
+#endif
+
+static u_int32_t counter_hash_rnd;
+static unsigned int quota_hashsize = 1024;
+module_param_named(hashsize, quota_hashsize, uint, S_IRUGO);
+MODULE_PARM_DESC(hashsize, "number of buckets for named counter lookup");
+static unsigned int quota_counter_files = 1;
+module_param_named(counter_files, quota_counter_files, uint, S_IRUGO);
+MODULE_PARM_DESC(counter_files, "create a procfs file for each named counter");
 
-static struct proc_dir_entry *proc_xt_quota;
 static unsigned int quota_list_perms = S_IRUGO | S_IWUSR;
 static unsigned int quota_list_uid   = 0;
 static unsigned int quota_list_gid   = 0;
@@ -46,15 +105,200 @@ module_param_named(perms, quota_list_perms, uint, S_IRUGO | S_IWUSR);
 module_param_named(uid, quota_list_uid, uint, S_IRUGO | S_IWUSR);
 module_param_named(gid, quota_list_gid, uint, S_IRUGO | S_IWUSR);
 
+static unsigned int quota_notify_burst = 1000;
+module_param_named(notify_burst, quota_notify_burst, uint, S_IRUGO);
+MODULE_PARM_DESC(notify_burst, "maximum number of events sent per second");
+
+static DEFINE_RATELIMIT_STATE(quota_notify_rs, HZ, 1000);
+
+static struct genl_family quota_genl_family = {
+	.id      = GENL_ID_GENERATE,
+	.name    = XT_QUOTA_GENL_NAME,
+	.version = 1,
+	.maxattr = XT_QUOTA_ATTR_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	.netnsok = true,
+#endif
+};
+
+static struct genl_multicast_group quota_genl_mcgrp = {
+	.name = XT_QUOTA_GENL_MCGRP,
+};
+
+static inline unsigned long q2_next_boundary(unsigned long now,
+    unsigned int period)
+{
+	return now - now % period + period;
+}
+
+/*
+ * Record a change of the counter, so that it can be taken back once the
+ * current sub-interval falls out of the sliding window.
+ */
+static inline void q2_account(struct xt_quota_counter *e, s64 delta)
+{
+	e->quota += delta;
+	if (e->bucket != NULL)
+		e->bucket[e->head] += delta;
+}
+
+static inline void q2_unaccount(struct xt_quota_counter *e, s64 delta)
+{
+	if (delta > 0 && e->quota < (u_int64_t)delta)
+		e->quota = 0;
+	else
+		e->quota -= delta;
+}
+
+/**
+ * q2_rollover - apply periodic reset or advance the sliding window
+ *
+ * Done lazily whenever the counter is looked at, so no timers are needed.
+ * Must be called with e->root->lock held.
+ */
+static void q2_rollover(struct xt_quota_counter *e)
+{
+	unsigned long now = get_seconds();
+	unsigned int slot, i;
+
+	if (e->interval == 0 || time_before(now, e->expires))
+		return;
+
+	if (e->bucket == NULL) {
+		e->quota   = e->limit;
+		e->expires = q2_next_boundary(now, e->interval);
+		return;
+	}
+
+	slot = e->interval / e->nbuckets;
+	for (i = 0; i < e->nbuckets && !time_before(now, e->expires); ++i) {
+		e->head = (e->head + 1) % e->nbuckets;
+		q2_unaccount(e, e->bucket[e->head]);
+		e->bucket[e->head] = 0;
+		e->expires += slot;
+	}
+	/* Idle for longer than the whole window */
+	if (!time_before(now, e->expires))
+		e->expires = q2_next_boundary(now, slot);
+}
+
+/**
+ * q2_check_thresh - find thresholds that need an event
+ *
+ * Each threshold fires once when the counter falls to or below it, and is
+ * rearmed when the counter rises above it again (refill, reset, window).
+ * For a growing counter, it is the other way round.
+ * The returned thresholds are marked as notified right away, so that only
+ * one CPU sends the event. Must be called with e->root->lock held.
+ */
+static unsigned int q2_check_thresh(struct xt_quota_counter *e)
+{
+	unsigned int i, fire = 0;
+
+	for (i = 0; i < e->nthresh; ++i)
+		if (e->grow ? e->quota < e->thresh[i] :
+		    e->quota > e->thresh[i])
+			e->notified &= ~(1 << i);
+		else if (!(e->notified & (1 << i)))
+			fire |= 1 << i;
+	e->notified |= fire;
+	return fire;
+}
+
+static int q2_send_event(const struct xt_quota_counter *e,
+    u_int64_t quota, u_int64_t thresh)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genlmsg_new(nla_total_size(sizeof(e->name)) +
+	      2 * nla_total_size(sizeof(u_int64_t)), GFP_ATOMIC);
+	if (skb == NULL)
+		return -ENOMEM;
+	hdr = genlmsg_put(skb, 0, 0, &quota_genl_family, 0,
+	      XT_QUOTA_CMD_EVENT);
+	if (hdr == NULL)
+		goto nla_put_failure;
+	NLA_PUT_STRING(skb, XT_QUOTA_ATTR_NAME, e->name);
+	NLA_PUT_U64(skb, XT_QUOTA_ATTR_QUOTA, quota);
+	NLA_PUT_U64(skb, XT_QUOTA_ATTR_THRESHOLD, thresh);
+	genlmsg_end(skb, hdr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	genlmsg_multicast_netns(e->net, skb, 0, quota_genl_mcgrp.id, GFP_ATOMIC);
+#else
+	genlmsg_multicast(skb, 0, quota_genl_mcgrp.id, GFP_ATOMIC);
+#endif
+	return 0;
+
+ nla_put_failure:
+	kfree_skb(skb);
+	return -EMSGSIZE;
+}
+
+/**
+ * q2_notify - emit events for the thresholds in @fire
+ *
+ * Called without e->root->lock held. Events that were suppressed by the rate
+ * limit or could not be allocated are rearmed, so they are retried on one
+ * of the next packets.
+ */
+static void q2_notify(struct xt_quota_counter *e, unsigned int fire,
+    u_int64_t quota)
+{
+	unsigned int i, unsent = 0;
+
+	for (i = 0; i < e->nthresh; ++i) {
+		if (!(fire & (1 << i)))
+			continue;
+		if (!__ratelimit(&quota_notify_rs) ||
+		    q2_send_event(e, quota, e->thresh[i]) != 0)
+			unsent |= 1 << i;
+	}
+	if (unsent == 0)
+		return;
+	spin_lock_bh(&e->root->lock);
+	e->notified &= ~unsent;
+	spin_unlock_bh(&e->root->lock);
+}
+
+static void q2_set_quota(struct xt_quota_counter *e, u_int64_t value)
+{
+	spin_lock_bh(&e->root->lock);
+	e->quota = value;
+	/* A value set by the administrator starts a fresh window. */
+	if (e->bucket != NULL)
+		memset(e->bucket, 0, e->nbuckets * sizeof(*e->bucket));
+	spin_unlock_bh(&e->root->lock);
+}
+
+static inline unsigned int q2_hash(const char *name)
+{
+	return jhash(name, strlen(name), counter_hash_rnd) % quota_hashsize;
+}
+
+/* Must be called with qn->counter_mutex held. */
+static struct xt_quota_counter *
+q2_lookup(struct quota_net *qn, const char *name)
+{
+	struct xt_quota_counter *e;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(e, pos, &qn->counter_hash[q2_hash(name)], node)
+		if (strcmp(e->name, name) == 0)
+			return e;
+	return NULL;
+}
+
 static int quota_proc_read(char *page, char **start, off_t offset,
                            int count, int *eof, void *data)
 {
 	struct xt_quota_counter *e = data;
 	int ret;
 
-	spin_lock_bh(&e->lock);
+	spin_lock_bh(&e->root->lock);
+	q2_rollover(e);
 	ret = snprintf(page, PAGE_SIZE, "%llu\n", e->quota);
-	spin_unlock_bh(&e->lock);
+	spin_unlock_bh(&e->root->lock);
 	return ret;
 }
 
@@ -70,12 +314,187 @@ static int quota_proc_write(struct file *file, const char __user *input,
 		return -EFAULT;
 	buf[sizeof(buf)-1] = '\0';
 
-	spin_lock_bh(&e->lock);
-	e->quota = simple_strtoull(buf, NULL, 0);
-	spin_unlock_bh(&e->lock);
+	q2_set_quota(e, simple_strtoull(buf, NULL, 0));
 	return size;
 }
 
+/*
+ * The ".all" file lists every named counter as "name value" lines, and
+ * accepts such lines to set any number of counters in one write.
+ */
+struct q2_seq_iter {
+	struct quota_net *qn;
+	/* position of the next entry to show */
+	unsigned int bucket, skip;
+	loff_t pos;
+};
+
+static struct xt_quota_counter *q2_seq_find(struct q2_seq_iter *it)
+{
+	struct xt_quota_counter *e;
+	struct hlist_node *pos;
+	unsigned int i;
+
+	for (; it->bucket < quota_hashsize; ++it->bucket, it->skip = 0) {
+		i = 0;
+		hlist_for_each_entry(e, pos, &it->qn->counter_hash[it->bucket],
+		    node)
+			if (i++ == it->skip)
+				return e;
+	}
+	return NULL;
+}
+
+static void *q2_seq_start(struct seq_file *seq, loff_t *pos)
+{
+	struct q2_seq_iter *it = seq->private;
+	loff_t i;
+
+	mutex_lock(&it->qn->counter_mutex);
+	/* Continue where the last read stopped, instead of walking again. */
+	if (*pos == 0 || *pos != it->pos) {
+		it->bucket = it->skip = 0;
+		for (i = 0; i < *pos; ++i, ++it->skip)
+			if (q2_seq_find(it) == NULL)
+				return NULL;
+	}
+	it->pos = *pos;
+	return q2_seq_find(it);
+}
+
+static void *q2_seq_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	struct q2_seq_iter *it = seq->private;
+
+	++it->skip;
+	it->pos = ++*pos;
+	return q2_seq_find(it);
+}
+
+static void q2_seq_stop(struct seq_file *seq, void *v)
+{
+	struct q2_seq_iter *it = seq->private;
+
+	mutex_unlock(&it->qn->counter_mutex);
+}
+
+static int q2_seq_show(struct seq_file *seq, void *v)
+{
+	struct xt_quota_counter *e = v;
+	u_int64_t value;
+
+	spin_lock_bh(&e->root->lock);
+	q2_rollover(e);
+	value = e->quota;
+	spin_unlock_bh(&e->root->lock);
+	if (e->parent != NULL)
+		seq_printf(seq, "%s %llu %s\n", e->name,
+		           (unsigned long long)value, e->parent->name);
+	else
+		seq_printf(seq, "%s %llu\n", e->name, (unsigned long long)value);
+	return 0;
+}
+
+static const struct seq_operations q2_seq_ops = {
+	.start = q2_seq_start,
+	.next  = q2_seq_next,
+	.stop  = q2_seq_stop,
+	.show  = q2_seq_show,
+};
+
+static int q2_bulk_open(struct inode *inode, struct file *file)
+{
+	struct q2_seq_iter *it;
+
+	it = __seq_open_private(file, &q2_seq_ops, sizeof(*it));
+	if (it == NULL)
+		return -ENOMEM;
+	it->qn = PDE(inode)->data;
+	return 0;
+}
+
+/* Must be called with qn->counter_mutex held. */
+static int q2_bulk_set(struct quota_net *qn, char *line)
+{
+	char name[sizeof(((struct xt_quota_counter *)NULL)->name)];
+	struct xt_quota_counter *e;
+	unsigned long long value;
+
+	line = skip_spaces(line);
+	if (*line == '\0')
+		return 0;
+	if (sscanf(line, "%14s %llu", name, &value) != 2)
+		return -EINVAL;
+	e = q2_lookup(qn, name);
+	if (e == NULL)
+		return -ENOENT;
+	q2_set_quota(e, value);
+	return 0;
+}
+
+/*
+ * Each write must consist of complete lines; on error, the number of bytes
+ * up to the offending line is returned, so the caller can locate it.
+ */
+static ssize_t q2_bulk_write(struct file *file, const char __user *input,
+    size_t size, loff_t *loff)
+{
+	struct quota_net *qn = PDE(file->f_path.dentry->d_inode)->data;
+	size_t done = 0, before, chunk;
+	char *buf, *line, *end;
+	int ret = 0;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&qn->counter_mutex);
+	while (done < size) {
+		chunk = min_t(size_t, size - done, PAGE_SIZE - 1);
+		if (copy_from_user(buf, input + done, chunk) != 0) {
+			ret = -EFAULT;
+			break;
+		}
+		buf[chunk] = '\0';
+		/* Only cut at a newline unless this is the end of the input. */
+		if (done + chunk < size) {
+			end = strrchr(buf, '\n');
+			if (end == NULL) {
+				ret = -EINVAL;
+				break;
+			}
+			end[1] = '\0';
+			chunk  = end + 1 - buf;
+		}
+		before = done;
+		for (end = buf; ret == 0 && end != NULL; ) {
+			line = strsep(&end, "\n");
+			ret  = q2_bulk_set(qn, line);
+			if (ret == 0)
+				done += (end != NULL) ? end - line : strlen(line);
+		}
+		if (ret < 0)
+			break;
+		if (done == before) {
+			/* embedded NUL byte */
+			ret = -EINVAL;
+			break;
+		}
+	}
+	mutex_unlock(&qn->counter_mutex);
+	free_page((unsigned long)buf);
+	return (done > 0) ? done : ret;
+}
+
+static const struct file_operations q2_bulk_fops = {
+	.open    = q2_bulk_open,
+	.read    = seq_read,
+	.write   = q2_bulk_write,
+	.llseek  = seq_lseek,
+	.release = seq_release_private,
+	.owner   = THIS_MODULE,
+};
+
 static struct xt_quota_counter *
 q2_new_counter(const struct xt_quota_mtinfo2 *q, bool anon)
 {
@@ -83,67 +502,176 @@ q2_new_counter(const struct xt_quota_mtinfo2 *q, bool anon)
 	unsigned int size;
 
 	/* Do not need all the procfs things for anonymous counters. */
-	size = anon ? offsetof(typeof(*e), list) : sizeof(*e);
+	size = anon ? offsetof(typeof(*e), node) : sizeof(*e);
 	e = kmalloc(size, GFP_KERNEL);
 	if (e == NULL)
 		return NULL;
 
-	e->quota = q->quota;
+	e->quota    = e->limit = q->quota;
+	e->interval = q->interval;
+	e->nbuckets = q->buckets;
+	e->head     = 0;
+	e->bucket   = NULL;
+	e->nthresh  = q->nthresh;
+	e->notified = 0;
+	e->grow     = q->flags & XT_QUOTA_GROW;
+	memcpy(e->thresh, q->thresh, sizeof(e->thresh));
+	e->root     = e;
+	e->parent   = NULL;
+	e->depth    = 0;
 	spin_lock_init(&e->lock);
+	if (e->nbuckets != 0) {
+		e->bucket = kcalloc(e->nbuckets, sizeof(*e->bucket), GFP_KERNEL);
+		if (e->bucket == NULL) {
+			kfree(e);
+			return NULL;
+		}
+		e->expires = q2_next_boundary(get_seconds(),
+		             e->interval / e->nbuckets);
+	} else if (e->interval != 0) {
+		e->expires = q2_next_boundary(get_seconds(), e->interval);
+	}
 	if (!anon) {
-		INIT_LIST_HEAD(&e->list);
+		INIT_HLIST_NODE(&e->node);
+		e->procfs_entry = NULL;
 		atomic_set(&e->ref, 1);
 		strncpy(e->name, q->name, sizeof(e->name));
 	}
 	return e;
 }
 
+static void q2_free_counter(struct xt_quota_counter *e)
+{
+	if (e == NULL)
+		return;
+	kfree(e->bucket);
+	kfree(e);
+}
+
+/**
+ * q2_put_counter - drop ref to counter, and to its ancestors once unused
+ *
+ * Must be called with qn->counter_mutex held.
+ */
+static void q2_put_counter(struct quota_net *qn, struct xt_quota_counter *e)
+{
+	struct xt_quota_counter *parent;
+
+	for (; e != NULL; e = parent) {
+		if (!atomic_dec_and_test(&e->ref))
+			return;
+		parent = e->parent;
+		/* May have been unhashed already by q2_net_teardown. */
+		if (!hlist_unhashed(&e->node))
+			hlist_del(&e->node);
+		if (e->procfs_entry != NULL)
+			remove_proc_entry(e->name, qn->proc_xt_quota);
+		q2_free_counter(e);
+	}
+}
+
+/**
+ * q2_same_settings - check that a rule agrees with an existing counter
+ *
+ * The reset, window, notification and parent settings belong to the
+ * counter, so a later rule naming it must not ask for different ones.
+ * Must be called with qn->counter_mutex held.
+ */
+static bool q2_same_settings(const struct xt_quota_counter *e,
+                             const struct xt_quota_mtinfo2 *q)
+{
+	const char *parent = (e->parent != NULL) ? e->parent->name : "";
+
+	return e->interval == q->interval && e->nbuckets == q->buckets &&
+	       e->nthresh == q->nthresh &&
+	       memcmp(e->thresh, q->thresh,
+	              q->nthresh * sizeof(*q->thresh)) == 0 &&
+	       strcmp(parent, q->parent) == 0;
+}
+
 /**
  * q2_get_counter - get ref to counter or create new
- * @name:	name of counter
+ * @par:	check parameters, giving the counter's name and namespace
  */
 static struct xt_quota_counter *
-q2_get_counter(const struct xt_quota_mtinfo2 *q)
+q2_get_counter(const struct xt_mtchk_param *par)
 {
+	const struct xt_quota_mtinfo2 *q = par->matchinfo;
+	struct quota_net *qn = quota_pernet(par->net);
+	struct xt_quota_counter *e, *parent = NULL;
 	struct proc_dir_entry *p;
-	struct xt_quota_counter *e;
 
-	if (*q->name == '\0')
-		return q2_new_counter(q, true);
+	if (*q->name == '\0') {
+		e = q2_new_counter(q, true);
+		return (e != NULL) ? e : ERR_PTR(-ENOMEM);
+	}
 
-	spin_lock_bh(&counter_list_lock);
-	list_for_each_entry(e, &counter_list, list)
-		if (strcmp(e->name, q->name) == 0) {
-			atomic_inc(&e->ref);
-			spin_unlock_bh(&counter_list_lock);
-			return e;
+	mutex_lock(&qn->counter_mutex);
+	e = q2_lookup(qn, q->name);
+	if (e != NULL) {
+		if (!q2_same_settings(e, q)) {
+			mutex_unlock(&qn->counter_mutex);
+			printk(KERN_INFO "xt_quota.3: counter \"%s\" already "
+			       "exists with other settings\n", q->name);
+			return ERR_PTR(-EINVAL);
+		}
+		atomic_inc(&e->ref);
+		mutex_unlock(&qn->counter_mutex);
+		return e;
+	}
+
+	if (*q->parent != '\0') {
+		parent = q2_lookup(qn, q->parent);
+		if (parent == NULL) {
+			mutex_unlock(&qn->counter_mutex);
+			printk(KERN_ERR "xt_quota.3: parent counter \"%s\" "
+			       "does not exist\n", q->parent);
+			return ERR_PTR(-ENOENT);
+		}
+		if (parent->depth + 1 >= XT_QUOTA_MAX_DEPTH) {
+			mutex_unlock(&qn->counter_mutex);
+			printk(KERN_ERR "xt_quota.3: counter hierarchy "
+			       "too deep\n");
+			return ERR_PTR(-EINVAL);
 		}
+	}
 
 	e = q2_new_counter(q, false);
 	if (e == NULL)
 		goto out;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	e->net = par->net;
+#endif
 
-	p = e->procfs_entry = create_proc_entry(e->name, quota_list_perms,
-	                      proc_xt_quota);
-	if (p == NULL || IS_ERR(p))
-		goto out;
+	if (quota_counter_files) {
+		p = e->procfs_entry = create_proc_entry(e->name,
+		                      quota_list_perms, qn->proc_xt_quota);
+		if (p == NULL || IS_ERR(p))
+			goto out;
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(2, 6, 29)
-	p->owner        = THIS_MODULE;
+		p->owner        = THIS_MODULE;
 #endif
-	p->data         = e;
-	p->read_proc    = quota_proc_read;
-	p->write_proc   = quota_proc_write;
-	p->uid          = quota_list_uid;
-	p->gid          = quota_list_gid;
-	list_add_tail(&e->list, &counter_list);
-	spin_unlock_bh(&counter_list_lock);
+		p->data         = e;
+		p->read_proc    = quota_proc_read;
+		p->write_proc   = quota_proc_write;
+		p->uid          = quota_list_uid;
+		p->gid          = quota_list_gid;
+	}
+	if (parent != NULL) {
+		atomic_inc(&parent->ref);
+		e->parent = parent;
+		e->root   = parent->root;
+		e->depth  = parent->depth + 1;
+	}
+	hlist_add_head(&e->node, &qn->counter_hash[q2_hash(e->name)]);
+	mutex_unlock(&qn->counter_mutex);
 	return e;
 
  out:
-	spin_unlock_bh(&counter_list_lock);
-	kfree(e);
-	return NULL;
+	mutex_unlock(&qn->counter_mutex);
+	q2_free_counter(e);
+	return ERR_PTR(-ENOMEM);
 }
 
 static int quota_mt2_check(const struct xt_mtchk_param *par)
@@ -154,15 +682,32 @@ static int quota_mt2_check(const struct xt_mtchk_param *par)
 		return -EINVAL;
 
 	q->name[sizeof(q->name)-1] = '\0';
-	if (*q->name == '.' || strchr(q->name, '/') != NULL) {
+	q->parent[sizeof(q->parent)-1] = '\0';
+	if (*q->name == '.' || strchr(q->name, '/') != NULL ||
+	    *q->parent == '.' || strchr(q->parent, '/') != NULL) {
 		printk(KERN_ERR "xt_quota.3: illegal name\n");
 		return -EINVAL;
 	}
+	if (*q->parent != '\0' && *q->name == '\0') {
+		printk(KERN_ERR "xt_quota.3: parent needs a named counter\n");
+		return -EINVAL;
+	}
+	if (q->buckets > XT_QUOTA_MAX_BUCKETS ||
+	    (q->buckets != 0 && q->interval < q->buckets)) {
+		printk(KERN_ERR "xt_quota.3: invalid window\n");
+		return -EINVAL;
+	}
+	if (q->nthresh > XT_QUOTA_MAX_NOTIFY ||
+	    (q->nthresh != 0 && *q->name == '\0')) {
+		printk(KERN_ERR "xt_quota.3: notification needs a named counter\n");
+		return -EINVAL;
+	}
 
-	q->master = q2_get_counter(q);
-	if (q->master == NULL) {
-		printk(KERN_ERR "xt_quota.3: memory alloc failure\n");
-		return -ENOMEM;
+	q->master = q2_get_counter(par);
+	if (IS_ERR(q->master)) {
+		if (PTR_ERR(q->master) == -ENOMEM)
+			printk(KERN_ERR "xt_quota.3: memory alloc failure\n");
+		return PTR_ERR(q->master);
 	}
 
 	return 0;
@@ -172,62 +717,152 @@ static void quota_mt2_destroy(const struct xt_mtdtor_param *par)
 {
 	struct xt_quota_mtinfo2 *q = par->matchinfo;
 	struct xt_quota_counter *e = q->master;
+	struct quota_net *qn;
 
 	if (*q->name == '\0') {
-		kfree(e);
+		q2_free_counter(e);
 		return;
 	}
 
-	spin_lock_bh(&counter_list_lock);
-	if (!atomic_dec_and_test(&e->ref)) {
-		spin_unlock_bh(&counter_list_lock);
-		return;
+	qn = quota_pernet(par->net);
+	mutex_lock(&qn->counter_mutex);
+	q2_put_counter(qn, e);
+	mutex_unlock(&qn->counter_mutex);
+}
+
+/*
+ * Revision 3 rules are checked and destroyed as revision 4 ones without
+ * any of the options that revision 3 has no room for.
+ */
+static int quota_mt2_v3_check(const struct xt_mtchk_param *par)
+{
+	struct xt_quota_mtinfo2_v3 *old = par->matchinfo;
+	struct xt_mtchk_param p = *par;
+	struct xt_quota_mtinfo2 q;
+	int ret;
+
+	memset(&q, 0, sizeof(q));
+	memcpy(q.name, old->name, sizeof(q.name));
+	q.flags = old->flags;
+	q.quota = old->quota;
+	p.matchinfo = &q;
+	ret = quota_mt2_check(&p);
+	if (ret == 0) {
+		old->name[sizeof(old->name)-1] = '\0';
+		old->master = q.master;
 	}
+	return ret;
+}
 
-	list_del(&e->list);
-	remove_proc_entry(e->name, proc_xt_quota);
-	spin_unlock_bh(&counter_list_lock);
-	kfree(e);
+static void quota_mt2_v3_destroy(const struct xt_mtdtor_param *par)
+{
+	const struct xt_quota_mtinfo2_v3 *old = par->matchinfo;
+	struct xt_mtdtor_param p = *par;
+	struct xt_quota_mtinfo2 q;
+
+	memset(&q, 0, sizeof(q));
+	memcpy(q.name, old->name, sizeof(q.name));
+	q.master = old->master;
+	p.matchinfo = &q;
+	quota_mt2_destroy(&p);
 }
 
+/*
+ * @quota:	the rule's copy of the counter value, for iptables -L
+ */
 static bool
-quota_mt2(const struct sk_buff *skb, struct xt_action_param *par)
+quota_mt2_common(const struct sk_buff *skb, struct xt_quota_counter *e,
+    u_int8_t flags, aligned_u64 *quota)
 {
-	struct xt_quota_mtinfo2 *q = (void *)par->matchinfo;
-	struct xt_quota_counter *e = q->master;
-	bool ret = q->flags & XT_QUOTA_INVERT;
+	struct xt_quota_counter *l;
+	bool ret = flags & XT_QUOTA_INVERT;
+	unsigned int fire[XT_QUOTA_MAX_DEPTH], i, n;
+	u_int64_t value[XT_QUOTA_MAX_DEPTH];
+	s64 amount = (flags & XT_QUOTA_PACKET) ? 1 : skb->len;
 
-	spin_lock_bh(&e->lock);
-	if (q->flags & XT_QUOTA_GROW) {
+	spin_lock_bh(&e->root->lock);
+	for (l = e; l != NULL; l = l->parent)
+		q2_rollover(l);
+	if (flags & XT_QUOTA_GROW) {
 		/*
 		 * While no_change is pointless in "grow" mode, we will
 		 * implement it here simply to have a consistent behavior.
 		 */
-		if (!(q->flags & XT_QUOTA_NO_CHANGE)) {
-			e->quota += (q->flags & XT_QUOTA_PACKET) ? 1 : skb->len;
-			q->quota = e->quota;
+		if (!(flags & XT_QUOTA_NO_CHANGE)) {
+			for (l = e; l != NULL; l = l->parent)
+				q2_account(l, amount);
+			*quota = e->quota;
 		}
 		ret = true;
 	} else {
-		if (e->quota >= skb->len) {
-			if (!(q->flags & XT_QUOTA_NO_CHANGE))
-				e->quota -= (q->flags & XT_QUOTA_PACKET) ? 1 : skb->len;
+		/* The packet has to fit into every level of the hierarchy. */
+		for (l = e; l != NULL; l = l->parent)
+			if (l->quota < skb->len)
+				break;
+		if (l == NULL) {
+			if (!(flags & XT_QUOTA_NO_CHANGE))
+				for (l = e; l != NULL; l = l->parent)
+					q2_account(l, -amount);
 			ret = !ret;
 		} else {
 			/* we do not allow even small packets from now on */
-			e->quota = 0;
+			q2_account(l, -(s64)l->quota);
 		}
-		q->quota = e->quota;
+		*quota = e->quota;
 	}
-	spin_unlock_bh(&e->lock);
+	for (n = 0, l = e; l != NULL; l = l->parent, ++n) {
+		fire[n]  = (l->nthresh != 0) ? q2_check_thresh(l) : 0;
+		value[n] = l->quota;
+	}
+	spin_unlock_bh(&e->root->lock);
+
+	for (i = 0, l = e; i < n; ++i, l = l->parent)
+		if (fire[i] != 0)
+			q2_notify(l, fire[i], value[i]);
 	return ret;
 }
 
+static bool
+quota_mt2(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	struct xt_quota_mtinfo2 *q = (void *)par->matchinfo;
+
+	return quota_mt2_common(skb, q->master, q->flags, &q->quota);
+}
+
+static bool
+quota_mt2_v3(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	struct xt_quota_mtinfo2_v3 *q = (void *)par->matchinfo;
+
+	return quota_mt2_common(skb, q->master, q->flags, &q->quota);
+}
+
 static struct xt_match quota_mt2_reg[] __read_mostly = {
 	{
 		.name       = "quota2",
 		.revision   = 3,
 		.family     = NFPROTO_IPV4,
+		.checkentry = quota_mt2_v3_check,
+		.match      = quota_mt2_v3,
+		.destroy    = quota_mt2_v3_destroy,
+		.matchsize  = sizeof(struct xt_quota_mtinfo2_v3),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "quota2",
+		.revision   = 3,
+		.family     = NFPROTO_IPV6,
+		.checkentry = quota_mt2_v3_check,
+		.match      = quota_mt2_v3,
+		.destroy    = quota_mt2_v3_destroy,
+		.matchsize  = sizeof(struct xt_quota_mtinfo2_v3),
+		.me         = THIS_MODULE,
+	},
+	{
+		.name       = "quota2",
+		.revision   = 4,
+		.family     = NFPROTO_IPV4,
 		.checkentry = quota_mt2_check,
 		.match      = quota_mt2,
 		.destroy    = quota_mt2_destroy,  
@@ -236,7 +871,7 @@ static struct xt_match quota_mt2_reg[] __read_mostly = {
 	},
 	{
 		.name       = "quota2",
-		.revision   = 3,
+		.revision   = 4,
 		.family     = NFPROTO_IPV6,
 		.checkentry = quota_mt2_check,
 		.match      = quota_mt2,
@@ -246,24 +881,140 @@ static struct xt_match quota_mt2_reg[] __read_mostly = {
 	},
 };
 
+static int q2_net_setup(struct quota_net *qn, struct proc_dir_entry *parent)
+{
+	struct proc_dir_entry *p;
+	unsigned int i;
+
+	qn->counter_hash = vmalloc(quota_hashsize * sizeof(*qn->counter_hash));
+	if (qn->counter_hash == NULL)
+		return -ENOMEM;
+	for (i = 0; i < quota_hashsize; ++i)
+		INIT_HLIST_HEAD(&qn->counter_hash[i]);
+	mutex_init(&qn->counter_mutex);
+
+	qn->proc_xt_quota = proc_mkdir("xt_quota", parent);
+	if (qn->proc_xt_quota == NULL)
+		goto out_hash;
+	p = proc_create_data(".all", quota_list_perms, qn->proc_xt_quota,
+	    &q2_bulk_fops, qn);
+	if (p == NULL)
+		goto out_dir;
+	p->uid = quota_list_uid;
+	p->gid = quota_list_gid;
+	return 0;
+
+ out_dir:
+	remove_proc_entry("xt_quota", parent);
+ out_hash:
+	vfree(qn->counter_hash);
+	return -EACCES;
+}
+
+/*
+ * The tables of a namespace, and with them the counters, may be torn down
+ * after us. Unhash the counters and remove their procfs files now, so that
+ * quota_mt2_destroy does not touch either of them later.
+ */
+static void q2_net_teardown(struct quota_net *qn, struct proc_dir_entry *parent)
+{
+	struct xt_quota_counter *e;
+	struct hlist_node *pos, *n;
+	unsigned int i;
+
+	mutex_lock(&qn->counter_mutex);
+	for (i = 0; i < quota_hashsize; ++i)
+		hlist_for_each_entry_safe(e, pos, n, &qn->counter_hash[i], node) {
+			hlist_del_init(&e->node);
+			if (e->procfs_entry == NULL)
+				continue;
+			remove_proc_entry(e->name, qn->proc_xt_quota);
+			e->procfs_entry = NULL;
+		}
+	remove_proc_entry(".all", qn->proc_xt_quota);
+	remove_proc_entry("xt_quota", parent);
+	qn->proc_xt_quota = NULL;
+	vfree(qn->counter_hash);
+	qn->counter_hash = NULL;
+	mutex_unlock(&qn->counter_mutex);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+static int __net_init quota_net_init(struct net *net)
+{
+	return q2_net_setup(quota_pernet(net), net->proc_net);
+}
+
+static void __net_exit quota_net_exit(struct net *net)
+{
+	q2_net_teardown(quota_pernet(net), net->proc_net);
+}
+
+static struct pernet_operations quota_net_ops = {
+	.init = quota_net_init,
+	.exit = quota_net_exit,
+	.id   = &quota_net_id,
+	.size = sizeof(struct quota_net),
+};
+
+static inline int q2_register_pernet(void)
+{
+	return register_pernet_subsys(&quota_net_ops);
+}
+
+static inline void q2_unregister_pernet(void)
+{
+	unregister_pernet_subsys(&quota_net_ops);
+}
+#else
+static inline int q2_register_pernet(void)
+{
+	return q2_net_setup(&quota_net, init_net__proc_net);
+}
+
+static inline void q2_unregister_pernet(void)
+{
+	q2_net_teardown(&quota_net, init_net__proc_net);
+}
+#endif
+
 static int __init quota_mt2_init(void)
 {
 	int ret;
 
-	proc_xt_quota = proc_mkdir("xt_quota", init_net__proc_net);
-	if (proc_xt_quota == NULL)
-		return -EACCES;
+	if (quota_hashsize == 0)
+		quota_hashsize = 1;
+	get_random_bytes(&counter_hash_rnd, sizeof(counter_hash_rnd));
+
+	quota_notify_rs.burst = quota_notify_burst;
+	ret = genl_register_family(&quota_genl_family);
+	if (ret < 0)
+		return ret;
+	ret = genl_register_mc_group(&quota_genl_family, &quota_genl_mcgrp);
+	if (ret < 0)
+		goto out_family;
+
+	ret = q2_register_pernet();
+	if (ret < 0)
+		goto out_family;
 
 	ret = xt_register_matches(quota_mt2_reg, ARRAY_SIZE(quota_mt2_reg));
 	if (ret < 0)
-		remove_proc_entry("xt_quota", init_net__proc_net);
+		goto out_pernet;
+	return 0;
+
+ out_pernet:
+	q2_unregister_pernet();
+ out_family:
+	genl_unregister_family(&quota_genl_family);
 	return ret;
 }
 
 static void __exit quota_mt2_exit(void)
 {
 	xt_unregister_matches(quota_mt2_reg, ARRAY_SIZE(quota_mt2_reg));
-	remove_proc_entry("xt_quota", init_net__proc_net);
+	q2_unregister_pernet();
+	genl_unregister_family(&quota_genl_family);
 }
 
 module_init(quota_mt2_init);
@@ -9,11 +9,62 @@ enum xt_quota_flags {
 	XT_QUOTA_MASK      = 0x0F,
 };
 
+enum {
+	XT_QUOTA_MAX_BUCKETS = 64,
+	XT_QUOTA_MAX_NOTIFY  = 4,
+	XT_QUOTA_MAX_DEPTH   = 8,
+};
+
+/*
+ * Generic netlink family used for threshold notifications. Events are
+ * sent to the XT_QUOTA_GENL_MCGRP multicast group as XT_QUOTA_CMD_EVENT.
+ */
+#define XT_QUOTA_GENL_NAME  "xt_quota2"
+#define XT_QUOTA_GENL_MCGRP "events"
+
+enum {
+	XT_QUOTA_CMD_UNSPEC,
+	XT_QUOTA_CMD_EVENT,
+};
+
+enum {
+	XT_QUOTA_ATTR_UNSPEC,
+	XT_QUOTA_ATTR_NAME,      /* string, counter name */
+	XT_QUOTA_ATTR_QUOTA,     /* u64, value of the counter */
+	XT_QUOTA_ATTR_THRESHOLD, /* u64, threshold that was crossed */
+	__XT_QUOTA_ATTR_MAX,
+};
+#define XT_QUOTA_ATTR_MAX (__XT_QUOTA_ATTR_MAX - 1)
+
 struct xt_quota_counter;
 
+/**
+ * @interval:	reset period or window length (seconds), 0 = none
+ * @buckets:	number of sub-intervals for a sliding window, 0 = plain reset
+ * @nthresh:	number of used entries in @thresh
+ * @thresh:	send an event when the counter falls to or below these values
+ * @parent:	name of an existing counter that is charged along with this one
+ */
 struct xt_quota_mtinfo2 {
 	char name[15];
 	u_int8_t flags;
+	u_int32_t interval;
+	u_int8_t buckets;
+	u_int8_t nthresh;
+	char parent[15];
+	aligned_u64 thresh[XT_QUOTA_MAX_NOTIFY];
+
+	/* Comparison-invariant */
+	aligned_u64 quota;
+
+	/* Used internally by the kernel */
+	struct xt_quota_counter *master __attribute__((aligned(8)));
+};
+
+/* Revision 3, which has none of the options added in revision 4 */
+struct xt_quota_mtinfo2_v3 {
+	char name[15];
+	u_int8_t flags;
 
 	/* Comparison-invariant */
 	aligned_u64 quota;
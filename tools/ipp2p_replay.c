@@ -0,0 +1,960 @@
+/*
+ *	ipp2p_replay - run the xt_ipp2p signatures over a labelled corpus of
+ *	captures, or over built-in samples, in userspace
+ *
+ *	The module source is compiled in unchanged against kshim.h. Every
+ *	packet is matched by a rule asking for all protocols (or by several
+ *	copies of it), optionally with the connmark cache, against a simulated
+ *	conntrack table. Reported are
+ *	the detections per label and protocol, the false positives and misses,
+ *	the match rate, the module's own signature statistics and, on request,
+ *	the throughput of each signature on its own.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License
+ *	version 2, as published by the Free Software Foundation.
+ */
+#include "kshim.h"
+#include "xt_ipp2p.c"
+#include <getopt.h>
+
+unsigned long jiffies;
+bool kshim_lock_timing;
+struct kshim_lock_stats kshim_lock_stats;
+unsigned long kshim_genl_events;
+struct net init_net;
+struct nf_conn *kshim_ct;
+
+/*
+ * Labels are IPP2N_* protocols, or one of these. Capture files are
+ * labelled by their base name, up to the first '-' or '.': "bit-dht.pcap"
+ * holds BitTorrent, "none-web.pcap" traffic that must not match, and
+ * anything else is replayed unlabelled.
+ */
+enum {
+	LABEL_NONE = IPP2N_XDCC + 1,
+	LABEL_UNKNOWN,
+	LABEL_MAX,
+	/* detected as nothing, in the per-protocol columns */
+	DETECT_NONE = LABEL_NONE,
+};
+
+static const char *label_name(unsigned int label)
+{
+	if (label == LABEL_NONE)
+		return "none";
+	if (label == LABEL_UNKNOWN)
+		return "unlabelled";
+	return ipp2p_names[label];
+}
+
+/*
+ * One connection, in both directions. Its conntrack entry carries the
+ * connmark for --ct-mask; @detected is what it was first matched as.
+ * @inspected counts the packets whose payload the signatures were run on.
+ */
+struct flow {
+	union nf_inet_addr addr[2];
+	u16 port[2];
+	u8 family, proto, used, detected;
+	unsigned int packets, matched, inspected;
+	struct nf_conn ct;
+};
+
+static struct flow *flows;
+static unsigned int flows_size, flows_used;
+
+struct label_stats {
+	unsigned long long packets, matched, flows, flows_detected;
+	/* matched packets by the protocol they were matched as */
+	unsigned long long as[DETECT_NONE];
+	unsigned int files;
+};
+
+/* as in libxt_ipp2p */
+enum {
+	DEFAULT_CT_PACKETS = 10,
+};
+
+/* The rule as given, and the @nrules copies of it that packets go through */
+static struct ipt_p2p_info ipp2p_info, *rules;
+static unsigned int nrules = 1;
+static struct label_stats labels[LABEL_MAX];
+static unsigned int cur_label;
+static unsigned long long reorder_every;
+
+/*
+ * @cached:	packets matched by the connmark without being inspected
+ * @given_up:	flows the connmark gave up on (--ct-packets misses)
+ */
+static struct {
+	unsigned long long packets, skipped, matched, match_ns;
+	unsigned long long cached, given_up;
+} stats;
+static unsigned int sample_failures;
+
+/* Payloads kept for the per-signature benchmark */
+struct payload {
+	unsigned int offset, len;
+	bool tcp;
+};
+
+static unsigned int bench_rounds;
+static struct payload *payloads;
+static unsigned char *payload_data;
+static unsigned int payloads_used, payloads_size;
+static size_t payload_data_used, payload_data_size;
+
+static struct flow *flow_find(const union nf_inet_addr *a,
+    const union nf_inet_addr *b, u16 pa, u16 pb, u8 family, u8 proto)
+{
+	unsigned int i, mask;
+	struct flow *f, *old;
+	u32 key[10];
+	bool swap;
+
+	if (flows_used * 2 >= flows_size) {
+		old = flows;
+		i = flows_size;
+		flows_size = (flows_size == 0) ? 1024 : flows_size * 2;
+		flows = calloc(flows_size, sizeof(*flows));
+		if (flows == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		flows_used = 0;
+		while (i-- > 0)
+			if (old[i].used) {
+				f = flow_find(&old[i].addr[0], &old[i].addr[1],
+				    old[i].port[0], old[i].port[1],
+				    old[i].family, old[i].proto);
+				*f = old[i];
+			}
+		free(old);
+	}
+
+	/* Both directions are one flow: order the endpoints. */
+	swap = memcmp(a, b, sizeof(*a)) > 0 ||
+	       (memcmp(a, b, sizeof(*a)) == 0 && pa > pb);
+	if (swap) {
+		const union nf_inet_addr *t = a;
+		u16 tp = pa;
+
+		a = b; b = t;
+		pa = pb; pb = tp;
+	}
+	memcpy(key, a, 16);
+	memcpy(key + 4, b, 16);
+	key[8] = pa << 16 | pb;
+	key[9] = family << 8 | proto;
+
+	mask = flows_size - 1;
+	for (i = jhash2(key, ARRAY_SIZE(key), 0) & mask; ;
+	     i = (i + 1) & mask) {
+		f = &flows[i];
+		if (!f->used) {
+			memset(f, 0, sizeof(*f));
+			f->used     = true;
+			f->addr[0]  = *a;
+			f->addr[1]  = *b;
+			f->port[0]  = pa;
+			f->port[1]  = pb;
+			f->family   = family;
+			f->proto    = proto;
+			f->detected = DETECT_NONE;
+			++flows_used;
+			return f;
+		}
+		if (f->family == family && f->proto == proto &&
+		    f->port[0] == pa && f->port[1] == pb &&
+		    memcmp(&f->addr[0], a, sizeof(*a)) == 0 &&
+		    memcmp(&f->addr[1], b, sizeof(*b)) == 0)
+			return f;
+	}
+}
+
+static unsigned int ct_state(const struct flow *f)
+{
+	if (ipp2p_info.ct_mask == 0)
+		return 0;
+	return (f->ct.mark & ipp2p_info.ct_mask) >>
+	       (ffs(ipp2p_info.ct_mask) - 1);
+}
+
+/* Counts the flows of the file just replayed, and forgets them. */
+static void flows_account(void)
+{
+	struct label_stats *ls = &labels[cur_label];
+	unsigned int i;
+
+	for (i = 0; i < flows_size; ++i) {
+		if (!flows[i].used)
+			continue;
+		++ls->flows;
+		if (ipp2p_info.ct_mask != 0 && ct_state(&flows[i]) >=
+		    IPP2P_CT_MISS + ipp2p_info.ct_packets)
+			++stats.given_up;
+		if (cur_label == LABEL_NONE || cur_label == LABEL_UNKNOWN) {
+			if (flows[i].detected != DETECT_NONE)
+				++ls->flows_detected;
+		} else if (flows[i].detected == cur_label) {
+			++ls->flows_detected;
+		}
+	}
+	free(flows);
+	flows = NULL;
+	flows_size = flows_used = 0;
+}
+
+static void payload_keep(const unsigned char *data, unsigned int len, bool tcp)
+{
+	struct payload *p;
+
+	if (payloads_used == payloads_size) {
+		payloads_size = (payloads_size == 0) ? 1024 : payloads_size * 2;
+		payloads = realloc(payloads, payloads_size * sizeof(*payloads));
+		if (payloads == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	while (payload_data_used + len > payload_data_size) {
+		payload_data_size = (payload_data_size == 0) ? 65536 :
+		                    payload_data_size * 2;
+		payload_data = realloc(payload_data, payload_data_size);
+		if (payload_data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	p = &payloads[payloads_used++];
+	p->offset = payload_data_used;
+	p->len    = len;
+	p->tcp    = tcp;
+	memcpy(payload_data + payload_data_used, data, len);
+	payload_data_used += len;
+}
+
+/*
+ * Which protocol the packet just matched as: the signature whose hit
+ * counter moved or, if the verdict came from the connmark, the mark.
+ */
+static unsigned int detected_as(const struct flow *f)
+{
+	static u64 last[IPP2P_TCP_SIGS + IPP2P_UDP_SIGS];
+	const struct ipp2p_stats *all = per_cpu_ptr(ipp2p_stats, 0);
+	const struct ipp2p_stat *stat;
+	unsigned int i, ret = DETECT_NONE, state;
+
+	for (i = 0; i < IPP2P_TCP_SIGS + IPP2P_UDP_SIGS; ++i) {
+		stat = (i < IPP2P_TCP_SIGS) ? &all->tcp[i] :
+		       &all->udp[i - IPP2P_TCP_SIGS];
+		if (stat->hits == last[i])
+			continue;
+		last[i] = stat->hits;
+		ret = ffs(i < IPP2P_TCP_SIGS ? matchlist[i].command :
+		      udp_list[i - IPP2P_TCP_SIGS].command) - 1;
+	}
+	if (ret == DETECT_NONE && f != NULL && ipp2p_info.ct_mask != 0) {
+		state = ct_state(f);
+		if (state >= IPP2P_CT_PROTO && state < IPP2P_CT_MISS)
+			ret = state - IPP2P_CT_PROTO;
+	}
+	return ret;
+}
+
+/* How often any signature was run, to tell whether a packet was inspected */
+static u64 stat_calls(void)
+{
+	const struct ipp2p_stats *all = per_cpu_ptr(ipp2p_stats, 0);
+	unsigned int i;
+	u64 calls = 0;
+
+	for (i = 0; i < IPP2P_TCP_SIGS; ++i)
+		calls += all->tcp[i].calls;
+	for (i = 0; i < IPP2P_UDP_SIGS; ++i)
+		calls += all->udp[i].calls;
+	return calls;
+}
+
+/*
+ * Run one packet, starting at its network header, through the match.
+ * Returns its flow, if it has one.
+ */
+static struct flow *replay(unsigned char *data, unsigned int len)
+{
+	struct xt_action_param par = {};
+	struct sk_buff skb = {.data = data, .len = len};
+	union nf_inet_addr src, dst;
+	unsigned int thoff, l4len, hlen, as, r;
+	struct timespec t0, t1;
+	struct flow *f = NULL;
+	u16 sport = 0, dport = 0;
+	bool hit, inspected;
+	u64 calls;
+	u8 family;
+	int proto;
+
+	memset(&src, 0, sizeof(src));
+	memset(&dst, 0, sizeof(dst));
+	if (len >= sizeof(struct iphdr) && (data[0] >> 4) == 4) {
+		family = NFPROTO_IPV4;
+		thoff  = ip_hdrlen(&skb);
+		proto  = ip_hdr(&skb)->protocol;
+		l4len  = ntohs(ip_hdr(&skb)->tot_len);
+		if ((ntohs(ip_hdr(&skb)->frag_off) & IP_OFFSET) != 0 ||
+		    l4len > len || l4len < thoff) {
+			++stats.skipped;
+			return NULL;
+		}
+		l4len -= thoff;
+		src.ip = ip_hdr(&skb)->saddr;
+		dst.ip = ip_hdr(&skb)->daddr;
+	} else if (len >= sizeof(struct ipv6hdr) && (data[0] >> 4) == 6) {
+		unsigned short fragoff;
+
+		family = NFPROTO_IPV6;
+		proto  = ipv6_find_hdr(&skb, &thoff, -1, &fragoff);
+		l4len  = sizeof(struct ipv6hdr) +
+		         ntohs(ipv6_hdr(&skb)->payload_len);
+		if (proto < 0 || fragoff != 0 || l4len > len || l4len < thoff) {
+			++stats.skipped;
+			return NULL;
+		}
+		l4len -= thoff;
+		src.in6 = ipv6_hdr(&skb)->saddr;
+		dst.in6 = ipv6_hdr(&skb)->daddr;
+	} else {
+		++stats.skipped;
+		return NULL;
+	}
+	/* Captures may be padded; the match goes by the IP length. */
+	skb.len = thoff + l4len;
+	par.family = family;
+	par.thoff  = thoff;
+
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP ||
+	    proto == IPPROTO_UDPLITE) && l4len >= 4) {
+		memcpy(&sport, data + thoff, 2);
+		memcpy(&dport, data + thoff + 2, 2);
+		f = flow_find(&src, &dst, ntohs(sport), ntohs(dport),
+		    family, proto);
+	}
+	kshim_ct = (f != NULL) ? &f->ct : NULL;
+
+	if (bench_rounds > 0 && proto == IPPROTO_TCP &&
+	    l4len >= sizeof(struct tcphdr)) {
+		hlen = (data[thoff + 12] >> 4) * 4;
+		if (hlen >= sizeof(struct tcphdr) && hlen <= l4len)
+			payload_keep(data + thoff + hlen, l4len - hlen, true);
+	} else if (bench_rounds > 0 && (proto == IPPROTO_UDP ||
+	    proto == IPPROTO_UDPLITE) && l4len >= sizeof(struct udphdr)) {
+		payload_keep(data + thoff + sizeof(struct udphdr),
+		             l4len - sizeof(struct udphdr), false);
+	}
+
+	calls = stat_calls();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (hit = false, r = 0; r < nrules; ++r) {
+		par.matchinfo = &rules[r];
+		hit |= (family == NFPROTO_IPV4) ? ipp2p_mt4(&skb, &par) :
+		       ipp2p_mt6(&skb, &par);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats.match_ns += kshim_ns(&t1) - kshim_ns(&t0);
+	inspected = stat_calls() != calls;
+	++stats.packets;
+	++labels[cur_label].packets;
+	if (f != NULL) {
+		++f->packets;
+		f->matched   += hit;
+		f->inspected += inspected;
+	}
+
+	as = detected_as(f);
+	if (hit) {
+		++stats.matched;
+		++labels[cur_label].matched;
+		if (!inspected)
+			++stats.cached;
+		if (as != DETECT_NONE)
+			++labels[cur_label].as[as];
+		if (f != NULL && f->detected == DETECT_NONE)
+			f->detected = as;
+	}
+	if (reorder_every != 0 && stats.packets % reorder_every == 0)
+		ipp2p_reorder(&ipp2p_reorder_work.work);
+	return f;
+}
+
+/*
+ * pcap input, as in psd_replay. Both byte orders and the nanosecond
+ * variant of the classic file format are understood, for Ethernet, Linux
+ * cooked and raw IP captures.
+ */
+enum {
+	LINKTYPE_EN10MB     = 1,
+	LINKTYPE_RAW_BSD    = 12,
+	LINKTYPE_RAW        = 101,
+	LINKTYPE_LINUX_SLL  = 113,
+	LINKTYPE_IPV4       = 228,
+	LINKTYPE_IPV6       = 229,
+	LINKTYPE_LINUX_SLL2 = 276,
+};
+
+static u32 pcap_u32(const unsigned char *p, bool swapped)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static int pcap_l3_offset(const unsigned char *frame, unsigned int len,
+    unsigned int linktype)
+{
+	unsigned int off;
+	u16 proto;
+
+	switch (linktype) {
+	case LINKTYPE_RAW_BSD:
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		return 0;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		proto = frame[14] << 8 | frame[15];
+		off = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		proto = frame[0] << 8 | frame[1];
+		off = 20;
+		break;
+	case LINKTYPE_EN10MB:
+		if (len < 14)
+			return -1;
+		proto = frame[12] << 8 | frame[13];
+		off = 14;
+		while ((proto == 0x8100 || proto == 0x88A8) && len >= off + 4) {
+			proto = frame[off + 2] << 8 | frame[off + 3];
+			off += 4;
+		}
+		break;
+	default:
+		return -1;
+	}
+	return (proto == 0x0800 || proto == 0x86DD) ? off : -1;
+}
+
+static int replay_pcap(const char *file)
+{
+	static u32 pkt[65536 / sizeof(u32)];
+	unsigned char hdr[24], *frame = NULL;
+	unsigned int linktype, caplen, snaplen;
+	bool swapped, nsec;
+	FILE *fp;
+	u32 magic;
+	int off;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL) {
+		perror(file);
+		return -1;
+	}
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+		goto bad_format;
+	memcpy(&magic, hdr, sizeof(magic));
+	swapped = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+	nsec    = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+	if (!swapped && !nsec && magic != 0xA1B2C3D4)
+		goto bad_format;
+	snaplen  = pcap_u32(hdr + 16, swapped);
+	linktype = pcap_u32(hdr + 20, swapped) & 0xFFFF;
+	if (snaplen == 0 || snaplen > 0x40000)
+		snaplen = 0x40000;
+	frame = malloc(snaplen);
+	if (frame == NULL) {
+		perror("malloc");
+		fclose(fp);
+		return -1;
+	}
+
+	while (fread(hdr, 16, 1, fp) == 1) {
+		caplen = pcap_u32(hdr + 8, swapped);
+		if (caplen > snaplen)
+			goto bad_format;
+		if (fread(frame, caplen, 1, fp) != 1 && caplen != 0)
+			break;
+		off = pcap_l3_offset(frame, caplen, linktype);
+		if (off < 0) {
+			++stats.skipped;
+			continue;
+		}
+		caplen -= off;
+		if (caplen > sizeof(pkt))
+			caplen = sizeof(pkt);
+		/* Copy the network part so that its headers are aligned. */
+		memcpy(pkt, frame + off, caplen);
+		replay((unsigned char *)pkt, caplen);
+	}
+	free(frame);
+	fclose(fp);
+	return 0;
+
+ bad_format:
+	fprintf(stderr, "%s: not a pcap file, or truncated\n", file);
+	free(frame);
+	fclose(fp);
+	return -1;
+}
+
+static unsigned int label_of(const char *file)
+{
+	const char *base = strrchr(file, '/');
+	unsigned int i;
+	size_t n;
+
+	base = (base != NULL) ? base + 1 : file;
+	n = strcspn(base, "-.");
+	if (n == 4 && strncmp(base, "none", 4) == 0)
+		return LABEL_NONE;
+	for (i = 0; i < ARRAY_SIZE(ipp2p_names); ++i)
+		if (strlen(ipp2p_names[i]) == n &&
+		    strncmp(base, ipp2p_names[i], n) == 0)
+			return i;
+	return LABEL_UNKNOWN;
+}
+
+/*
+ * Built-in samples, for when no captures are given: a first packet of
+ * each kind of connection that the signatures are written for, and
+ * ordinary traffic that must not match. Each is sent over IPv4 and IPv6.
+ * Some flows go on with @follow packets of sample_filler, which matches
+ * nothing by itself: with --ct-mask, those of P2P flows must match from
+ * the connmark, and the others must be given up on after --ct-packets.
+ */
+static const struct sample {
+	unsigned int label;
+	u8 proto;
+	u16 port;
+	unsigned int follow;
+	unsigned int len;
+	const char *data;
+} samples[] = {
+#define SF(label, proto, port, follow, data) \
+	{(label), (proto), (port), (follow), sizeof(data) - 1, (data)}
+#define S(label, proto, port, data) SF((label), (proto), (port), 0, (data))
+	SF(IPP2N_EDK, IPPROTO_TCP, 4662, 4,
+	  "\xe3\x23\x00\x00\x00\x01\x10\x11\x22\x33\x44\x55\x66\x77\x88\x99"
+	  "\xaa\xbb\xcc\xdd\xee\xff\x00\x00\x00\x00\x36\x12\x02\x00\x00\x00"
+	  "\x02\x01\x00\x01\x04\x00\x74\x65"),
+	S(IPP2N_EDK, IPPROTO_UDP, 4665,
+	  "\xe3\x97\x12\x34\x56\x78\x00\x00\x00\x00\x10\x27\x00\x00"
+	  "\x40\x42\x0f\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+	  "\x00\x00\x00\x00\x00\x00"),
+	S(IPP2N_DC, IPPROTO_TCP, 411,
+	  "$Lock EXTENDEDPROTOCOLABCABCABCABCABCABC Pk=DCPLUSPLUS0.7|"),
+	S(IPP2N_DC, IPPROTO_TCP, 412, "$MyNick someone|"),
+	SF(IPP2N_GNU, IPPROTO_TCP, 6346, 4,
+	  "GNUTELLA CONNECT/0.6\r\nUser-Agent: LimeWire/4.12\r\n\r\n"),
+	S(IPP2N_GNU, IPPROTO_TCP, 6346,
+	  "GET /uri-res/N2R?urn:sha1:PLSTHIPQGSSZTS5FJUPAKUZWUGYQYPFB "
+	  "HTTP/1.1\r\nX-Queue: 0.1\r\nUser-Agent: Shareaza\r\n\r\n"),
+	S(IPP2N_GNU, IPPROTO_UDP, 6346, "GND\x02\x00\x01\x00\x00\x00\x00\x00\x00"),
+	S(IPP2N_KAZAA, IPPROTO_TCP, 1214, "GIVE 12345:abcdef\r\n"),
+	S(IPP2N_KAZAA, IPPROTO_TCP, 1214,
+	  "GET /.hash=0123456789abcdef HTTP/1.1\r\nHost: 10.0.0.1\r\n"
+	  "X-Kazaa-Username: someone\r\nX-Kazaa-Network: KaZaA\r\n\r\n"),
+	S(IPP2N_KAZAA, IPPROTO_UDP, 1214, "\x27\x00\x00\x00\x29\x80someoneKaZaA\x00"),
+	SF(IPP2N_BIT, IPPROTO_TCP, 6881, 4,
+	  "\x13" "BitTorrent protocol\x00\x00\x00\x00\x00\x10\x00\x05"
+	  "0123456789abcdefghij-UT2210-abcdefghijkl"),
+	S(IPP2N_BIT, IPPROTO_TCP, 80,
+	  "GET /announce?info_hash=%12%34%56%78%9a%bc%de%f0%12%34%56%78%9a"
+	  "%bc%de%f0%12%34%56%78&peer_id=-UT2210-abcdefghijkl&port=6881 "
+	  "HTTP/1.1\r\nHost: tracker.example.net\r\n\r\n"),
+	SF(IPP2N_BIT, IPPROTO_UDP, 6881, 4,
+	  "d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe"),
+	S(IPP2N_APPLE, IPPROTO_TCP, 9850, "ajprot\r\nversion: 1.0\r\n"),
+	S(IPP2N_XDCC, IPPROTO_TCP, 6667,
+	  "PRIVMSG [XDCC]Bot :xdcc send #12\r\n"),
+	SF(LABEL_NONE, IPPROTO_TCP, 80, 15,
+	  "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+	  "User-Agent: Mozilla/5.0\r\nAccept: */*\r\n\r\n"),
+	S(LABEL_NONE, IPPROTO_TCP, 80,
+	  "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n"
+	  "Content-Length: 17\r\n\r\n<html>hi</html>\r\n"),
+	S(LABEL_NONE, IPPROTO_TCP, 25,
+	  "EHLO mail.example.com\r\n"),
+	S(LABEL_NONE, IPPROTO_TCP, 6667,
+	  "PRIVMSG #channel :hello there, how is everybody?\r\n"),
+	S(LABEL_NONE, IPPROTO_TCP, 443,
+	  "\x16\x03\x01\x00\xc8\x01\x00\x00\xc4\x03\x03\x5b\x1a\x7e\x12\x00"
+	  "\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb\xcc\xdd\xee\xff\x00"),
+	SF(LABEL_NONE, IPPROTO_UDP, 53, 15,
+	  "\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00\x03www\x07"
+	  "example\x03" "com\x00\x00\x01\x00\x01"),
+	S(LABEL_NONE, IPPROTO_UDP, 123,
+	  "\x23\x00\x06\xec\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+	  "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+	  "\x00\x00\x00\x00\x00\x00\x00\x00\xe5\x2d\x3c\x94\x1a\x5e\x00\x00"),
+#undef S
+#undef SF
+};
+
+static const char sample_filler[] =
+	"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+	"eiusmod tempor incididunt ut labore et dolore magna aliqua.\r\n";
+
+static unsigned int sample_packet(u32 *buf, bool ipv6, unsigned int host,
+    const struct sample *s, const void *data, unsigned int len)
+{
+	unsigned char *p = (unsigned char *)buf, *l4;
+	unsigned int l3len, l4len;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+
+	l4len = (s->proto == IPPROTO_TCP) ? sizeof(struct tcphdr) :
+	        sizeof(struct udphdr);
+	if (ipv6) {
+		/* 2001:db8::<host> -> 2001:db8::1 */
+		l3len = sizeof(*ip6h);
+		ip6h = (struct ipv6hdr *)p;
+		memset(ip6h, 0, l3len);
+		ip6h->version     = 6;
+		ip6h->payload_len = htons(l4len + len);
+		ip6h->nexthdr     = s->proto;
+		ip6h->hop_limit   = 64;
+		ip6h->saddr.s6_addr[0] = ip6h->daddr.s6_addr[0] = 0x20;
+		ip6h->saddr.s6_addr[1] = ip6h->daddr.s6_addr[1] = 0x01;
+		ip6h->saddr.s6_addr[2] = ip6h->daddr.s6_addr[2] = 0x0D;
+		ip6h->saddr.s6_addr[3] = ip6h->daddr.s6_addr[3] = 0xB8;
+		ip6h->saddr.s6_addr[14] = host >> 8;
+		ip6h->saddr.s6_addr[15] = host;
+		ip6h->daddr.s6_addr[15] = 1;
+	} else {
+		/* 10.1.<host> -> 10.0.0.1 */
+		l3len = sizeof(*iph);
+		iph = (struct iphdr *)p;
+		memset(iph, 0, l3len);
+		iph->version  = 4;
+		iph->ihl      = l3len / 4;
+		iph->tot_len  = htons(l3len + l4len + len);
+		iph->ttl      = 64;
+		iph->protocol = s->proto;
+		iph->saddr    = htonl(0x0A010000 | (host & 0xFFFF));
+		iph->daddr    = htonl(0x0A000001);
+	}
+	l4 = p + l3len;
+	memset(l4, 0, l4len);
+	memcpy(l4, &(u16){htons(1024 + host % 60000)}, 2);
+	memcpy(l4 + 2, &(u16){htons(s->port)}, 2);
+	if (s->proto == IPPROTO_TCP) {
+		l4[12] = (sizeof(struct tcphdr) / 4) << 4;
+		l4[13] = 0x18; /* PSH, ACK */
+	} else {
+		memcpy(l4 + 4, &(u16){htons(l4len + len)}, 2);
+	}
+	memcpy(l4 + l4len, data, len);
+	return l3len + l4len + len;
+}
+
+/*
+ * Checks what became of a sample flow. Without --ct-mask, the filler must
+ * not have matched. With it, a P2P flow must be marked as its protocol
+ * and have matched on every packet, inspecting only the first one; other
+ * flows must have been inspected until they were given up on, after
+ * --ct-packets packets however many rules share the connmark bits.
+ */
+static void sample_check(unsigned int i, bool ipv6, const struct flow *f)
+{
+	const struct sample *s = &samples[i];
+	unsigned int state = ct_state(f), inspect;
+
+	if (ipp2p_info.ct_mask == 0) {
+		if (f->matched <= 1)
+			return;
+	} else if (s->label != LABEL_NONE) {
+		if (state == IPP2P_CT_PROTO + s->label &&
+		    f->matched == f->packets && f->inspected == 1)
+			return;
+	} else {
+		inspect = min(f->packets, ipp2p_info.ct_packets);
+		if (f->matched == 0 && f->inspected == inspect &&
+		    (f->packets < ipp2p_info.ct_packets ||
+		    state == IPP2P_CT_MISS + ipp2p_info.ct_packets))
+			return;
+	}
+	printf("FAIL: sample %u (%s) over IPv%u: %u of %u packets matched, "
+	       "%u inspected, connmark state %u\n", i, label_name(s->label),
+	       ipv6 ? 6 : 4, f->matched, f->packets, f->inspected, state);
+	++sample_failures;
+}
+
+/*
+ * Every sample, @rounds times, each time from another client, as its own
+ * "file" so that flows and labels are counted like for captures.
+ */
+static void replay_samples(unsigned int rounds)
+{
+	static u32 pkt[1024];
+	unsigned int i, j, r, v6, len, host = 0;
+	const struct sample *s;
+	struct flow *f;
+
+	for (i = 0; i < ARRAY_SIZE(samples); ++i) {
+		s = &samples[i];
+		cur_label = s->label;
+		++labels[cur_label].files;
+		for (r = 0; r < rounds; ++r)
+			for (v6 = 0; v6 < 2; ++v6) {
+				len = sample_packet(pkt, v6, ++host, s,
+				      s->data, s->len);
+				f = replay((unsigned char *)pkt, len);
+				for (j = 0; j < s->follow; ++j) {
+					len = sample_packet(pkt, v6, host, s,
+					      sample_filler,
+					      sizeof(sample_filler) - 1);
+					replay((unsigned char *)pkt, len);
+				}
+				sample_check(i, v6, f);
+			}
+		flows_account();
+	}
+}
+
+/*
+ * Runs each signature on its own over every kept payload it would be
+ * given, @bench_rounds times, with a fresh scan each time, so that the
+ * shared Aho-Corasick pass is charged to every signature using it.
+ */
+static void benchmark(void)
+{
+	unsigned long long calls, bytes, hits, ns;
+	struct timespec t0, t1;
+	struct ipp2p_scan scan;
+	const struct payload *p;
+	const unsigned char *data;
+	unsigned int i, j, r;
+
+	printf("signature benchmark (%u rounds over %u payloads):\n",
+	       bench_rounds, payloads_used);
+	printf("  %-4s %-11s %12s %8s %14s %10s %10s\n", "", "signature",
+	       "calls", "hits", "packets/s", "MB/s", "ns/call");
+	for (i = 0; i < IPP2P_TCP_SIGS + IPP2P_UDP_SIGS; ++i) {
+		bool tcp = i < IPP2P_TCP_SIGS;
+		unsigned int sig = tcp ? i : i - IPP2P_TCP_SIGS;
+		unsigned int min_len = tcp ? matchlist[sig].packet_len :
+		                       udp_list[sig].packet_len;
+
+		calls = bytes = hits = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r = 0; r < bench_rounds; ++r)
+			for (j = 0; j < payloads_used; ++j) {
+				p = &payloads[j];
+				if (p->tcp != tcp || p->len <= min_len)
+					continue;
+				data = payload_data + p->offset;
+				++calls;
+				bytes += p->len;
+				if (tcp) {
+					scan.payload = data;
+					scan.avail   = p->len;
+					scan.done    = false;
+					hits += matchlist[sig].function_name(data,
+					        p->len, &scan) != 0;
+				} else {
+					hits += udp_list[sig].function_name(data,
+					        p->len, p->len) != 0;
+				}
+			}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = kshim_ns(&t1) - kshim_ns(&t0);
+		if (calls == 0 || ns == 0) {
+			printf("  %-4s %-11s %12s\n", tcp ? "tcp" : "udp",
+			       ipp2p_names[ffs(tcp ? matchlist[sig].command :
+			       udp_list[sig].command) - 1], "-");
+			continue;
+		}
+		printf("  %-4s %-11s %12llu %8llu %14.0f %10.1f %10.1f\n",
+		       tcp ? "tcp" : "udp",
+		       ipp2p_names[ffs(tcp ? matchlist[sig].command :
+		       udp_list[sig].command) - 1], calls, hits / bench_rounds,
+		       calls * 1e9 / ns, bytes * 1e3 / ns, (double)ns / calls);
+	}
+}
+
+/*
+ * Returns the number of failures: labelled protocols never matched as
+ * themselves, and packets of "none" files that matched.
+ */
+static unsigned int report(bool verbose, double wall)
+{
+	struct seq_file seq = {.fp = stdout};
+	const struct label_stats *ls;
+	unsigned int i, j, failures = 0;
+
+	printf("packets:     %llu replayed, %llu skipped, %llu matched\n",
+	       stats.packets, stats.skipped, stats.matched);
+	if (stats.packets > 0 && stats.match_ns > 0)
+		printf("match:       %.0f packets/s, %.1f ns/packet\n",
+		       stats.packets * 1e9 / stats.match_ns,
+		       (double)stats.match_ns / stats.packets);
+	printf("wall time:   %.3f s\n", wall);
+	if (ipp2p_info.ct_mask != 0)
+		printf("connmark:    %llu packets matched without inspection, "
+		       "%llu flows given up\n", stats.cached, stats.given_up);
+
+	printf("%-11s %5s %10s %10s %10s %8s %8s  %s\n", "label", "files",
+	       "packets", "matched", "as label", "flows", "found",
+	       "matched as");
+	for (i = 0; i < LABEL_MAX; ++i) {
+		ls = &labels[i];
+		if (ls->files == 0)
+			continue;
+		printf("%-11s %5u %10llu %10llu ", label_name(i), ls->files,
+		       ls->packets, ls->matched);
+		if (i < DETECT_NONE)
+			printf("%10llu ", ls->as[i]);
+		else
+			printf("%10s ", "-");
+		printf("%8llu %8llu", ls->flows, ls->flows_detected);
+		for (j = 0; j < DETECT_NONE; ++j)
+			if (ls->as[j] != 0 && (j != i || verbose))
+				printf("  %s:%llu", ipp2p_names[j], ls->as[j]);
+		printf("\n");
+
+		if (i == LABEL_NONE && ls->matched != 0) {
+			printf("  FAIL: %llu false positives\n", ls->matched);
+			++failures;
+		} else if (i < DETECT_NONE && ls->as[i] == 0) {
+			printf("  FAIL: never matched as %s\n", label_name(i));
+			++failures;
+		}
+	}
+
+	printf("/proc/net/xt_ipp2p:\n");
+	ipp2p_stat_show(&seq, NULL);
+	return failures + sample_failures;
+}
+
+static void usage(const char *p)
+{
+	fprintf(stderr,
+"Usage: %s [options] [file.pcap...]\n"
+"Replays the capture files, or built-in samples if none are given, through\n"
+"an xt_ipp2p rule asking for all protocols. Files are labelled by their name\n"
+"up to the first '-' or '.' (e.g. bit-dht.pcap, none-web.pcap); the exit\n"
+"status is non-zero if a labelled protocol is never detected, or traffic\n"
+"labelled none is.\n\n"
+"Match and module options:\n"
+"  --ct-mask M      --ct-mask, against a simulated conntrack table\n"
+"  --ct-packets N   --ct-packets (default %u)\n"
+"  --reorder N      re-sort the signatures every N packets, as\n"
+"                   reorder_interval would\n"
+"  --rules N        match every packet with N copies of the rule, all\n"
+"                   sharing the connmark bits (default 1)\n"
+"Other:\n"
+"  -b N             benchmark each signature N times over all payloads\n"
+"  -n N             replay the built-in samples N times (default 1)\n"
+"  -v               also list matches as the label's own protocol\n",
+	p, DEFAULT_CT_PACKETS);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	enum {
+		OPT_CT_MASK = 256, OPT_CT_PACKETS, OPT_REORDER, OPT_RULES,
+	};
+	static const struct option opts[] = {
+		{"ct-mask",    true, NULL, OPT_CT_MASK},
+		{"ct-packets", true, NULL, OPT_CT_PACKETS},
+		{"reorder",    true, NULL, OPT_REORDER},
+		{"rules",      true, NULL, OPT_RULES},
+		{NULL},
+	};
+	struct xt_mtchk_param chk = {.net = &init_net, .matchinfo = &ipp2p_info};
+	unsigned int rounds = 1, failures;
+	struct timespec t0, t1;
+	bool verbose = false;
+	int c, i, ret = EXIT_SUCCESS;
+
+	ipp2p_info.cmd        = IPP2P_CT_ALL;
+	ipp2p_info.ct_packets = DEFAULT_CT_PACKETS;
+
+	while ((c = getopt_long(argc, argv, "b:n:v", opts, NULL)) != -1) {
+		switch (c) {
+		case OPT_CT_MASK:
+			ipp2p_info.ct_mask = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_CT_PACKETS:
+			ipp2p_info.ct_packets = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_REORDER:
+			reorder_every = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_RULES:
+			nrules = strtoul(optarg, NULL, 0);
+			if (nrules == 0)
+				usage(*argv);
+			break;
+		case 'b':
+			bench_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+
+	if (ipp2p_mt_init() < 0) {
+		fprintf(stderr, "module initialization failed\n");
+		return EXIT_FAILURE;
+	}
+	if (ipp2p_mt_check(&chk) < 0) {
+		fprintf(stderr, "match parameters rejected by checkentry\n");
+		ipp2p_mt_exit();
+		return EXIT_FAILURE;
+	}
+	rules = calloc(nrules, sizeof(*rules));
+	if (rules == NULL) {
+		perror("calloc");
+		ipp2p_mt_exit();
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nrules; ++i)
+		rules[i] = ipp2p_info;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (optind == argc)
+		replay_samples(rounds);
+	for (i = optind; i < argc; ++i) {
+		cur_label = label_of(argv[i]);
+		++labels[cur_label].files;
+		if (replay_pcap(argv[i]) < 0)
+			ret = EXIT_FAILURE;
+		flows_account();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	failures = report(verbose, (kshim_ns(&t1) - kshim_ns(&t0)) / 1e9);
+	if (bench_rounds > 0)
+		benchmark();
+	if (failures > 0)
+		ret = EXIT_FAILURE;
+	ipp2p_mt_exit();
+	free(rules);
+	free(payloads);
+	free(payload_data);
+	return ret;
+}
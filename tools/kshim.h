@@ -0,0 +1,656 @@
+#ifndef _XTA_KSHIM_H
+#define _XTA_KSHIM_H 1
+
+/*
+ *	Minimal stand-ins for the kernel interfaces used by some of the
+ *	Xtables-addons match modules, so that their packet-processing code
+ *	can be built and exercised as a plain userspace program. Only what
+ *	the modules actually use is provided, and only as far as it is
+ *	needed for replaying packets against them; see tools/Makefile.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License
+ *	version 2, as published by the Free Software Foundation.
+ */
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#	error The header layouts below assume a little-endian host.
+#endif
+
+#define LINUX_VERSION_CODE		KERNEL_VERSION(3, 2, 0)
+#define KERNEL_VERSION(a, b, c)		(((a) << 16) + ((b) << 8) + (c))
+#define CONFIG_NF_CONNTRACK		1
+#define CONFIG_NF_CONNTRACK_MARK	1
+#define KBUILD_MODNAME			"kshim"
+#define HZ				250
+
+typedef uint8_t u8, __u8;
+typedef uint16_t u16, __u16, __be16, __sum16;
+typedef uint32_t u32, __u32, __be32, __wsum;
+typedef uint64_t u64, __u64;
+typedef int32_t s32;
+typedef int64_t s64;
+#define __bitwise
+#define __force
+#define __init
+#define __exit
+#define __net_init
+#define __net_exit
+#define __read_mostly
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+#define likely(x)			__builtin_expect(!!(x), 1)
+#define unlikely(x)			__builtin_expect(!!(x), 0)
+#define ARRAY_SIZE(a)			(sizeof(a) / sizeof(*(a)))
+#define max(a, b)			((a) > (b) ? (a) : (b))
+#define min(a, b)			((a) < (b) ? (a) : (b))
+#define max_t(t, a, b)			max((t)(a), (t)(b))
+#define min_t(t, a, b)			min((t)(a), (t)(b))
+#define S_IRUGO				(S_IRUSR | S_IRGRP | S_IROTH)
+
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_ALIAS(x)
+#define MODULE_PARM_DESC(v, d)
+#define module_param(v, t, p)
+#define module_param_named(n, v, t, p)
+#define module_init(f)
+#define module_exit(f)
+#define THIS_MODULE			NULL
+#define pr_debug(fmt, ...)		do { } while (0)
+#define pr_info(fmt, ...)		printf(fmt, ##__VA_ARGS__)
+#define printk(fmt, ...)		fprintf(stderr, fmt, ##__VA_ARGS__)
+#define KERN_WARNING			""
+
+#define __constant_htons(x)		htons(x)
+#define __constant_htonl(x)		htonl(x)
+#define get_unaligned(p) \
+	({ __typeof__(*(p) + 0) __v; memcpy(&__v, (p), sizeof(__v)); __v; })
+
+#define GFP_KERNEL			0
+#define GFP_ATOMIC			0
+#define vmalloc(size)			malloc(size)
+#define vfree(p)			free(p)
+#define kmalloc(size, flags)		malloc(size)
+#define kzalloc(size, flags)		calloc(1, (size))
+#define kfree(p)			free(p)
+
+/* Time is driven by the harness, not by a timer interrupt. */
+extern unsigned long jiffies;
+#define time_after_eq(a, b)		((long)((a) - (b)) >= 0)
+#define time_before(a, b)		((long)((a) - (b)) < 0)
+
+static inline void get_random_bytes(void *buf, int len)
+{
+	unsigned char *p = buf;
+
+	while (len-- > 0)
+		*p++ = rand();
+}
+
+/*
+ * Locks are not contended in a single-threaded replay; instead, the time
+ * spent between lock and unlock is accounted, if kshim_lock_timing is set.
+ */
+typedef struct {
+	struct timespec taken;
+} spinlock_t;
+
+struct kshim_lock_stats {
+	unsigned long long count, total_ns, max_ns;
+};
+extern bool kshim_lock_timing;
+extern struct kshim_lock_stats kshim_lock_stats;
+
+static inline unsigned long long kshim_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline void spin_lock_init(spinlock_t *l)
+{
+	memset(l, 0, sizeof(*l));
+}
+
+static inline void spin_lock(spinlock_t *l)
+{
+	if (kshim_lock_timing)
+		clock_gettime(CLOCK_MONOTONIC, &l->taken);
+}
+
+static inline void spin_unlock(spinlock_t *l)
+{
+	struct timespec now;
+	unsigned long long held;
+
+	if (!kshim_lock_timing)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	held = kshim_ns(&now) - kshim_ns(&l->taken);
+	++kshim_lock_stats.count;
+	kshim_lock_stats.total_ns += held;
+	if (held > kshim_lock_stats.max_ns)
+		kshim_lock_stats.max_ns = held;
+}
+
+#define spin_lock_bh(l)			spin_lock(l)
+#define spin_unlock_bh(l)		spin_unlock(l)
+
+/* There is one CPU, and RCU readers never overlap with updates. */
+#define alloc_percpu(type)		((type *)calloc(1, sizeof(type)))
+#define free_percpu(p)			free(p)
+#define per_cpu_ptr(p, cpu)		(p)
+#define smp_processor_id()		0
+#define for_each_possible_cpu(cpu)	for ((cpu) = 0; (cpu) < 1; ++(cpu))
+
+#define rcu_dereference(p)		(p)
+#define rcu_assign_pointer(p, v)	((p) = (v))
+#define synchronize_rcu()		do { } while (0)
+
+/* Deferred work never runs by itself; the harness calls the handlers. */
+struct work_struct {
+	void (*func)(struct work_struct *);
+};
+
+struct delayed_work {
+	struct work_struct work;
+};
+
+#define INIT_DELAYED_WORK(w, f)		((w)->work.func = (f))
+
+static inline bool schedule_delayed_work(struct delayed_work *w,
+    unsigned long delay)
+{
+	return true;
+}
+
+static inline bool cancel_delayed_work_sync(struct delayed_work *w)
+{
+	return false;
+}
+
+/* jhash2 as in include/linux/jhash.h */
+#define JHASH_INITVAL			0xdeadbeef
+
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+	return (word << shift) | (word >> (32 - shift));
+}
+
+#define __jhash_mix(a, b, c) { \
+	a -= c; a ^= rol32(c, 4);  c += b; \
+	b -= a; b ^= rol32(a, 6);  a += c; \
+	c -= b; c ^= rol32(b, 8);  b += a; \
+	a -= c; a ^= rol32(c, 16); c += b; \
+	b -= a; b ^= rol32(a, 19); a += c; \
+	c -= b; c ^= rol32(b, 4);  b += a; \
+}
+
+#define __jhash_final(a, b, c) { \
+	c ^= b; c -= rol32(b, 14); \
+	a ^= c; a -= rol32(c, 11); \
+	b ^= a; b -= rol32(a, 25); \
+	c ^= b; c -= rol32(b, 16); \
+	a ^= c; a -= rol32(c, 4);  \
+	b ^= a; b -= rol32(a, 14); \
+	c ^= b; c -= rol32(b, 24); \
+}
+
+static inline u32 jhash2(const u32 *k, u32 length, u32 initval)
+{
+	u32 a, b, c;
+
+	a = b = c = JHASH_INITVAL + (length << 2) + initval;
+	while (length > 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		length -= 3;
+		k += 3;
+	}
+	switch (length) {
+	case 3:
+		c += k[2];
+	case 2:
+		b += k[1];
+	case 1:
+		a += k[0];
+		__jhash_final(a, b, c);
+	case 0:
+		break;
+	}
+	return c;
+}
+
+/* Network namespaces: there is only init_net. */
+struct proc_dir_entry {
+	void *data;
+};
+
+struct net {
+	struct proc_dir_entry *proc_net;
+	void *gen;
+};
+extern struct net init_net;
+
+struct pernet_operations {
+	int (*init)(struct net *);
+	void (*exit)(struct net *);
+	int *id;
+	size_t size;
+};
+
+static inline void *net_generic(const struct net *net, int id)
+{
+	return net->gen;
+}
+
+static inline int register_pernet_subsys(struct pernet_operations *ops)
+{
+	int ret;
+
+	init_net.gen = calloc(1, ops->size);
+	if (init_net.gen == NULL)
+		return -1;
+	ret = ops->init(&init_net);
+	if (ret < 0)
+		free(init_net.gen);
+	return ret;
+}
+
+static inline void unregister_pernet_subsys(struct pernet_operations *ops)
+{
+	ops->exit(&init_net);
+	free(init_net.gen);
+	init_net.gen = NULL;
+}
+
+struct net_device {
+	int ifindex;
+};
+
+static inline struct net *dev_net(const struct net_device *dev)
+{
+	return &init_net;
+}
+
+/* procfs and seq_file: files are not created, shows write to a stdio file. */
+struct inode;
+struct file;
+
+struct file_operations {
+	int (*open)(struct inode *, struct file *);
+	ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+	loff_t (*llseek)(struct file *, loff_t, int);
+	int (*release)(struct inode *, struct file *);
+	void *owner;
+};
+
+struct seq_file {
+	FILE *fp;
+	void *private;
+};
+
+static inline int seq_printf(struct seq_file *seq, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(seq->fp, fmt, args);
+	va_end(args);
+	return 0;
+}
+
+#define PDE(inode)			((struct proc_dir_entry *)(inode))
+static inline int single_open(struct file *f,
+    int (*show)(struct seq_file *, void *), void *data)
+{
+	return 0;
+}
+static inline ssize_t seq_read(struct file *f, char *b, size_t n, loff_t *p)
+{
+	return 0;
+}
+static inline loff_t seq_lseek(struct file *f, loff_t o, int w)
+{
+	return 0;
+}
+static inline int single_release(struct inode *i, struct file *f)
+{
+	return 0;
+}
+
+static inline struct proc_dir_entry *
+proc_create_data(const char *name, unsigned int mode,
+    struct proc_dir_entry *parent, const struct file_operations *fops,
+    void *data)
+{
+	static struct proc_dir_entry entry;
+
+	entry.data = data;
+	return &entry;
+}
+
+static inline struct proc_dir_entry *
+proc_create(const char *name, unsigned int mode,
+    struct proc_dir_entry *parent, const struct file_operations *fops)
+{
+	return proc_create_data(name, mode, parent, fops, NULL);
+}
+
+static inline void remove_proc_entry(const char *name,
+    struct proc_dir_entry *parent)
+{
+}
+
+/* Generic netlink: messages are counted and dropped. */
+struct sk_buff;
+extern unsigned long kshim_genl_events;
+
+struct genl_family {
+	unsigned int id;
+	const char *name;
+	unsigned int version, maxattr;
+	bool netnsok;
+};
+
+struct genl_multicast_group {
+	const char *name;
+	unsigned int id;
+};
+
+#define GENL_ID_GENERATE		0
+#define nla_total_size(payload)		(4 + (((payload) + 3) & ~3))
+#define NLA_PUT(skb, type, len, data) \
+	do { if ((skb) == NULL) goto nla_put_failure; } while (0)
+#define NLA_PUT_U8(skb, type, value)	NLA_PUT((skb), (type), 1, &(value))
+#define NLA_PUT_U32(skb, type, value)	NLA_PUT((skb), (type), 4, &(value))
+#define NLA_PUT_U64(skb, type, value)	NLA_PUT((skb), (type), 8, &(value))
+#define NLA_PUT_STRING(skb, type, value) NLA_PUT((skb), (type), 0, (value))
+
+static inline int genl_register_family(struct genl_family *f)
+{
+	return 0;
+}
+static inline int genl_register_mc_group(struct genl_family *f,
+    struct genl_multicast_group *g)
+{
+	return 0;
+}
+static inline int genl_unregister_family(struct genl_family *f)
+{
+	return 0;
+}
+
+/* Rate limiting is left to the harness. */
+struct ratelimit_state {
+	unsigned int interval, burst;
+};
+#define DEFINE_RATELIMIT_STATE(name, i, b) \
+	struct ratelimit_state name = {(i), (b)}
+#define __ratelimit(rs)			1
+
+/* Packet headers, as in the kernel's uapi headers (little endian). */
+struct iphdr {
+	u8 ihl:4, version:4;
+	u8 tos;
+	__be16 tot_len, id, frag_off;
+	u8 ttl, protocol;
+	__sum16 check;
+	__be32 saddr, daddr;
+};
+#define IP_OFFSET			0x1FFF
+
+struct ipv6hdr {
+	u8 priority:4, version:4;
+	u8 flow_lbl[3];
+	__be16 payload_len;
+	u8 nexthdr, hop_limit;
+	struct in6_addr saddr, daddr;
+};
+
+struct tcphdr {
+	__be16 source, dest;
+	__be32 seq, ack_seq;
+	u16 res1:4, doff:4, fin:1, syn:1, rst:1, psh:1,
+	    ack:1, urg:1, ece:1, cwr:1;
+	__be16 window;
+	__sum16 check;
+	__be16 urg_ptr;
+};
+
+struct udphdr {
+	__be16 source, dest, len;
+	__sum16 check;
+};
+
+union nf_inet_addr {
+	__be32 ip;
+	__be32 ip6[4];
+	struct in_addr in;
+	struct in6_addr in6;
+};
+
+enum {
+	NFPROTO_UNSPEC =  0,
+	NFPROTO_IPV4   =  2,
+	NFPROTO_IPV6   = 10,
+};
+
+/* The packet is always linear: @data points at the network header. */
+struct sk_buff {
+	unsigned char *data;
+	unsigned int len;
+};
+
+static inline void *skb_header_pointer(const struct sk_buff *skb, int offset,
+    int len, void *buffer)
+{
+	if (offset < 0 || offset + len > skb->len)
+		return NULL;
+	return skb->data + offset;
+}
+
+static inline struct sk_buff *genlmsg_new(size_t payload, int flags)
+{
+	return calloc(1, sizeof(struct sk_buff));
+}
+
+static inline void *genlmsg_put(struct sk_buff *skb, u32 pid, u32 seq,
+    struct genl_family *family, int flags, u8 cmd)
+{
+	return skb;
+}
+
+static inline int genlmsg_end(struct sk_buff *skb, void *hdr)
+{
+	return 0;
+}
+
+static inline void kfree_skb(struct sk_buff *skb)
+{
+	free(skb);
+}
+
+static inline int genlmsg_multicast_netns(struct net *net,
+    struct sk_buff *skb, u32 pid, unsigned int group, int flags)
+{
+	++kshim_genl_events;
+	kfree_skb(skb);
+	return 0;
+}
+
+static inline unsigned int skb_headlen(const struct sk_buff *skb)
+{
+	return skb->len;
+}
+
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb)
+{
+	return (struct iphdr *)skb->data;
+}
+
+static inline unsigned int ip_hdrlen(const struct sk_buff *skb)
+{
+	return ip_hdr(skb)->ihl * 4;
+}
+
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb)
+{
+	return (struct ipv6hdr *)skb->data;
+}
+
+static inline u8 ipv6_get_dsfield(const struct ipv6hdr *ip6h)
+{
+	return ntohs(*(const __be16 *)ip6h) >> 4;
+}
+
+static inline bool ipv6_addr_any(const struct in6_addr *a)
+{
+	static const struct in6_addr any;
+
+	return memcmp(a, &any, sizeof(any)) == 0;
+}
+
+static inline void ipv6_addr_prefix(struct in6_addr *pfx,
+    const struct in6_addr *addr, int plen)
+{
+	int o = plen >> 3, b = plen & 7;
+
+	memset(pfx, 0, sizeof(*pfx));
+	memcpy(pfx->s6_addr, addr->s6_addr, o);
+	if (b != 0)
+		pfx->s6_addr[o] = addr->s6_addr[o] & (0xff00 >> b);
+}
+
+/*
+ * Simplified ipv6_find_hdr: walks the common extension headers and returns
+ * the upper-layer protocol, with @offset pointing at its header.
+ */
+static inline int ipv6_find_hdr(const struct sk_buff *skb,
+    unsigned int *offset, int target, unsigned short *fragoff)
+{
+	unsigned int start = sizeof(struct ipv6hdr);
+	u8 nexthdr = ipv6_hdr(skb)->nexthdr;
+	const u8 *hp;
+
+	if (fragoff != NULL)
+		*fragoff = 0;
+	for (;;) {
+		if (nexthdr != IPPROTO_HOPOPTS && nexthdr != IPPROTO_ROUTING &&
+		    nexthdr != IPPROTO_DSTOPTS && nexthdr != IPPROTO_FRAGMENT)
+			break;
+		if (start + 8 > skb->len)
+			return -1;
+		hp = skb->data + start;
+		if (nexthdr == IPPROTO_FRAGMENT) {
+			if (fragoff != NULL)
+				*fragoff = ntohs(*(const __be16 *)(hp + 2)) & ~7;
+			nexthdr = hp[0];
+			start += 8;
+			continue;
+		}
+		nexthdr = hp[0];
+		start += (hp[1] + 1) << 3;
+	}
+	*offset = start;
+	return nexthdr;
+}
+
+/* Connection tracking: the harness sets the entry of the next packet. */
+struct nf_conn {
+	u32 mark;
+};
+
+enum ip_conntrack_info {
+	IP_CT_ESTABLISHED,
+	IP_CT_RELATED,
+	IP_CT_NEW,
+};
+extern struct nf_conn *kshim_ct;
+
+static inline struct nf_conn *nf_ct_get(const struct sk_buff *skb,
+    enum ip_conntrack_info *ctinfo)
+{
+	*ctinfo = IP_CT_ESTABLISHED;
+	return kshim_ct;
+}
+
+static inline bool nf_ct_is_untracked(const struct nf_conn *ct)
+{
+	return false;
+}
+
+/* Xtables */
+#define XT_EXTENSION_MAXNAMELEN		29
+
+struct xt_match;
+struct xt_action_param {
+	const struct xt_match *match;
+	const void *matchinfo;
+	const struct net_device *in, *out;
+	int fragoff;
+	unsigned int thoff, hooknum;
+	u8 family;
+	bool hotdrop;
+};
+
+struct xt_mtchk_param {
+	struct net *net;
+	const char *table;
+	const void *entryinfo;
+	const struct xt_match *match;
+	void *matchinfo;
+	unsigned int hook_mask;
+	u8 family;
+};
+
+struct xt_mtdtor_param {
+	struct net *net;
+	const struct xt_match *match;
+	void *matchinfo;
+	u8 family;
+};
+
+struct xt_match {
+	char name[XT_EXTENSION_MAXNAMELEN];
+	u8 revision;
+	bool (*match)(const struct sk_buff *, struct xt_action_param *);
+	int (*checkentry)(const struct xt_mtchk_param *);
+	void (*destroy)(const struct xt_mtdtor_param *);
+	void *me;
+	const char *table;
+	unsigned int matchsize, hooks;
+	unsigned short proto, family;
+};
+
+struct xt_target {
+	char name[XT_EXTENSION_MAXNAMELEN];
+};
+struct xt_tgchk_param;
+struct xt_tgdtor_param;
+
+static inline int xt_register_matches(struct xt_match *m, unsigned int n)
+{
+	return 0;
+}
+static inline void xt_unregister_matches(struct xt_match *m, unsigned int n)
+{
+}
+
+#endif /* _XTA_KSHIM_H */
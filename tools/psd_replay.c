@@ -0,0 +1,670 @@
+/*
+ *	psd_replay - run the xt_psd scan detection over recorded or generated
+ *	traffic in userspace
+ *
+ *	The module source is compiled in unchanged against kshim.h. Packets
+ *	are fed to its match functions in timestamp order, with jiffies
+ *	following the packet timestamps. Reported are the sources detected,
+ *	for generated traffic also the false positives and missed scanners,
+ *	the packet rate and optionally the time spent with the shard lock
+ *	held.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License
+ *	version 2, as published by the Free Software Foundation.
+ */
+#include "kshim.h"
+#include "xt_psd.c"
+#include <getopt.h>
+
+unsigned long jiffies;
+bool kshim_lock_timing;
+struct kshim_lock_stats kshim_lock_stats;
+unsigned long kshim_genl_events;
+struct net init_net;
+
+enum {
+	SRC_BENIGN = 0,
+	SRC_SCAN,
+	SRC_SLOW,
+	SRC_UNKNOWN,
+};
+
+static const char *const src_kind_names[] = {
+	"benign", "scanner", "slow scanner", "unknown",
+};
+
+/*
+ * Every source address seen, with what it was generated as (or
+ * SRC_UNKNOWN for captures) and whether the match fired for it.
+ */
+struct source {
+	union nf_inet_addr addr;
+	u_int8_t family, kind, used;
+	bool detected;
+	unsigned long matched;
+};
+
+static struct xt_psd_info psd_info;
+static struct source *sources;
+static unsigned int sources_size, sources_used;
+
+static struct {
+	unsigned long long packets, skipped, matched, match_ns;
+} stats;
+
+static struct source *source_find(const union nf_inet_addr *addr,
+    u_int8_t family)
+{
+	unsigned int i, mask;
+	struct source *s, *old;
+
+	if (sources_used * 2 >= sources_size) {
+		old = sources;
+		i = sources_size;
+		sources_size = (sources_size == 0) ? 1024 : sources_size * 2;
+		sources = calloc(sources_size, sizeof(*sources));
+		if (sources == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		sources_used = 0;
+		while (i-- > 0)
+			if (old[i].used) {
+				s = source_find(&old[i].addr, old[i].family);
+				*s = old[i];
+			}
+		free(old);
+	}
+
+	mask = sources_size - 1;
+	for (i = jhash2((const u32 *)addr, 4, family) & mask; ;
+	     i = (i + 1) & mask) {
+		s = &sources[i];
+		if (!s->used) {
+			s->used   = true;
+			s->addr   = *addr;
+			s->family = family;
+			s->kind   = SRC_UNKNOWN;
+			++sources_used;
+			return s;
+		}
+		if (s->family == family &&
+		    memcmp(&s->addr, addr, sizeof(*addr)) == 0)
+			return s;
+	}
+}
+
+/*
+ * Run one packet, starting at its network header, through the match.
+ * @usec is the capture time, from which jiffies are derived.
+ */
+static void replay(unsigned char *data, unsigned int len,
+    unsigned long long usec, int kind)
+{
+	static struct net_device dev;
+	struct xt_action_param par = {.in = &dev};
+	struct sk_buff skb = {.data = data, .len = len};
+	union nf_inet_addr src;
+	struct timespec t0, t1;
+	struct source *s;
+	u_int8_t family;
+	bool hit;
+
+	memset(&src, 0, sizeof(src));
+	if (len >= sizeof(struct iphdr) && (data[0] >> 4) == 4) {
+		family    = NFPROTO_IPV4;
+		par.thoff = (data[0] & 0x0F) * 4;
+		memcpy(&src.ip, &ip_hdr(&skb)->saddr, sizeof(src.ip));
+	} else if (len >= sizeof(struct ipv6hdr) && (data[0] >> 4) == 6) {
+		family    = NFPROTO_IPV6;
+		memcpy(&src.in6, &ipv6_hdr(&skb)->saddr, sizeof(src.in6));
+	} else {
+		++stats.skipped;
+		return;
+	}
+
+	jiffies = usec * HZ / 1000000;
+	par.family = family;
+	par.matchinfo = &psd_info;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	hit = (family == NFPROTO_IPV4) ? xt_psd_match(&skb, &par) :
+	      xt_psd_match6(&skb, &par);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats.match_ns += kshim_ns(&t1) - kshim_ns(&t0);
+	++stats.packets;
+
+	s = source_find(&src, family);
+	if (kind != SRC_UNKNOWN)
+		s->kind = kind;
+	if (hit) {
+		++stats.matched;
+		++s->matched;
+		s->detected = true;
+	}
+}
+
+/*
+ * pcap input. Both byte orders and the nanosecond variant of the classic
+ * file format are understood, for Ethernet, Linux cooked and raw IP
+ * captures.
+ */
+enum {
+	LINKTYPE_EN10MB     = 1,
+	LINKTYPE_RAW_BSD    = 12,
+	LINKTYPE_RAW        = 101,
+	LINKTYPE_LINUX_SLL  = 113,
+	LINKTYPE_IPV4       = 228,
+	LINKTYPE_IPV6       = 229,
+	LINKTYPE_LINUX_SLL2 = 276,
+};
+
+static u32 pcap_u32(const unsigned char *p, bool swapped)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+/*
+ * Returns the offset of the network header within @frame, or -1 if the
+ * frame does not carry IPv4 or IPv6.
+ */
+static int pcap_l3_offset(const unsigned char *frame, unsigned int len,
+    unsigned int linktype)
+{
+	unsigned int off;
+	u16 proto;
+
+	switch (linktype) {
+	case LINKTYPE_RAW_BSD:
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		return 0;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		proto = frame[14] << 8 | frame[15];
+		off = 16;
+		break;
+	case LINKTYPE_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		proto = frame[0] << 8 | frame[1];
+		off = 20;
+		break;
+	case LINKTYPE_EN10MB:
+		if (len < 14)
+			return -1;
+		proto = frame[12] << 8 | frame[13];
+		off = 14;
+		while ((proto == 0x8100 || proto == 0x88A8) && len >= off + 4) {
+			proto = frame[off + 2] << 8 | frame[off + 3];
+			off += 4;
+		}
+		break;
+	default:
+		return -1;
+	}
+	return (proto == 0x0800 || proto == 0x86DD) ? off : -1;
+}
+
+static int replay_pcap(const char *file)
+{
+	static u32 pkt[65536 / sizeof(u32)];
+	unsigned char hdr[24], *frame = NULL;
+	unsigned int linktype, caplen, snaplen;
+	unsigned long long usec;
+	bool swapped, nsec;
+	FILE *fp;
+	u32 magic;
+	int off;
+
+	fp = fopen(file, "rb");
+	if (fp == NULL) {
+		perror(file);
+		return -1;
+	}
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+		goto bad_format;
+	memcpy(&magic, hdr, sizeof(magic));
+	swapped = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+	nsec    = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+	if (!swapped && !nsec && magic != 0xA1B2C3D4)
+		goto bad_format;
+	snaplen  = pcap_u32(hdr + 16, swapped);
+	linktype = pcap_u32(hdr + 20, swapped) & 0xFFFF;
+	if (snaplen == 0 || snaplen > 0x40000)
+		snaplen = 0x40000;
+	frame = malloc(snaplen);
+	if (frame == NULL) {
+		perror("malloc");
+		fclose(fp);
+		return -1;
+	}
+
+	while (fread(hdr, 16, 1, fp) == 1) {
+		caplen = pcap_u32(hdr + 8, swapped);
+		if (caplen > snaplen)
+			goto bad_format;
+		if (fread(frame, caplen, 1, fp) != 1 && caplen != 0)
+			break;
+		usec = pcap_u32(hdr, swapped) * 1000000ULL;
+		usec += pcap_u32(hdr + 4, swapped) / (nsec ? 1000 : 1);
+		off = pcap_l3_offset(frame, caplen, linktype);
+		if (off < 0) {
+			++stats.skipped;
+			continue;
+		}
+		caplen -= off;
+		if (caplen > sizeof(pkt))
+			caplen = sizeof(pkt);
+		/* Copy the network part so that its headers are aligned. */
+		memcpy(pkt, frame + off, caplen);
+		replay((unsigned char *)pkt, caplen, usec, SRC_UNKNOWN);
+	}
+	free(frame);
+	fclose(fp);
+	return 0;
+
+ bad_format:
+	fprintf(stderr, "%s: not a pcap file, or truncated\n", file);
+	free(frame);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ * Traffic generator. Benign clients talk to a handful of services on a few
+ * servers, mostly with established-connection (ACK) packets. Scanners
+ * sweep the ports of one target each, fast enough to be detected; slow
+ * scanners leave more than the delay threshold between probes and show
+ * what the detection misses by design.
+ */
+static struct gen_config {
+	unsigned long long packets;
+	unsigned int rate, benign, scanners, slow, scan_share;
+	bool ipv6;
+} gen = {
+	.packets    = 1000000,
+	.rate       = 10000,
+	.benign     = 2000,
+	.scanners   = 20,
+	.slow       = 5,
+	.scan_share = 5,
+};
+
+struct gen_source {
+	union nf_inet_addr addr, target;
+	unsigned int next_port;
+	unsigned long long next_usec;
+};
+
+static const u16 benign_ports[] = {22, 25, 53, 80, 443, 993, 8080};
+
+static void gen_addr(union nf_inet_addr *addr, bool ipv6, u8 net,
+    unsigned int host)
+{
+	memset(addr, 0, sizeof(*addr));
+	if (ipv6) {
+		/* 2001:db8:<net>::<host> */
+		addr->in6.s6_addr[0] = 0x20;
+		addr->in6.s6_addr[1] = 0x01;
+		addr->in6.s6_addr[2] = 0x0D;
+		addr->in6.s6_addr[3] = 0xB8;
+		addr->in6.s6_addr[5] = net;
+		addr->in6.s6_addr[12] = host >> 24;
+		addr->in6.s6_addr[13] = host >> 16;
+		addr->in6.s6_addr[14] = host >> 8;
+		addr->in6.s6_addr[15] = host;
+	} else {
+		/* 10.<net>.0.0/16 */
+		addr->ip = htonl(0x0A000000 | net << 16 | (host & 0xFFFF));
+	}
+}
+
+/*
+ * Build a packet into @buf; @tcp_flags is used for TCP, a @proto of
+ * IPPROTO_UDP yields a UDP packet.
+ */
+static unsigned int gen_packet(u32 *buf, bool ipv6,
+    const union nf_inet_addr *src, const union nf_inet_addr *dst,
+    u8 proto, u16 sport, u16 dport, u8 tcp_flags)
+{
+	unsigned char *p = (unsigned char *)buf, *l4;
+	unsigned int l3len, l4len;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+
+	l4len = (proto == IPPROTO_TCP) ? sizeof(struct tcphdr) :
+	        sizeof(struct udphdr);
+	if (ipv6) {
+		l3len = sizeof(*ip6h);
+		ip6h = (struct ipv6hdr *)p;
+		memset(ip6h, 0, l3len);
+		ip6h->version     = 6;
+		ip6h->payload_len = htons(l4len);
+		ip6h->nexthdr     = proto;
+		ip6h->hop_limit   = 64;
+		ip6h->saddr       = src->in6;
+		ip6h->daddr       = dst->in6;
+	} else {
+		l3len = sizeof(*iph);
+		iph = (struct iphdr *)p;
+		memset(iph, 0, l3len);
+		iph->version  = 4;
+		iph->ihl      = l3len / 4;
+		iph->tot_len  = htons(l3len + l4len);
+		iph->ttl      = 64;
+		iph->protocol = proto;
+		iph->saddr    = src->ip;
+		iph->daddr    = dst->ip;
+	}
+	l4 = p + l3len;
+	memset(l4, 0, l4len);
+	memcpy(l4, &(u16){htons(sport)}, 2);
+	memcpy(l4 + 2, &(u16){htons(dport)}, 2);
+	if (proto == IPPROTO_TCP) {
+		l4[12] = (sizeof(struct tcphdr) / 4) << 4;
+		l4[13] = tcp_flags;
+	}
+	return l3len + l4len;
+}
+
+#define TH_SYN 0x02
+#define TH_ACK 0x10
+
+static struct gen_source *gen_sources(unsigned int n, u8 net, bool scanner)
+{
+	struct gen_source *s = calloc(n > 0 ? n : 1, sizeof(*s));
+	unsigned int i;
+
+	if (s == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; ++i) {
+		gen_addr(&s[i].addr, gen.ipv6, net, i + 1);
+		gen_addr(&s[i].target, gen.ipv6, 0, 1 + i % 10);
+		s[i].next_port = scanner ? 1 + rand() % 1024 : 0;
+	}
+	return s;
+}
+
+static void generate(void)
+{
+	/* Twice the delay threshold between two probes of a slow scanner */
+	unsigned long long slow_gap = psd_info.delay_threshold * 20000ULL + 1;
+	unsigned long long usec, gap = 1000000 / gen.rate, n;
+	struct gen_source *benign, *scan, *slow, *s;
+	union nf_inet_addr server;
+	static u32 pkt[32];
+	unsigned int i, len;
+	u16 port;
+
+	benign = gen_sources(gen.benign, 1, false);
+	scan   = gen_sources(gen.scanners, 66, true);
+	slow   = gen_sources(gen.slow, 67, true);
+	for (i = 0; i < gen.slow; ++i)
+		slow[i].next_usec = rand() % slow_gap;
+
+	for (n = 0, usec = 0; n < gen.packets; ++n, usec += gap) {
+		for (i = 0; i < gen.slow; ++i) {
+			s = &slow[i];
+			if (s->next_usec > usec)
+				continue;
+			len = gen_packet(pkt, gen.ipv6, &s->addr, &s->target,
+			      IPPROTO_TCP, 40000 + i, s->next_port++, TH_SYN);
+			replay((unsigned char *)pkt, len, usec, SRC_SLOW);
+			s->next_usec = usec + slow_gap;
+		}
+		if (gen.scanners > 0 && rand() % 100 < gen.scan_share) {
+			i = rand() % gen.scanners;
+			s = &scan[i];
+			if (s->next_port > 0xFFFF)
+				s->next_port = 1;
+			len = gen_packet(pkt, gen.ipv6, &s->addr, &s->target,
+			      IPPROTO_TCP, 50000 + i, s->next_port++, TH_SYN);
+			replay((unsigned char *)pkt, len, usec, SRC_SCAN);
+			continue;
+		}
+		if (gen.benign == 0)
+			continue;
+		s = &benign[rand() % gen.benign];
+		gen_addr(&server, gen.ipv6, 0, 1 + rand() % 10);
+		port = benign_ports[rand() % ARRAY_SIZE(benign_ports)];
+		if (port == 53)
+			len = gen_packet(pkt, gen.ipv6, &s->addr, &server,
+			      IPPROTO_UDP, 1024 + rand() % 60000, port, 0);
+		else
+			len = gen_packet(pkt, gen.ipv6, &s->addr, &server,
+			      IPPROTO_TCP, 1024 + rand() % 60000, port,
+			      (rand() % 8 == 0) ? TH_SYN : TH_ACK);
+		replay((unsigned char *)pkt, len, usec, SRC_BENIGN);
+	}
+	free(benign);
+	free(scan);
+	free(slow);
+}
+
+static void print_addr(const struct source *s)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	inet_ntop(s->family == NFPROTO_IPV6 ? AF_INET6 : AF_INET,
+	          &s->addr, buf, sizeof(buf));
+	printf("  %-40s %-12s %lu packets matched\n", buf,
+	       src_kind_names[s->kind], s->matched);
+}
+
+static void report(bool generated, bool verbose, double wall)
+{
+	unsigned int total[SRC_UNKNOWN+1] = {}, found[SRC_UNKNOWN+1] = {};
+	struct seq_file seq = {.fp = stdout, .private = psd_pernet(&init_net)};
+	const struct source *s;
+	unsigned int i;
+
+	for (i = 0; i < sources_size; ++i) {
+		s = &sources[i];
+		if (!s->used)
+			continue;
+		++total[s->kind];
+		if (s->detected)
+			++found[s->kind];
+	}
+
+	printf("packets:     %llu replayed, %llu skipped, %llu matched\n",
+	       stats.packets, stats.skipped, stats.matched);
+	printf("sources:     %u seen\n", sources_used);
+	if (generated) {
+		for (i = SRC_BENIGN; i < SRC_UNKNOWN; ++i)
+			printf("  %-12s %u, %u detected\n", src_kind_names[i],
+			       total[i], found[i]);
+		printf("false pos.:  %u\n", found[SRC_BENIGN]);
+		printf("missed:      %u scanners, %u slow scanners\n",
+		       total[SRC_SCAN] - found[SRC_SCAN],
+		       total[SRC_SLOW] - found[SRC_SLOW]);
+	} else {
+		printf("detected:    %u\n", found[SRC_UNKNOWN]);
+	}
+	if (stats.packets > 0 && stats.match_ns > 0)
+		printf("match:       %.0f packets/s, %.1f ns/packet\n",
+		       stats.packets * 1e9 / stats.match_ns,
+		       (double)stats.match_ns / stats.packets);
+	printf("wall time:   %.3f s\n", wall);
+	if (kshim_lock_timing && kshim_lock_stats.count > 0)
+		printf("lock held:   %llu times, avg %.1f ns, max %llu ns\n",
+		       kshim_lock_stats.count,
+		       (double)kshim_lock_stats.total_ns / kshim_lock_stats.count,
+		       kshim_lock_stats.max_ns);
+	if (psd_info.flags & XT_PSD_NOTIFY)
+		printf("events:      %lu\n", kshim_genl_events);
+	printf("/proc/net/xt_psd:\n");
+	psd_stat_show(&seq, NULL);
+
+	if (!verbose)
+		return;
+	printf("detected sources:\n");
+	for (i = 0; i < sources_size; ++i)
+		if (sources[i].used && sources[i].detected)
+			print_addr(&sources[i]);
+}
+
+static void usage(const char *p)
+{
+	fprintf(stderr,
+"Usage: %s [options] [file.pcap...]\n"
+"Replays the capture files, or generated traffic if none are given,\n"
+"through the xt_psd match.\n\n"
+"Match and module options:\n"
+"  --weight N       --psd-weight-threshold (default %u)\n"
+"  --delay N        --psd-delay-threshold (default %u)\n"
+"  --lo-weight N    --psd-lo-ports-weight (default %u)\n"
+"  --hi-weight N    --psd-hi-ports-weight (default %u)\n"
+"  --ipv6-prefix N  --psd-ipv6-prefix-len\n"
+"  --notify         --psd-notify (events are counted)\n"
+"  --list-size N    list_size module parameter (default %u)\n"
+"  --hash-size N    hash_size module parameter (default %u)\n"
+"Generator options:\n"
+"  -n N             number of packets (default %llu)\n"
+"  -6               generate IPv6 instead of IPv4 traffic\n"
+"  --rate N         packets per second of simulated time (default %u)\n"
+"  --benign N       benign clients (default %u)\n"
+"  --scanners N     scanners (default %u)\n"
+"  --slow N         slow scanners (default %u)\n"
+"  --scan-share N   percentage of packets from scanners (default %u)\n"
+"Other:\n"
+"  -s N             random seed, also for the module's hash key\n"
+"  -t               measure the time the shard locks are held\n"
+"  -v               list the detected sources\n",
+	p, SCAN_WEIGHT_THRESHOLD, SCAN_DELAY_THRESHOLD, PORT_WEIGHT_PRIV,
+	PORT_WEIGHT_HIGH, LIST_SIZE, HASH_SIZE, gen.packets, gen.rate,
+	gen.benign, gen.scanners, gen.slow, gen.scan_share);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	enum {
+		OPT_WEIGHT = 256, OPT_DELAY, OPT_LO, OPT_HI, OPT_PREFIX,
+		OPT_NOTIFY, OPT_LIST, OPT_HASH, OPT_RATE, OPT_BENIGN,
+		OPT_SCANNERS, OPT_SLOW, OPT_SHARE,
+	};
+	static const struct option opts[] = {
+		{"weight",      true,  NULL, OPT_WEIGHT},
+		{"delay",       true,  NULL, OPT_DELAY},
+		{"lo-weight",   true,  NULL, OPT_LO},
+		{"hi-weight",   true,  NULL, OPT_HI},
+		{"ipv6-prefix", true,  NULL, OPT_PREFIX},
+		{"notify",      false, NULL, OPT_NOTIFY},
+		{"list-size",   true,  NULL, OPT_LIST},
+		{"hash-size",   true,  NULL, OPT_HASH},
+		{"rate",        true,  NULL, OPT_RATE},
+		{"benign",      true,  NULL, OPT_BENIGN},
+		{"scanners",    true,  NULL, OPT_SCANNERS},
+		{"slow",        true,  NULL, OPT_SLOW},
+		{"scan-share",  true,  NULL, OPT_SHARE},
+		{NULL},
+	};
+	struct xt_mtchk_param chk = {.net = &init_net, .matchinfo = &psd_info};
+	struct timespec t0, t1;
+	bool verbose = false;
+	int c, i, ret = EXIT_SUCCESS;
+
+	psd_info.weight_threshold = SCAN_WEIGHT_THRESHOLD;
+	psd_info.delay_threshold  = SCAN_DELAY_THRESHOLD;
+	psd_info.lo_ports_weight  = PORT_WEIGHT_PRIV;
+	psd_info.hi_ports_weight  = PORT_WEIGHT_HIGH;
+	srand(1);
+
+	while ((c = getopt_long(argc, argv, "6n:s:tv", opts, NULL)) != -1) {
+		switch (c) {
+		case OPT_WEIGHT:
+			psd_info.weight_threshold = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_DELAY:
+			psd_info.delay_threshold = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_LO:
+			psd_info.lo_ports_weight = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_HI:
+			psd_info.hi_ports_weight = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_PREFIX:
+			psd_info.ipv6_prefix = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_NOTIFY:
+			psd_info.flags |= XT_PSD_NOTIFY;
+			break;
+		case OPT_LIST:
+			list_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_HASH:
+			hash_size = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_RATE:
+			gen.rate = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_BENIGN:
+			gen.benign = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SCANNERS:
+			gen.scanners = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SLOW:
+			gen.slow = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_SHARE:
+			gen.scan_share = strtoul(optarg, NULL, 0);
+			break;
+		case '6':
+			gen.ipv6 = true;
+			break;
+		case 'n':
+			gen.packets = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			srand(strtoul(optarg, NULL, 0));
+			break;
+		case 't':
+			kshim_lock_timing = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	if (gen.rate == 0 || gen.rate > 1000000) {
+		fprintf(stderr, "--rate must be between 1 and 1000000\n");
+		return EXIT_FAILURE;
+	}
+
+	if (xt_psd_init() < 0) {
+		fprintf(stderr, "module initialization failed\n");
+		return EXIT_FAILURE;
+	}
+	if (psd_mt_check(&chk) < 0) {
+		fprintf(stderr, "match parameters rejected by checkentry\n");
+		xt_psd_exit();
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (optind == argc)
+		generate();
+	for (i = optind; i < argc; ++i)
+		if (replay_pcap(argv[i]) < 0)
+			ret = EXIT_FAILURE;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	report(optind == argc, verbose, (kshim_ns(&t1) - kshim_ns(&t0)) / 1e9);
+	xt_psd_exit();
+	free(sources);
+	return ret;
+}